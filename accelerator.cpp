@@ -0,0 +1,58 @@
+// Common interface to the acceleration structures we can cast rays against.
+
+using namespace std;
+#include <assert.h>
+#include "accelerator.h"
+#include "kdtree.h"
+#include "bvh.h"
+
+long long rays_cast = 0;
+long long node_visits = 0;
+
+const vector<string> accelerator_names = {"kdtree", "bvh"};
+
+Accelerator::~Accelerator() {
+}
+
+void Accelerator::ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max) const {
+	assert(count <= RAY_PACKET_SIZE);
+	for (int i = 0; i < count; i++)
+		hits.hit[i] = ray_test(rays[i], hits.hit_parameter[i], hits.hit_u[i], hits.hit_v[i], &hits.hit_triangle[i], t_max != nullptr ? t_max[i] : FLOAT_INF);
+}
+
+void Accelerator::occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const {
+	assert(count <= RAY_PACKET_SIZE);
+	for (int i = 0; i < count; i++)
+		result[i] = occluded(rays[i], t_max[i]);
+}
+
+bool Accelerator::save(SceneCacheWriter& writer) const {
+	return false;
+}
+
+void Accelerator::ray_test_stream(const Ray* rays, int count, RayHit* hits) const {
+	for (int i = 0; i < count; i++)
+		hits[i].hit = ray_test(rays[i], hits[i].hit_parameter, hits[i].hit_u, hits[i].hit_v, &hits[i].hit_triangle);
+}
+
+void Accelerator::occluded_stream(const Ray* rays, const Real* t_max, int count, bool* result) const {
+	for (int i = 0; i < count; i++)
+		result[i] = occluded(rays[i], t_max[i]);
+}
+
+Accelerator* build_accelerator(const string& name, vector<Triangle>* triangles) {
+	if (name == "kdtree")
+		return new kdTree(triangles);
+	if (name == "bvh")
+		return new WideBVH(triangles);
+	return nullptr;
+}
+
+Accelerator* load_accelerator(const string& name, SceneCacheReader& reader, const Triangle* triangles, size_t triangle_count) {
+	if (name == "kdtree")
+		return new kdTree(reader, triangles, triangle_count);
+	if (name == "bvh")
+		return new WideBVH(reader, triangles, triangle_count);
+	return nullptr;
+}
+
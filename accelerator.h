@@ -0,0 +1,127 @@
+// Common interface to the acceleration structures we can cast rays against.
+
+#ifndef _RENDER_ACCELERATOR_H
+#define _RENDER_ACCELERATOR_H
+
+#include <string>
+#include <vector>
+#include "utils.h"
+
+extern long long rays_cast;
+extern long long node_visits;
+
+class SceneCacheWriter;
+class SceneCacheReader;
+
+// An array that an accelerator reads while casting rays. It either holds its own elements, as after a build, or refers to
+// elements held elsewhere, such as in a mapped scene cache, and the code reading it doesn't care which.
+template <typename T>
+class AcceleratorArray {
+	std::vector<T> owned;
+	const T* elements;
+	size_t count;
+
+public:
+	AcceleratorArray() : elements(nullptr), count(0) {}
+	AcceleratorArray(const AcceleratorArray&) = delete;
+	AcceleratorArray& operator=(const AcceleratorArray&) = delete;
+
+	// Gives the array to fill in while building, which the elements then come from once built() is called.
+	std::vector<T>& building() { return owned; }
+	void built() {
+		elements = owned.data();
+		count = owned.size();
+	}
+	// Refers to elements owned elsewhere, which must outlive us.
+	void refer_to(const T* _elements, size_t _count) {
+		owned.clear();
+		elements = _elements;
+		count = _count;
+	}
+
+	inline const T& operator[](size_t index) const { return elements[index]; }
+	inline const T* data() const { return elements; }
+	inline size_t size() const { return count; }
+};
+
+// Coherent rays, such as camera rays through a 4x4 block of neighboring pixels, can be cast together in packets of up to this many.
+#define RAY_PACKET_SIZE 16
+
+// Refitting rebuilds the structure instead once refitting has made its estimated cost of casting a ray this many times what it was when built.
+#define REFIT_REBUILD_THRESHOLD 1.5
+// Refits spread the subtrees below this depth across threads.
+#define PARALLEL_REFIT_DEPTH 6
+
+// What refitting a subtree finds: the bounds of its triangles, and the sum over its nodes of their surface areas weighted by the cost of
+// visiting them, which divided by the area of the whole structure estimates the cost of casting a ray through it.
+struct RefitResult {
+	AABB aabb;
+	Real cost;
+
+	// The surface area of the bounds, which are left inverted if the subtree has no triangles at all.
+	inline Real area() const { return aabb.minima(0) > aabb.maxima(0) ? 0 : aabb.surface_area(); }
+};
+
+// The results of casting a packet of rays, with entry i being what ray_test gives for ray i.
+struct PacketHits {
+	bool hit[RAY_PACKET_SIZE];
+	Real hit_parameter[RAY_PACKET_SIZE];
+	Real hit_u[RAY_PACKET_SIZE], hit_v[RAY_PACKET_SIZE];
+	const Triangle* hit_triangle[RAY_PACKET_SIZE];
+};
+
+// The result of casting one ray of a stream, which is what ray_test gives for it.
+struct RayHit {
+	bool hit;
+	Real hit_parameter;
+	Real hit_u, hit_v;
+	const Triangle* hit_triangle;
+};
+
+class Accelerator {
+public:
+	virtual ~Accelerator();
+	// Finds the closest hit along the ray before a parameter of t_max, if any.
+	virtual bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr, Real t_max=FLOAT_INF) const = 0;
+	// Checks if anything blocks the ray before a parameter of t_max, stopping at the first blocker found rather than finding the closest.
+	// This is all that shadow rays need.
+	virtual bool occluded(const Ray& ray, Real t_max) const = 0;
+	// Casts up to RAY_PACKET_SIZE rays, giving the same results as calling ray_test on each in turn, which is what this does by default.
+	// Each ray is cast up to its entry of t_max, or without limit if t_max is nullptr.
+	// Structures that can walk coherent rays together, sharing each node fetch between them, override it.
+	virtual void ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max=nullptr) const;
+	// Likewise for occluded, with each ray checked up to its own t_max, setting result[i] to whether ray i is blocked.
+	virtual void occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const;
+	// Casts any number of rays, however incoherent, giving the same closest hit parameters as calling ray_test on each in turn, which
+	// is what this does by default. (When several triangles tie for the closest hit, a different one of them may be reported.)
+	// Structures that can walk a large batch of rays together, fetching each node once for every ray that reaches it, override it.
+	virtual void ray_test_stream(const Ray* rays, int count, RayHit* hits) const;
+	// Likewise for occluded, as occluded_packet is, for any number of rays.
+	virtual void occluded_stream(const Ray* rays, const Real* t_max, int count, bool* result) const;
+	// Brings the structure up to date after the vertices of the triangles it was built over have moved. The triangles must still be the
+	// same ones, in the same order as the structure left them in, and only their positions (and normals) may have changed.
+	// Rather than building from scratch, this refits the bounds of the existing nodes to the moved triangles, unless that has degraded
+	// the structure past REFIT_REBUILD_THRESHOLD, in which case it rebuilds it. Returns true if it rebuilt.
+	// Rebuilding may reorder the triangles again, and if order is given then it's permuted the same way, for callers to keep other
+	// per-triangle data in step. Only structures that were built, rather than loaded from a scene cache, can be refit.
+	virtual bool refit(std::vector<int>* order=nullptr) = 0;
+	// Prints the node count and the memory used by the structure and the triangles it refers to.
+	virtual void print_stats() const = 0;
+	// Writes out everything needed to cast rays, for loading back with load_accelerator, returning false if the structure can't be
+	// cached, which is what this does by default, writing nothing.
+	virtual bool save(SceneCacheWriter& writer) const;
+};
+
+// The names accepted by build_accelerator, with the default first.
+extern const std::vector<std::string> accelerator_names;
+
+// Builds the named acceleration structure over the given triangles, returning nullptr if the name isn't recognized.
+// NB: Some structures reorder the triangles, so only build one structure over a given array at a time.
+Accelerator* build_accelerator(const std::string& name, std::vector<Triangle>* triangles);
+
+// Loads the named acceleration structure as written by its save(), referring to the triangles (in the order they were in when
+// it was saved) and the reader's memory rather than copying them. Returns nullptr if the name isn't recognized.
+Accelerator* load_accelerator(const std::string& name, SceneCacheReader& reader, const Triangle* triangles, size_t triangle_count);
+
+#endif
+
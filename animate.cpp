@@ -2,13 +2,19 @@
 
 using namespace std;
 #include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include <iostream>
 #include "integrator.h"
 #include "visualizer.h"
 
 int main(int argc, char** argv) {
-	// Load up an STL file.
-	auto scene = new Scene(argv[1]);
+	// Load up an STL file, using the scene cache directory given after it, if any.
+	auto scene = new Scene(argv[1], accelerator_names[0], argc > 2 ? argv[2] : "");
+	// If a wobble amplitude is given after that, the mesh ripples from frame to frame. Give an empty cache directory with it, as meshes
+	// loaded from a cache can't be deformed.
+	Real wobble = argc > 3 ? atof(argv[3]) : 0.0;
+	Real extent = (scene->meshes[0].bounds.maxima - scene->meshes[0].bounds.minima).norm();
 	// Make a light.
 	scene->lights->push_back(Light({Vec(0, 0, 3), 9.0 * Vec(0.8, 0.5, 0.25)}));
 	scene->lights->push_back(Light({Vec(-2, 2, 4), 9.0 * Vec(0.25, 0.8, 0.25)}));
@@ -32,6 +38,18 @@ int main(int argc, char** argv) {
 		scene->main_camera.direction.normalize();
 		scene->main_camera.origin += Vec(0.0, 0.0, 0.2);
 		scene->plane_of_focus_distance = 3.5 + frame / 33.0;
+		if (wobble != 0.0) {
+			Real phase = frame * 0.2;
+			struct timeval start, stop, elapsed;
+			gettimeofday(&start, NULL);
+			bool rebuilt = scene->deform_mesh(0, [=](const Vec& p) {
+				return Vec(p + wobble * extent * sin(phase + 8.0 * p(2) / extent) * Vec(1, 0, 0));
+			});
+			gettimeofday(&stop, NULL);
+			timersub(&stop, &start, &elapsed);
+			cout << "Frame " << frame << (rebuilt ? ": rebuilt the mesh in " : ": refit the mesh in ")
+				<< (elapsed.tv_sec * 1e3 + elapsed.tv_usec * 1e-3) << " ms" << endl;
+		}
 
 		auto display = new ProgressBar(engine);
 //		display->init();
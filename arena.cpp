@@ -0,0 +1,37 @@
+// Bump allocation for data that all dies at once.
+
+using namespace std;
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+#include "arena.h"
+
+BumpArena::BumpArena(size_t block_size) : next(nullptr), end(nullptr), block_size(block_size), used(0) {
+}
+
+BumpArena::~BumpArena() {
+	for (char* block : blocks)
+		delete[] block;
+}
+
+void* BumpArena::allocate(size_t bytes, size_t alignment) {
+	assert(alignment > 0 and (alignment & (alignment - 1)) == 0);
+	char* start = (char*)(((uintptr_t)next + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	if (next == nullptr or start + bytes > end) {
+		// Start a new block, big enough for this allocation even if it's bigger than usual.
+		// Whatever was left of the last block is simply wasted, which is less than the size of this allocation.
+		size_t size = max(block_size, bytes + alignment);
+		char* block = new char[size];
+		blocks.push_back(block);
+		end = block + size;
+		start = (char*)(((uintptr_t)block + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	}
+	next = start + bytes;
+	used += bytes;
+	return start;
+}
+
+size_t BumpArena::bytes_used() const {
+	return used;
+}
+
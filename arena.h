@@ -0,0 +1,37 @@
+// Bump allocation for data that all dies at once.
+
+#ifndef _RENDER_ARENA_H
+#define _RENDER_ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Hands out memory by bumping a pointer through big blocks, and frees all of it at once when destroyed.
+// Nothing that is created in an arena gets its destructor called, so only trivially destructible types belong in one.
+// Arenas aren't thread safe, so parallel code gives each thread its own.
+class BumpArena {
+	std::vector<char*> blocks;
+	char* next;
+	char* end;
+	size_t block_size;
+	size_t used;
+
+public:
+	BumpArena(size_t block_size=1 << 20);
+	~BumpArena();
+	BumpArena(const BumpArena&) = delete;
+	BumpArena& operator=(const BumpArena&) = delete;
+	void* allocate(size_t bytes, size_t alignment);
+	// The total of all the allocations so far.
+	size_t bytes_used() const;
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+};
+
+#endif
+
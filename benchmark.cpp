@@ -0,0 +1,257 @@
+// Acceleration structure benchmark.
+
+using namespace std;
+#include <math.h>
+#include <sys/time.h>
+#include <time.h>
+#include <iostream>
+#include <string>
+#include <functional>
+#include "integrator.h"
+#include "stlreader.h"
+
+#define BENCHMARK_RUNS 5
+// Streams are cast in batches of this many rays.
+#define STREAM_BATCH_SIZE 4096
+
+static double seconds_since(const struct timeval& start) {
+	struct timeval stop, result;
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &result);
+	return result.tv_sec + result.tv_usec * 1e-6;
+}
+
+// Pushes out a point on the unit sphere to give the benchmark blob some lumps.
+static Vec displace(Vec p) {
+	p.normalize();
+	Real bump = 0.15 * sin(5 * p(0)) * sin(7 * p(1)) * sin(3 * p(2)) + 0.05 * sin(23 * p(0) + 17 * p(2));
+	return (1 + bump) * p;
+}
+
+static void subdivide(Vec a, Vec b, Vec c, int levels, vector<Triangle>* out) {
+	if (levels == 0) {
+		out->push_back(Triangle(displace(a), displace(b), displace(c)));
+		return;
+	}
+	// NB: Midpoints are computed symmetrically, so both triangles sharing an edge get bit-identical vertices, which compute_barycentric_normals requires.
+	Vec ab = (a + b).normalized(), bc = (b + c).normalized(), ca = (c + a).normalized();
+	subdivide(a, ab, ca, levels - 1, out);
+	subdivide(ab, b, bc, levels - 1, out);
+	subdivide(ca, bc, c, levels - 1, out);
+	subdivide(ab, bc, ca, levels - 1, out);
+}
+
+// Builds a lumpy subdivided icosahedron sitting on a ground plane, standing in for a high polygon model when no STL is given.
+// Each level of subdivision quadruples the triangle count: 7 levels gives 327,680 triangles on the blob.
+vector<Triangle>* make_benchmark_mesh(int subdivisions) {
+	const Real g = (1 + sqrt(5.0)) / 2;
+	Vec v[12] = {
+		Vec(-1,  g,  0), Vec( 1,  g,  0), Vec(-1, -g,  0), Vec( 1, -g,  0),
+		Vec( 0, -1,  g), Vec( 0,  1,  g), Vec( 0, -1, -g), Vec( 0,  1, -g),
+		Vec( g,  0, -1), Vec( g,  0,  1), Vec(-g,  0, -1), Vec(-g,  0,  1),
+	};
+	int faces[20][3] = {
+		{0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11},
+		{1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+		{3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9},
+		{4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1},
+	};
+	auto tris = new vector<Triangle>();
+	for (auto& face : faces)
+		subdivide(v[face[0]].normalized(), v[face[1]].normalized(), v[face[2]].normalized(), subdivisions, tris);
+	// Add a big ground plane made of two long triangles.
+	Real z = -1.3, s = 20.0;
+	tris->push_back(Triangle(Vec(-s, -s, z), Vec(s, -s, z), Vec(s, s, z)));
+	tris->push_back(Triangle(Vec(-s, -s, z), Vec(s, s, z), Vec(-s, s, z)));
+	compute_barycentric_normals(tris);
+	return tris;
+}
+
+// Traces every ray in the list, and returns the number of hits.
+static int trace_all(Accelerator* tree, const vector<Ray>& rays, vector<Vec>* hit_points=nullptr) {
+	int hits = 0;
+	for (auto& ray : rays) {
+		Real param, u, v;
+		if (tree->ray_test(ray, param, u, v)) {
+			hits++;
+			if (hit_points != nullptr)
+				hit_points->push_back(ray.origin + param * ray.direction);
+		}
+	}
+	return hits;
+}
+
+// We time tracing by CPU time rather than wall time, as the tracing is single threaded and this is much less noisy on a busy machine.
+static double cpu_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Casts every shadow ray, stopping each one at the matching distance, and returns the number that were blocked.
+static int occlude_all(Accelerator* tree, const vector<Ray>& rays, const vector<Real>& distances) {
+	int blocked = 0;
+	for (unsigned int i = 0; i < rays.size(); i++)
+		blocked += tree->occluded(rays[i], distances[i]);
+	return blocked;
+}
+
+// Traces the rays in consecutive packets of RAY_PACKET_SIZE, and returns the number of hits.
+static int trace_packets(Accelerator* tree, const vector<Ray>& rays) {
+	int hits = 0;
+	PacketHits packet_hits;
+	for (unsigned int i = 0; i < rays.size(); i += RAY_PACKET_SIZE) {
+		int count = min<int>(RAY_PACKET_SIZE, rays.size() - i);
+		tree->ray_test_packet(&rays[i], count, packet_hits);
+		for (int j = 0; j < count; j++)
+			hits += packet_hits.hit[j];
+	}
+	return hits;
+}
+
+// Likewise casts the shadow rays in consecutive packets, and returns the number that were blocked.
+static int occlude_packets(Accelerator* tree, const vector<Ray>& rays, const vector<Real>& distances) {
+	int blocked = 0;
+	bool result[RAY_PACKET_SIZE];
+	for (unsigned int i = 0; i < rays.size(); i += RAY_PACKET_SIZE) {
+		int count = min<int>(RAY_PACKET_SIZE, rays.size() - i);
+		tree->occluded_packet(&rays[i], &distances[i], count, result);
+		for (int j = 0; j < count; j++)
+			blocked += result[j];
+	}
+	return blocked;
+}
+
+// Traces the rays in consecutive batches of STREAM_BATCH_SIZE, and returns the number of hits.
+static int trace_streams(Accelerator* tree, const vector<Ray>& rays) {
+	int hits = 0;
+	vector<RayHit> stream_hits(STREAM_BATCH_SIZE);
+	for (unsigned int i = 0; i < rays.size(); i += STREAM_BATCH_SIZE) {
+		int count = min<int>(STREAM_BATCH_SIZE, rays.size() - i);
+		tree->ray_test_stream(&rays[i], count, stream_hits.data());
+		for (int j = 0; j < count; j++)
+			hits += stream_hits[j].hit;
+	}
+	return hits;
+}
+
+// Likewise casts the shadow rays in consecutive batches, and returns the number that were blocked.
+static int occlude_streams(Accelerator* tree, const vector<Ray>& rays, const vector<Real>& distances) {
+	int blocked = 0;
+	bool result[STREAM_BATCH_SIZE];
+	for (unsigned int i = 0; i < rays.size(); i += STREAM_BATCH_SIZE) {
+		int count = min<int>(STREAM_BATCH_SIZE, rays.size() - i);
+		tree->occluded_stream(&rays[i], &distances[i], count, result);
+		for (int j = 0; j < count; j++)
+			blocked += result[j];
+	}
+	return blocked;
+}
+
+// Times the given function, which casts ray_count rays and returns how many hit, taking the best of a few runs to cut down on noise from the rest of the system.
+static void report(string name, int ray_count, function<int()> cast) {
+	double best_elapsed = FLOAT_INF;
+	int hits;
+	for (int run = 0; run < BENCHMARK_RUNS; run++) {
+		triangle_tests = node_visits = 0;
+		double start = cpu_seconds();
+		hits = cast();
+		best_elapsed = min(best_elapsed, cpu_seconds() - start);
+	}
+	cout << name << ": " << ray_count << " rays, " << hits << " hits, " << ray_count / best_elapsed * 1e-6 << " Mrays/s";
+	if (node_visits != 0)
+		cout << ", " << node_visits / (double) ray_count << " nodes and " << triangle_tests / (double) ray_count << " triangles tested per ray";
+	cout << endl;
+}
+
+// Usage: benchmark [input.stl | subdivision levels] [accelerator]
+int main(int argc, char** argv) {
+	vector<Triangle>* mesh;
+	if (argc > 1 and isdigit(argv[1][0]))
+		mesh = make_benchmark_mesh(atoi(argv[1]));
+	else if (argc > 1)
+		mesh = read_stl(argv[1]);
+	else
+		mesh = make_benchmark_mesh(7);
+	if (mesh == nullptr) {
+		cout << "Couldn't read input file." << endl;
+		return 1;
+	}
+	cout << "Triangles: " << mesh->size() << endl;
+	string accelerator_name = argc > 2 ? argv[2] : accelerator_names[0];
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	auto tree = build_accelerator(accelerator_name, mesh);
+	if (tree == nullptr) {
+		cout << "Unknown accelerator: " << accelerator_name << endl;
+		return 1;
+	}
+	cout << "Build time: " << seconds_since(start) << " s" << endl;
+	tree->print_stats();
+
+	// Generate camera rays with the same framing as the example renders.
+	int width = 640, height = 360;
+	Real angle = 20 * 0.05;
+	Ray camera(-5 * Vec(cos(angle), sin(angle), 0.0), Vec(cos(angle), sin(angle), 0.0));
+	camera.origin += Vec(0.0, 0.0, 0.2);
+	Vec camera_right = camera.direction.cross(Vec(0, 0, 1)).normalized();
+	Vec camera_up = camera_right.cross(camera.direction).normalized();
+	Real image_plane_width = 0.75;
+	// As in the integrator the rays go in 4x4 tiles of pixels, so each packet of 16 consecutive rays covers one tile.
+	vector<Ray> primary_rays;
+	for (int tile_y = 0; tile_y < height; tile_y += 4) {
+		for (int tile_x = 0; tile_x < width; tile_x += 4) {
+			for (int y = tile_y; y < tile_y + 4; y++) {
+				for (int x = tile_x; x < tile_x + 4; x++) {
+					Real dx = image_plane_width * (x - width / 2.0) / width;
+					Real dy = -image_plane_width * (y - height / 2.0) / width;
+					primary_rays.push_back(Ray(camera.origin, camera.direction + dx * camera_right + dy * camera_up));
+				}
+			}
+		}
+	}
+
+	// Generate incoherent secondary rays leaving the primary hits in random directions.
+	vector<Vec> hit_points;
+	trace_all(tree, primary_rays, &hit_points);
+	Sampler sampler(1234);
+	vector<Ray> secondary_rays;
+	for (auto& p : hit_points) {
+		Vec direction = sampler.unit_sphere();
+		secondary_rays.push_back(Ray(p + 1e-3 * direction, direction));
+	}
+
+	// Generate shadow rays from the primary hits to the key light used in the example renders.
+	Vec light_position(0, 0, 3);
+	vector<Ray> shadow_rays;
+	vector<Real> light_distances;
+	for (auto& p : hit_points) {
+		Vec to_light = light_position - p;
+		shadow_rays.push_back(Ray(p + 1e-3 * to_light.normalized(), to_light));
+		light_distances.push_back(to_light.norm());
+	}
+
+	report("Primary rays", primary_rays.size(), [&]() { return trace_all(tree, primary_rays); });
+	report("Secondary rays", secondary_rays.size(), [&]() { return trace_all(tree, secondary_rays); });
+	report("Shadow rays", shadow_rays.size(), [&]() { return occlude_all(tree, shadow_rays, light_distances); });
+	// The shadow rays of neighboring primary hits are neighbors in their list too, so their packets are about as coherent as the integrator's.
+	report("Primary packets", primary_rays.size(), [&]() { return trace_packets(tree, primary_rays); });
+	report("Shadow packets", shadow_rays.size(), [&]() { return occlude_packets(tree, shadow_rays, light_distances); });
+	// With TRAVERSAL_STATS, the nodes per ray for packets and streams count each node fetched once for all the rays that reach it.
+	report("Secondary streams", secondary_rays.size(), [&]() { return trace_streams(tree, secondary_rays); });
+	report("Shadow streams", shadow_rays.size(), [&]() { return occlude_streams(tree, shadow_rays, light_distances); });
+
+	// Refitting a mesh that hasn't moved leaves the structure no worse than it was built, so it must never decide to rebuild.
+	// (This goes last, as refitting the BVH loosens the boxes that spatial splits clipped, which would skew the timings above.)
+	gettimeofday(&start, NULL);
+	bool rebuilt = tree->refit();
+	cout << "Refit time: " << seconds_since(start) << " s" << endl;
+	if (rebuilt) {
+		cout << "Refitting the unmoved mesh rebuilt the accelerator!" << endl;
+		return 1;
+	}
+
+	delete tree;
+	delete mesh;
+}
@@ -0,0 +1,816 @@
+// Wide bounding volume hierarchy for ray casting.
+
+using namespace std;
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include "bvh.h"
+#include "scenecache.h"
+#include "scheduler.h"
+#if defined(__SSE__) and not defined(DOUBLE_PRECISION)
+#include <immintrin.h>
+#define SIMD_BVH_CHILDREN
+#endif
+
+// Clusters of at most this many triangles become leaves.
+#ifdef LEAF_BLOCK_WIDTH
+#define BVH_LEAF_SIZE LEAF_BLOCK_WIDTH
+#else
+#define BVH_LEAF_SIZE 4
+#endif
+#define BVH_SAH_BINS 32
+// The relative costs of testing a node's boxes and a leaf's triangles (or its blocks, with SIMD_LEAVES), with which refits estimate how
+// far they've degraded the BVH.
+#define BVH_NODE_COST 1.0
+#ifdef LEAF_BLOCK_WIDTH
+#define BVH_LEAF_COST(count) (2.0 * (((count) + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH))
+#else
+#define BVH_LEAF_COST(count) (2.0 * (count))
+#endif
+// Spatial splits may make up to this fraction of the triangle count in duplicate references, as a budget on the memory they cost.
+#define BVH_SPLIT_BUDGET 0.3
+// We only look for a spatial split where the children of the best split by centroids overlap by at least this fraction of the root's
+// surface area, as elsewhere the split by centroids is already about as good, and the search costs a lot more.
+#define BVH_SPATIAL_SPLIT_OVERLAP 1e-5
+// Triangles that spatial splits left in more than one leaf have this bit set in the leaves' indices of them.
+#define BVH_SHARED_TRIANGLE 0x80000000u
+// With BVH_MAILBOX, rays remember this many of the shared triangles they've tested.
+#define BVH_MAILBOX_SIZE 8
+// Past this depth we stop trusting the SAH and split clusters at their median, which bounds how much deeper the tree can get.
+#define BVH_MAXIMUM_DEPTH 48
+// Every node visited pushes at most BVH_WIDTH - 1 more entries than it pops, so this comfortably covers the depth of the tree.
+#define BVH_STACK_SIZE 256
+
+WideBVHNode::WideBVHNode() {
+	AABB unused[BVH_WIDTH];
+	set_bounds(unused);
+	for (int slot = 0; slot < BVH_WIDTH; slot++) {
+		child[slot] = 0;
+		triangle_count[slot] = 0;
+	}
+}
+
+#ifdef QUANTIZED_BVH
+void WideBVHNode::set_bounds(const AABB* children) {
+	AABB all;
+	for (int slot = 0; slot < BVH_WIDTH; slot++)
+		all.update(children[slot]);
+	for (int axis = 0; axis < 3; axis++) {
+		// With no children at all any grid will do.
+		Real extent = all.maxima(axis) - all.minima(axis);
+		origin[axis] = extent >= 0 ? all.minima(axis) : 0.0;
+		// The grid overshoots the node's box a little, so that rounding in the decoding can't leave the top of the box off the grid.
+		// A flat box gets a grid of unit steps, so that an unused slot's inverted bounds (below) still decode to an inverted box.
+		scale[axis] = extent > 0 ? extent * (1 + 1e-5) / QUANTIZED_BOUND_MAXIMUM : 1.0;
+		for (int slot = 0; slot < BVH_WIDTH; slot++) {
+			const AABB& child = children[slot];
+			if (child.minima(axis) > child.maxima(axis)) {
+				lower[axis][slot] = QUANTIZED_BOUND_MAXIMUM;
+				upper[axis][slot] = 0;
+				continue;
+			}
+			// Round outwards, and then make sure the decoded bounds (computed just as traversal does) really do contain the child.
+			int low = max(0, min(QUANTIZED_BOUND_MAXIMUM, (int)floor((child.minima(axis) - origin[axis]) / scale[axis])));
+			int high = max(0, min(QUANTIZED_BOUND_MAXIMUM, (int)ceil((child.maxima(axis) - origin[axis]) / scale[axis])));
+			while (low > 0 and origin[axis] + low * scale[axis] > child.minima(axis))
+				low--;
+			while (high < QUANTIZED_BOUND_MAXIMUM and origin[axis] + high * scale[axis] < child.maxima(axis))
+				high++;
+			assert(origin[axis] + low * scale[axis] <= child.minima(axis) and origin[axis] + high * scale[axis] >= child.maxima(axis));
+			lower[axis][slot] = low;
+			upper[axis][slot] = high;
+		}
+	}
+}
+
+AABB WideBVHNode::bounds(int slot) const {
+	AABB result;
+	for (int axis = 0; axis < 3; axis++) {
+		result.minima(axis) = origin[axis] + lower[axis][slot] * scale[axis];
+		result.maxima(axis) = origin[axis] + upper[axis][slot] * scale[axis];
+	}
+	return result;
+}
+#else
+void WideBVHNode::set_bounds(const AABB* children) {
+	for (int slot = 0; slot < BVH_WIDTH; slot++) {
+		for (int axis = 0; axis < 3; axis++) {
+			minima[axis][slot] = children[slot].minima(axis);
+			maxima[axis][slot] = children[slot].maxima(axis);
+		}
+	}
+}
+
+AABB WideBVHNode::bounds(int slot) const {
+	AABB result;
+	for (int axis = 0; axis < 3; axis++) {
+		result.minima(axis) = minima[axis][slot];
+		result.maxima(axis) = maxima[axis][slot];
+	}
+	return result;
+}
+#endif
+
+WideBVH::WideBVH(vector<Triangle>* _all_triangles) : all_triangles(_all_triangles) {
+	build();
+}
+
+void WideBVH::build() {
+	// Throw away whatever we built last time, if anything.
+	nodes.building().clear();
+#ifdef LEAF_BLOCK_WIDTH
+	blocks.building().clear();
+#else
+	records.building().clear();
+	record_triangles.building().clear();
+#endif
+	deepest_depth = leaf_count = duplicate_count = 0;
+	vector<BVHReference> references(all_triangles->size());
+	AABB root_bounds;
+	for (unsigned int i = 0; i < all_triangles->size(); i++) {
+		references[i].triangle = i;
+		references[i].bounds = (*all_triangles)[i].aabb;
+		references[i].shared = false;
+		root_bounds.update(references[i].bounds);
+	}
+	root_area = root_bounds.surface_area();
+	split_budget = (long long)(BVH_SPLIT_BUDGET * all_triangles->size());
+	build_node(references, 0);
+	triangles.refer_to(all_triangles->data(), all_triangles->size());
+	nodes.built();
+#ifdef LEAF_BLOCK_WIDTH
+	blocks.built();
+#else
+	records.built();
+	record_triangles.built();
+#endif
+	// Measure the BVH as built, for refits to compare against. Refits bound every triangle whole, so the baseline must too, or else
+	// a refit that moved nothing would look worse than the clipped boxes that spatial splits left and trigger a rebuild. We measure
+	// without storing those boxes, so the BVH keeps its clipped boxes until it's actually refit.
+	build_cost = refit_nodes(nullptr, false);
+}
+
+bool WideBVH::refit(vector<int>* order) {
+	assert(all_triangles != nullptr and all_triangles->size() == triangles.size());
+	Real cost;
+#ifdef THREADED_KD_BUILD
+	TaskScheduler scheduler(get_optimal_thread_count());
+	scheduler.run([&]() { cost = refit_nodes(&scheduler, true); });
+#else
+	cost = refit_nodes(nullptr, true);
+#endif
+	if (cost <= REFIT_REBUILD_THRESHOLD * build_cost)
+		return false;
+	// The BVH never reorders the triangles, so there's nothing to do to order.
+	build();
+	return true;
+}
+
+Real WideBVH::refit_nodes(TaskScheduler* scheduler, bool refit_boxes) {
+	RefitResult root = refit_node(0, scheduler, 0, refit_boxes);
+	return root.cost / root.area();
+}
+
+RefitResult WideBVH::refit_node(uint32_t index, TaskScheduler* scheduler, int depth, bool refit_boxes) {
+	// Working up from the leaves gives every child's tight box, which is all a node stores, so the BVH stays valid however the triangles move.
+	// Triangles shared between leaves are bounded whole in each, which is looser than the spatial splits clipped them to, but still valid.
+	WideBVHNode& node = nodes.building()[index];
+	RefitResult children[BVH_WIDTH];
+	auto refit_child = [&](int slot) {
+		RefitResult& child = children[slot];
+		int count = node.triangle_count[slot];
+		// Unused slots look like interior children pointing at the root, which is never anyone's child.
+		if (count == 0 and node.child[slot] == 0) {
+			child.cost = 0;
+			return;
+		}
+		if (count == 0) {
+			child = refit_node(node.child[slot], scheduler, depth + 1, refit_boxes);
+			child.cost += child.area() * BVH_NODE_COST;
+			return;
+		}
+#ifdef LEAF_BLOCK_WIDTH
+		vector<TriangleBlock>& flat_blocks = blocks.building();
+		for (int i = 0; i < count; i++) {
+			TriangleBlock& block = flat_blocks[node.child[slot] + i / LEAF_BLOCK_WIDTH];
+			uint32_t triangle_index = block.triangle_index[i % LEAF_BLOCK_WIDTH];
+			const Triangle& triangle = (*all_triangles)[triangle_index & ~BVH_SHARED_TRIANGLE];
+			if (refit_boxes)
+				block.set_lane(i % LEAF_BLOCK_WIDTH, triangle.intersection_record(), triangle_index);
+			child.aabb.update(triangle.aabb);
+		}
+#else
+		vector<IntersectionRecord>& flat_records = records.building();
+		for (uint32_t i = node.child[slot]; i < node.child[slot] + count; i++) {
+			const Triangle& triangle = (*all_triangles)[record_triangles[i] & ~BVH_SHARED_TRIANGLE];
+			if (refit_boxes)
+				flat_records[i] = triangle.intersection_record();
+			child.aabb.update(triangle.aabb);
+		}
+#endif
+		child.cost = child.area() * BVH_LEAF_COST(count);
+	};
+	if (scheduler != nullptr and depth < PARALLEL_REFIT_DEPTH)
+		scheduler->parallel_for(0, BVH_WIDTH, BVH_WIDTH, [&](int slot, int, int) { refit_child(slot); });
+	else
+		for (int slot = 0; slot < BVH_WIDTH; slot++)
+			refit_child(slot);
+	RefitResult result;
+	result.cost = 0;
+	AABB boxes[BVH_WIDTH];
+	for (int slot = 0; slot < BVH_WIDTH; slot++) {
+		// Unused slots keep their inverted boxes, which no ray can hit.
+		boxes[slot] = children[slot].aabb;
+		result.aabb.update(children[slot].aabb);
+		result.cost += children[slot].cost;
+	}
+	if (refit_boxes)
+		node.set_bounds(boxes);
+	return result;
+}
+
+WideBVH::WideBVH(SceneCacheReader& reader, const Triangle* _triangles, size_t triangle_count) : all_triangles(nullptr) {
+	triangles.refer_to(_triangles, triangle_count);
+	reader.read_array(nodes);
+#ifdef LEAF_BLOCK_WIDTH
+	reader.read_array(blocks);
+#else
+	reader.read_array(records);
+	reader.read_array(record_triangles);
+#endif
+	reader.read_value(deepest_depth);
+	reader.read_value(leaf_count);
+	reader.read_value(duplicate_count);
+	build_cost = 0;
+}
+
+WideBVH::~WideBVH() {
+}
+
+bool WideBVH::save(SceneCacheWriter& writer) const {
+	writer.write_array(nodes);
+#ifdef LEAF_BLOCK_WIDTH
+	writer.write_array(blocks);
+#else
+	writer.write_array(records);
+	writer.write_array(record_triangles);
+#endif
+	writer.write_value(deepest_depth);
+	writer.write_value(leaf_count);
+	writer.write_value(duplicate_count);
+	return true;
+}
+
+static inline bool is_empty_box(const AABB& aabb) {
+	return (aabb.minima.array() > aabb.maxima.array()).any();
+}
+
+static inline Vec centroid(const BVHReference& reference) {
+	return 0.5 * (reference.bounds.minima + reference.bounds.maxima);
+}
+
+void WideBVH::split(const vector<BVHReference>& references, vector<BVHReference>& low, vector<BVHReference>& high, int depth) {
+	int count = references.size();
+	AABB bounds, centroid_bounds;
+	for (const BVHReference& reference : references) {
+		bounds.update(reference.bounds);
+		centroid_bounds.update(centroid(reference));
+	}
+	// Find the best split by a binned Surface Area Heuristic over the references' centroids.
+	// The references' counts on each side are weighted by the surface areas of the boxes bounding them.
+	Real best_score = FLOAT_INF, best_height = 0.0;
+	int best_axis = -1;
+	AABB best_low_bounds, best_high_bounds;
+	for (int axis = 0; axis < 3 and depth < BVH_MAXIMUM_DEPTH; axis++) {
+		Real low_edge = centroid_bounds.minima(axis);
+		Real extent = centroid_bounds.maxima(axis) - low_edge;
+		if (extent <= 0)
+			continue;
+		Real bin_scale = BVH_SAH_BINS / extent;
+		int bin_counts[BVH_SAH_BINS] = {0};
+		AABB bin_bounds[BVH_SAH_BINS];
+		for (const BVHReference& reference : references) {
+			int bin = min(BVH_SAH_BINS - 1, (int)((centroid(reference)(axis) - low_edge) * bin_scale));
+			bin_counts[bin]++;
+			bin_bounds[bin].update(reference.bounds);
+		}
+		AABB high_bounds[BVH_SAH_BINS];
+		int high_counts[BVH_SAH_BINS];
+		AABB accumulated;
+		int accumulated_count = 0;
+		for (int bin = BVH_SAH_BINS - 1; bin > 0; bin--) {
+			accumulated.update(bin_bounds[bin]);
+			accumulated_count += bin_counts[bin];
+			high_bounds[bin] = accumulated;
+			high_counts[bin] = accumulated_count;
+		}
+		accumulated = AABB();
+		accumulated_count = 0;
+		for (int bin = 0; bin < BVH_SAH_BINS - 1; bin++) {
+			accumulated.update(bin_bounds[bin]);
+			accumulated_count += bin_counts[bin];
+			if (accumulated_count == 0 or accumulated_count == count)
+				continue;
+			Real score = accumulated.surface_area() * accumulated_count + high_bounds[bin+1].surface_area() * high_counts[bin+1];
+			if (score < best_score) {
+				best_score = score;
+				best_axis = axis;
+				best_height = low_edge + (bin + 1) / bin_scale;
+				best_low_bounds = accumulated;
+				best_high_bounds = high_bounds[bin+1];
+			}
+		}
+	}
+	// Long thin triangles, say, can leave the best split by centroids with children that overlap a lot, which every ray through the
+	// overlap pays for twice. There a spatial split can do better: it splits space rather than the references, clipping each reference
+	// that straddles it into one on each side. We bin the references by their extents, clipping each to every bin it passes through,
+	// and then a reference counts on the low side of a split if it enters any bin below it, and on the high side if it exits any above it.
+	AABB overlap;
+	for (int axis = 0; axis < 3; axis++) {
+		overlap.minima(axis) = max(best_low_bounds.minima(axis), best_high_bounds.minima(axis));
+		overlap.maxima(axis) = min(best_low_bounds.maxima(axis), best_high_bounds.maxima(axis));
+	}
+	int spatial_axis = -1;
+	Real spatial_height = 0.0;
+	if (best_axis != -1 and split_budget > 0 and not is_empty_box(overlap) and overlap.surface_area() > BVH_SPATIAL_SPLIT_OVERLAP * root_area) {
+		for (int axis = 0; axis < 3; axis++) {
+			Real low_edge = bounds.minima(axis);
+			Real extent = bounds.maxima(axis) - low_edge;
+			if (extent <= 0)
+				continue;
+			Real bin_scale = BVH_SAH_BINS / extent;
+			int entries[BVH_SAH_BINS] = {0}, exits[BVH_SAH_BINS] = {0};
+			AABB bin_bounds[BVH_SAH_BINS];
+			for (const BVHReference& reference : references) {
+				int first = min(BVH_SAH_BINS - 1, (int)((reference.bounds.minima(axis) - low_edge) * bin_scale));
+				int last = min(BVH_SAH_BINS - 1, (int)((reference.bounds.maxima(axis) - low_edge) * bin_scale));
+				entries[first]++;
+				exits[last]++;
+				if (first == last) {
+					bin_bounds[first].update(reference.bounds);
+					continue;
+				}
+				const Triangle& triangle = (*all_triangles)[reference.triangle];
+				for (int bin = first; bin <= last; bin++) {
+					AABB slab = reference.bounds;
+					if (bin > first)
+						slab.minima(axis) = low_edge + bin / bin_scale;
+					if (bin < last)
+						slab.maxima(axis) = low_edge + (bin + 1) / bin_scale;
+					bin_bounds[bin].update(triangle.clipped_bounds(slab));
+				}
+			}
+			AABB high_bounds[BVH_SAH_BINS];
+			int high_counts[BVH_SAH_BINS];
+			AABB accumulated;
+			int accumulated_count = 0;
+			for (int bin = BVH_SAH_BINS - 1; bin > 0; bin--) {
+				accumulated.update(bin_bounds[bin]);
+				accumulated_count += exits[bin];
+				high_bounds[bin] = accumulated;
+				high_counts[bin] = accumulated_count;
+			}
+			accumulated = AABB();
+			accumulated_count = 0;
+			for (int bin = 0; bin < BVH_SAH_BINS - 1; bin++) {
+				accumulated.update(bin_bounds[bin]);
+				accumulated_count += entries[bin];
+				// Both sides must shrink, or else we could go on splitting forever, and the duplicates must fit in the budget.
+				int low_count = accumulated_count, high_count = high_counts[bin+1];
+				if (low_count == 0 or high_count == 0 or low_count == count or high_count == count or low_count + high_count - count > split_budget)
+					continue;
+				Real score = accumulated.surface_area() * low_count + high_bounds[bin+1].surface_area() * high_count;
+				if (score < best_score) {
+					best_score = score;
+					spatial_axis = axis;
+					spatial_height = low_edge + (bin + 1) / bin_scale;
+				}
+			}
+		}
+	}
+	if (spatial_axis != -1) {
+		int duplicates = 0;
+		for (const BVHReference& reference : references) {
+			if (reference.bounds.maxima(spatial_axis) <= spatial_height) {
+				low.push_back(reference);
+				continue;
+			}
+			if (reference.bounds.minima(spatial_axis) >= spatial_height) {
+				high.push_back(reference);
+				continue;
+			}
+			const Triangle& triangle = (*all_triangles)[reference.triangle];
+			BVHReference low_part = reference, high_part = reference;
+			AABB low_side = reference.bounds, high_side = reference.bounds;
+			low_side.maxima(spatial_axis) = spatial_height;
+			high_side.minima(spatial_axis) = spatial_height;
+			low_part.bounds = triangle.clipped_bounds(low_side);
+			high_part.bounds = triangle.clipped_bounds(high_side);
+			// The triangle may only pass through the corner of the reference's box on one side, or, through rounding, neither.
+			if (not is_empty_box(low_part.bounds) and not is_empty_box(high_part.bounds)) {
+				low_part.shared = high_part.shared = true;
+				duplicates++;
+			}
+			if (not is_empty_box(low_part.bounds))
+				low.push_back(low_part);
+			if (not is_empty_box(high_part.bounds))
+				high.push_back(high_part);
+			if (is_empty_box(low_part.bounds) and is_empty_box(high_part.bounds))
+				low.push_back(reference);
+		}
+		// The bins only approximate where the references fall, so check that the split still makes progress.
+		if (not low.empty() and not high.empty() and (int)low.size() < count and (int)high.size() < count) {
+			split_budget -= duplicates;
+			duplicate_count += duplicates;
+			return;
+		}
+		low.clear();
+		high.clear();
+	}
+	if (best_axis != -1) {
+		for (const BVHReference& reference : references)
+			(centroid(reference)(best_axis) < best_height ? low : high).push_back(reference);
+		// Rounding in the bin computation can in principle leave one side empty, in which case we fall back to the median below.
+		if (not low.empty() and not high.empty())
+			return;
+		low.clear();
+		high.clear();
+	}
+	// If every centroid coincides (or we're too deep) then we just split at the median along the longest axis of the centroids.
+	int axis = centroid_bounds.longest_axis();
+	vector<BVHReference> sorted(references);
+	int split_point = count / 2;
+	nth_element(sorted.begin(), sorted.begin() + split_point, sorted.end(), [&](const BVHReference& x, const BVHReference& y) {
+		return centroid(x)(axis) < centroid(y)(axis);
+	});
+	low.assign(sorted.begin(), sorted.begin() + split_point);
+	high.assign(sorted.begin() + split_point, sorted.end());
+}
+
+uint32_t WideBVH::store_leaf(const vector<BVHReference>& references) {
+	leaf_count++;
+#ifdef LEAF_BLOCK_WIDTH
+	vector<TriangleBlock>& flat_blocks = blocks.building();
+	uint32_t first_block = flat_blocks.size();
+	for (int i = 0; i < (int)references.size(); i++) {
+		if (i % LEAF_BLOCK_WIDTH == 0)
+			flat_blocks.push_back(TriangleBlock());
+		uint32_t triangle_index = references[i].triangle;
+		uint32_t marked_index = references[i].shared ? triangle_index | BVH_SHARED_TRIANGLE : triangle_index;
+		flat_blocks.back().set_lane(i % LEAF_BLOCK_WIDTH, (*all_triangles)[triangle_index].intersection_record(), marked_index);
+	}
+	return first_block;
+#else
+	vector<IntersectionRecord>& flat_records = records.building();
+	vector<uint32_t>& flat_record_triangles = record_triangles.building();
+	uint32_t first_record = flat_records.size();
+	for (const BVHReference& reference : references) {
+		flat_records.push_back((*all_triangles)[reference.triangle].intersection_record());
+		flat_record_triangles.push_back(reference.shared ? reference.triangle | BVH_SHARED_TRIANGLE : reference.triangle);
+	}
+	return first_record;
+#endif
+}
+
+uint32_t WideBVH::build_node(vector<BVHReference>& references, int depth) {
+	if (depth > deepest_depth)
+		deepest_depth = depth;
+	vector<WideBVHNode>& flat_nodes = nodes.building();
+	uint32_t index = flat_nodes.size();
+	flat_nodes.push_back(WideBVHNode());
+	// Rather than building a binary tree and collapsing it, we grow our children directly: starting from one cluster holding all
+	// our references, we keep splitting whichever cluster has the largest surface area until we have BVH_WIDTH of them.
+	// As spatial splits can duplicate references, each cluster has its own list of them.
+	struct Cluster {
+		vector<BVHReference> references;
+		AABB aabb;
+	};
+	vector<Cluster> clusters;
+	if (not references.empty()) {
+		Cluster everything;
+		everything.references.swap(references);
+		for (const BVHReference& reference : everything.references)
+			everything.aabb.update(reference.bounds);
+		clusters.push_back(move(everything));
+	}
+	while (clusters.size() < BVH_WIDTH) {
+		int biggest = -1;
+		for (int i = 0; i < (int)clusters.size(); i++)
+			if (clusters[i].references.size() > BVH_LEAF_SIZE and (biggest == -1 or clusters[i].aabb.surface_area() > clusters[biggest].aabb.surface_area()))
+				biggest = i;
+		if (biggest == -1)
+			break;
+		Cluster low, high;
+		split(clusters[biggest].references, low.references, high.references, depth);
+		for (const BVHReference& reference : low.references)
+			low.aabb.update(reference.bounds);
+		for (const BVHReference& reference : high.references)
+			high.aabb.update(reference.bounds);
+		clusters[biggest] = move(low);
+		clusters.push_back(move(high));
+	}
+	AABB boxes[BVH_WIDTH];
+	for (int slot = 0; slot < (int)clusters.size(); slot++)
+		boxes[slot] = clusters[slot].aabb;
+	flat_nodes[index].set_bounds(boxes);
+	// Turn each cluster into a leaf or a child node.
+	// NB: We must index into flat_nodes rather than holding a reference, because the recursion reallocates it.
+	for (int slot = 0; slot < (int)clusters.size(); slot++) {
+		Cluster& cluster = clusters[slot];
+		int count = cluster.references.size();
+		if (count <= BVH_LEAF_SIZE) {
+			uint32_t first = store_leaf(cluster.references);
+			flat_nodes[index].child[slot] = first;
+			flat_nodes[index].triangle_count[slot] = count;
+		} else {
+			uint32_t child = build_node(cluster.references, depth + 1);
+			flat_nodes[index].child[slot] = child;
+			flat_nodes[index].triangle_count[slot] = 0;
+		}
+	}
+	return index;
+}
+
+#ifdef SIMD_BVH_CHILDREN
+// Loads the children's bounds along the axis, decoding them from the grid if quantized, with the same arithmetic as WideBVHNode::decode.
+static inline void load_child_bounds(const WideBVHNode& node, int axis, __m128& minima, __m128& maxima) {
+#ifdef QUANTIZED_BVH
+	__m128i zero = _mm_setzero_si128();
+#if QUANTIZED_BVH == 8
+	int32_t packed_lower, packed_upper;
+	memcpy(&packed_lower, node.lower[axis], sizeof(packed_lower));
+	memcpy(&packed_upper, node.upper[axis], sizeof(packed_upper));
+	__m128i lower = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_lower), zero);
+	__m128i upper = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_upper), zero);
+#else
+	__m128i lower = _mm_loadl_epi64((const __m128i*)node.lower[axis]);
+	__m128i upper = _mm_loadl_epi64((const __m128i*)node.upper[axis]);
+#endif
+	lower = _mm_unpacklo_epi16(lower, zero);
+	upper = _mm_unpacklo_epi16(upper, zero);
+	__m128 origin = _mm_set1_ps(node.origin[axis]), scale = _mm_set1_ps(node.scale[axis]);
+	minima = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(lower), scale));
+	maxima = _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(upper), scale));
+#else
+	minima = _mm_loadu_ps(node.minima[axis]);
+	maxima = _mm_loadu_ps(node.maxima[axis]);
+#endif
+}
+#endif
+
+// Tests the ray against all the children's boxes of a node at once, returning a mask of the children hit within the ray's live interval,
+// and filling in the ray parameter at which each is entered.
+// To keep empty slots (with inverted boxes) from ever being hit, we take the entry plane of each slab by the sign of the ray's direction,
+// rather than sorting the two plane crossings.
+static inline int test_children(const WideBVHNode& node, const CastingRay& ray, const int near_is_maxima[3], Real* t_enter) {
+#ifdef SIMD_BVH_CHILDREN
+	__m128 entry = _mm_set1_ps(ray.t_min), exit = _mm_set1_ps(ray.t_max);
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 origin = _mm_set1_ps(ray.ray.origin(axis));
+		__m128 recip = _mm_set1_ps(ray.recip_deltas(axis));
+		__m128 minima, maxima;
+		load_child_bounds(node, axis, minima, maxima);
+		__m128 near_plane = near_is_maxima[axis] ? maxima : minima;
+		__m128 far_plane = near_is_maxima[axis] ? minima : maxima;
+		__m128 near_t = _mm_mul_ps(_mm_sub_ps(near_plane, origin), recip);
+		__m128 far_t = _mm_mul_ps(_mm_sub_ps(far_plane, origin), recip);
+		entry = _mm_max_ps(near_t, entry);
+		exit = _mm_min_ps(far_t, exit);
+	}
+	_mm_storeu_ps(t_enter, entry);
+	return _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+#ifdef QUANTIZED_BVH
+	Real minima[3][BVH_WIDTH], maxima[3][BVH_WIDTH];
+	node.decode(minima, maxima);
+#else
+	const Real (*minima)[BVH_WIDTH] = node.minima;
+	const Real (*maxima)[BVH_WIDTH] = node.maxima;
+#endif
+	int mask = 0;
+	for (int slot = 0; slot < BVH_WIDTH; slot++) {
+		Real entry = ray.t_min, exit = ray.t_max;
+		for (int axis = 0; axis < 3; axis++) {
+			Real near_plane = near_is_maxima[axis] ? maxima[axis][slot] : minima[axis][slot];
+			Real far_plane = near_is_maxima[axis] ? minima[axis][slot] : maxima[axis][slot];
+			Real near_t = (near_plane - ray.ray.origin(axis)) * ray.recip_deltas(axis);
+			Real far_t = (far_plane - ray.ray.origin(axis)) * ray.recip_deltas(axis);
+			if (near_t > entry)
+				entry = near_t;
+			if (far_t < exit)
+				exit = far_t;
+		}
+		t_enter[slot] = entry;
+		if (entry <= exit)
+			mask |= 1 << slot;
+	}
+	return mask;
+#endif
+}
+
+// A child still to be visited during traversal, along with the ray parameter at which we enter its box.
+struct WideBVHStackEntry {
+	uint32_t child;
+	uint32_t triangle_count;
+	Real t_enter;
+};
+
+// Pushes the children in the mask onto the stack, farthest first, so that the nearest is popped first.
+static inline void push_children(const WideBVHNode& node, int mask, const Real* t_enter, WideBVHStackEntry* stack, int& stack_size) {
+	int slots[BVH_WIDTH];
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		int slot = __builtin_ctz(mask);
+		// Insertion sort by decreasing entry parameter.
+		int i = count++;
+		while (i > 0 and t_enter[slots[i-1]] < t_enter[slot]) {
+			slots[i] = slots[i-1];
+			i--;
+		}
+		slots[i] = slot;
+	}
+	for (int i = 0; i < count; i++) {
+		assert(stack_size < BVH_STACK_SIZE);
+		stack[stack_size++] = WideBVHStackEntry({node.child[slots[i]], node.triangle_count[slots[i]], t_enter[slots[i]]});
+	}
+}
+
+#ifdef BVH_MAILBOX
+// The shared triangles a ray has recently tested, so that it needn't test them again when it reaches another leaf they're in.
+// The ray can only shrink, so a triangle that missed it before will miss it again, and one that hit it has already been counted.
+struct BVHMailbox {
+	uint32_t triangles[BVH_MAILBOX_SIZE];
+
+	BVHMailbox() {
+		for (int i = 0; i < BVH_MAILBOX_SIZE; i++)
+			triangles[i] = 0;
+	}
+
+	// Returns true if the shared triangle has already been tested, and otherwise remembers that it now has been.
+	inline bool already_tested(uint32_t triangle) {
+		uint32_t& slot = triangles[triangle % BVH_MAILBOX_SIZE];
+		if (slot == triangle)
+			return true;
+		slot = triangle;
+		return false;
+	}
+
+#ifdef LEAF_BLOCK_WIDTH
+	// A block tests all its lanes at once, so it can only be skipped if every triangle in it is shared and already tested.
+	// Only blocks of nothing but shared triangles are remembered, as nothing else could ever be skipped.
+	inline bool already_tested(const TriangleBlock& block, int lane_count) {
+		uint32_t shared = BVH_SHARED_TRIANGLE;
+		for (int lane = 0; lane < lane_count; lane++)
+			shared &= block.triangle_index[lane];
+		if (not shared)
+			return false;
+		bool all_tested = true;
+		for (int lane = 0; lane < lane_count; lane++)
+			if (not already_tested(block.triangle_index[lane]))
+				all_tested = false;
+		return all_tested;
+	}
+#endif
+};
+#endif
+
+bool WideBVH::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle, Real t_max) const {
+	CastingRay casting_ray(ray, 0.0, t_max);
+	int near_is_maxima[3];
+	for (int axis = 0; axis < 3; axis++)
+		near_is_maxima[axis] = casting_ray.recip_deltas(axis) < 0;
+	WideBVHStackEntry stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = WideBVHStackEntry({0, 0, casting_ray.t_min});
+	uint32_t hit_index = 0;
+	bool overall_result = false;
+#ifdef BVH_MAILBOX
+	BVHMailbox mailbox;
+#endif
+	while (stack_size > 0) {
+		WideBVHStackEntry entry = stack[--stack_size];
+		// Everything in the child lies beyond where it's entered, so if that's past the closest hit so far we can skip it.
+		if (entry.t_enter > casting_ray.t_max)
+			continue;
+		if (entry.triangle_count == 0) {
+#ifdef TRAVERSAL_STATS
+			node_visits++;
+#endif
+			const WideBVHNode& node = nodes[entry.child];
+			Real t_enter[BVH_WIDTH];
+			int mask = test_children(node, casting_ray, near_is_maxima, t_enter);
+			push_children(node, mask, t_enter, stack, stack_size);
+			continue;
+		}
+		// Otherwise the child is a leaf, so we try intersecting against all of its triangles.
+#ifdef LEAF_BLOCK_WIDTH
+		uint32_t end = entry.child + (entry.triangle_count + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+		for (uint32_t i = entry.child; i < end; i++) {
+#ifdef BVH_MAILBOX
+			if (mailbox.already_tested(blocks[i], min(LEAF_BLOCK_WIDTH, (int)(entry.triangle_count - (i - entry.child) * LEAF_BLOCK_WIDTH))))
+				continue;
+#endif
+			Real temp_hit_parameter, u, v;
+			int lane = blocks[i].ray_test(casting_ray, temp_hit_parameter, u, v);
+			if (lane != -1) {
+				casting_ray.t_max = temp_hit_parameter;
+				hit_u = u;
+				hit_v = v;
+				hit_index = blocks[i].triangle_index[lane] & ~BVH_SHARED_TRIANGLE;
+				overall_result = true;
+			}
+		}
+#else
+		uint32_t end = entry.child + entry.triangle_count;
+		for (uint32_t i = entry.child; i < end; i++) {
+			uint32_t triangle_index = record_triangles[i];
+#ifdef BVH_MAILBOX
+			if ((triangle_index & BVH_SHARED_TRIANGLE) and mailbox.already_tested(triangle_index))
+				continue;
+#endif
+			Real temp_hit_parameter, u, v;
+			bool result = records[i].ray_test(casting_ray.ray, temp_hit_parameter, u, v);
+			if (result and casting_ray.t_min <= temp_hit_parameter and temp_hit_parameter < casting_ray.t_max) {
+				casting_ray.t_max = temp_hit_parameter;
+				hit_u = u;
+				hit_v = v;
+				hit_index = triangle_index & ~BVH_SHARED_TRIANGLE;
+				overall_result = true;
+			}
+		}
+#endif
+	}
+	if (overall_result) {
+		hit_parameter = casting_ray.t_max;
+		if (hit_triangle != nullptr)
+			*hit_triangle = &triangles[hit_index];
+	}
+	return overall_result;
+}
+
+bool WideBVH::occluded(const Ray& ray, Real t_max) const {
+	CastingRay casting_ray(ray, 0.0, t_max);
+	int near_is_maxima[3];
+	for (int axis = 0; axis < 3; axis++)
+		near_is_maxima[axis] = casting_ray.recip_deltas(axis) < 0;
+	WideBVHStackEntry stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = WideBVHStackEntry({0, 0, casting_ray.t_min});
+#ifdef BVH_MAILBOX
+	BVHMailbox mailbox;
+#endif
+	while (stack_size > 0) {
+		WideBVHStackEntry entry = stack[--stack_size];
+		if (entry.triangle_count == 0) {
+#ifdef TRAVERSAL_STATS
+			node_visits++;
+#endif
+			const WideBVHNode& node = nodes[entry.child];
+			Real t_enter[BVH_WIDTH];
+			int mask = test_children(node, casting_ray, near_is_maxima, t_enter);
+			push_children(node, mask, t_enter, stack, stack_size);
+			continue;
+		}
+#ifdef LEAF_BLOCK_WIDTH
+		uint32_t end = entry.child + (entry.triangle_count + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+		for (uint32_t i = entry.child; i < end; i++) {
+#ifdef BVH_MAILBOX
+			if (mailbox.already_tested(blocks[i], min(LEAF_BLOCK_WIDTH, (int)(entry.triangle_count - (i - entry.child) * LEAF_BLOCK_WIDTH))))
+				continue;
+#endif
+			if (blocks[i].occludes(casting_ray))
+				return true;
+		}
+#else
+		uint32_t end = entry.child + entry.triangle_count;
+		for (uint32_t i = entry.child; i < end; i++) {
+#ifdef BVH_MAILBOX
+			if ((record_triangles[i] & BVH_SHARED_TRIANGLE) and mailbox.already_tested(record_triangles[i]))
+				continue;
+#endif
+			if (records[i].occludes(casting_ray.ray, casting_ray.t_max))
+				return true;
+		}
+#endif
+	}
+	return false;
+}
+
+void WideBVH::print_stats() const {
+	size_t node_bytes = nodes.size() * sizeof(WideBVHNode);
+	size_t triangle_bytes = triangles.size() * sizeof(Triangle);
+	cout << "WideBVH: " << nodes.size() << " nodes at " << sizeof(WideBVHNode) << " bytes per node (" << node_bytes / 1e6 << " MB), ";
+#ifdef LEAF_BLOCK_WIDTH
+	size_t record_bytes = blocks.size() * sizeof(TriangleBlock);
+	cout << blocks.size() << " " << LEAF_BLOCK_WIDTH << "-wide triangle blocks at " << sizeof(TriangleBlock) << " bytes per block (" << record_bytes / 1e6 << " MB), ";
+#else
+	size_t record_bytes = records.size() * (sizeof(IntersectionRecord) + sizeof(uint32_t));
+	cout << records.size() << " intersection records at " << sizeof(IntersectionRecord) + sizeof(uint32_t) << " bytes per record (" << record_bytes / 1e6 << " MB), ";
+#endif
+	cout << "shading triangles " << triangle_bytes / 1e6 << " MB, ";
+	cout << "total " << (node_bytes + record_bytes + triangle_bytes) / 1e6 << " MB, ";
+	cout << "depth = " << deepest_depth << " leaves = " << leaf_count << " duplicate references = " << duplicate_count << endl;
+}
+
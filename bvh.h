@@ -0,0 +1,122 @@
+// Wide bounding volume hierarchy for ray casting.
+
+#ifndef _RENDER_BVH_H
+#define _RENDER_BVH_H
+
+#include <stdint.h>
+#include <vector>
+#include "utils.h"
+#include "accelerator.h"
+
+class TaskScheduler;
+
+// Each node has up to this many children, whose boxes are all tested together.
+#define BVH_WIDTH 4
+
+#ifdef QUANTIZED_BVH
+static_assert(QUANTIZED_BVH == 8 or QUANTIZED_BVH == 16, "QUANTIZED_BVH gives the bits per quantized bound, which must be 8 or 16.");
+#if QUANTIZED_BVH == 8
+typedef uint8_t QuantizedBound;
+#else
+typedef uint16_t QuantizedBound;
+#endif
+#define QUANTIZED_BOUND_MAXIMUM ((1 << QUANTIZED_BVH) - 1)
+#endif
+
+// Each node stores the boxes of its children as a structure of arrays, so that one slab test covers all of them.
+// Unused child slots have an inverted box, which no ray can hit.
+struct WideBVHNode {
+#ifdef QUANTIZED_BVH
+	// To save memory the boxes are stored on a grid over the node's own box, where along each axis a child's minimum is at least
+	// origin + lower * scale, and its maximum at most origin + upper * scale. The grid is rounded outwards, so the boxes only grow.
+	Real origin[3], scale[3];
+	QuantizedBound lower[3][BVH_WIDTH];
+	QuantizedBound upper[3][BVH_WIDTH];
+#else
+	Real minima[3][BVH_WIDTH];
+	Real maxima[3][BVH_WIDTH];
+#endif
+	// For interior children this is the index of the child's node.
+	// For leaves it's the index of the leaf's first block in WideBVH::blocks (or first record in WideBVH::records).
+	uint32_t child[BVH_WIDTH];
+	// This is zero for interior children, and the number of triangles for leaves.
+	uint32_t triangle_count[BVH_WIDTH];
+
+	WideBVHNode();
+	// Stores the boxes of the children, where unused slots have invalid AABBs.
+	void set_bounds(const AABB* children);
+	// The stored box of a child, which is a little bigger than the box it was set to when quantized.
+	AABB bounds(int slot) const;
+#ifdef QUANTIZED_BVH
+	// Fills in the children's boxes from the grid, for traversal to test.
+	inline void decode(Real minima[3][BVH_WIDTH], Real maxima[3][BVH_WIDTH]) const {
+		for (int axis = 0; axis < 3; axis++) {
+			for (int slot = 0; slot < BVH_WIDTH; slot++) {
+				minima[axis][slot] = origin[axis] + lower[axis][slot] * scale[axis];
+				maxima[axis][slot] = origin[axis] + upper[axis][slot] * scale[axis];
+			}
+		}
+	}
+#endif
+};
+
+// A cluster's reference to a triangle, bounding only the part of the triangle within the cluster. Spatial splits clip the triangles
+// that straddle them into a reference on each side, so one triangle can have several references, each with a tighter box than its own.
+struct BVHReference {
+	uint32_t triangle;
+	AABB bounds;
+	// Whether a spatial split has left other references to the triangle, which then goes in the leaves marked as shared.
+	bool shared;
+};
+
+class WideBVH : public Accelerator {
+	// The caller's triangles, or nullptr if the BVH was loaded from a scene cache rather than built.
+	std::vector<Triangle>* all_triangles;
+	// The triangles as traversal sees them.
+	AcceleratorArray<Triangle> triangles;
+	// The nodes, with the root at index 0.
+	AcceleratorArray<WideBVHNode> nodes;
+	// Unlike the kd-tree we leave the triangles in their original order, so the leaves keep the indices of their triangles.
+	// Triangles referenced from more than one leaf are marked with BVH_SHARED_TRIANGLE, so that rays can avoid testing them twice.
+#ifdef LEAF_BLOCK_WIDTH
+	AcceleratorArray<TriangleBlock> blocks;
+#else
+	AcceleratorArray<IntersectionRecord> records;
+	AcceleratorArray<uint32_t> record_triangles;
+#endif
+	int deepest_depth, leaf_count;
+	// How many more references to triangles the leaves hold than there are triangles, from spatial splits.
+	int duplicate_count;
+	// The estimated cost of casting a ray as of the last build, which refits compare against to decide when to rebuild.
+	Real build_cost;
+	// While building, the surface area of the whole BVH, and how many more duplicate references spatial splits may still make.
+	Real root_area;
+	long long split_budget;
+
+	// Builds the BVH over all_triangles, which unlike the kd-tree leaves them in their order.
+	void build();
+	// Estimates the cost of casting a ray through boxes refit to the triangles as they are now, bounding each triangle whole as a refit
+	// does, and stores those boxes (and the triangles' intersection data) if refit_boxes is set, or otherwise leaves the BVH as it is.
+	Real refit_nodes(TaskScheduler* scheduler, bool refit_boxes);
+	RefitResult refit_node(uint32_t index, TaskScheduler* scheduler, int depth, bool refit_boxes);
+	// Builds a node over the references, which it uses up, and returns its index.
+	uint32_t build_node(std::vector<BVHReference>& references, int depth);
+	// Splits the references into two nonempty parts, either by their centroids, or, if it's better and within budget, spatially, in
+	// which case the references straddling the split are clipped into one for each side.
+	void split(const std::vector<BVHReference>& references, std::vector<BVHReference>& low, std::vector<BVHReference>& high, int depth);
+	// Stores the referenced triangles as a leaf, and returns the index of its first block or record.
+	uint32_t store_leaf(const std::vector<BVHReference>& references);
+
+public:
+	WideBVH(std::vector<Triangle>* all_triangles);
+	WideBVH(SceneCacheReader& reader, const Triangle* triangles, size_t triangle_count);
+	~WideBVH();
+	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr, Real t_max=FLOAT_INF) const;
+	bool occluded(const Ray& ray, Real t_max) const;
+	bool refit(std::vector<int>* order=nullptr);
+	void print_stats() const;
+	bool save(SceneCacheWriter& writer) const;
+};
+
+#endif
+
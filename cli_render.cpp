@@ -5,6 +5,10 @@ using namespace std;
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <sys/time.h>
 
 #include "integrator.h"
 #include "visualizer.h"
@@ -16,7 +20,8 @@ int main(int argc, char** argv) {
 	po::options_description desc("Allowed options");
 	desc.add_options()
 		("help", "Produce help message.")
-		("stl", po::value<vector<string>>(), "Input STL file.")
+		("stl", po::value<vector<string>>(), "Input STL file. (May be given more than once, each input being placed as is.)")
+		("instance", po::value<vector<string>>(), "Place another copy of an input, given as N,X,Y,Z[,ANGLE[,SCALE]] to place input N (counting from 0) rotated ANGLE degrees about the z axis, scaled by SCALE, and moved by (X, Y, Z). (May be given more than once.)")
 		("output", po::value<string>()->default_value("output.png"), "Output PNG file.")
 		("samples", po::value<int>()->default_value(10), "Number of samples.")
 		("width", po::value<int>()->default_value(1920), "Width of rendered image.")
@@ -30,8 +35,15 @@ int main(int argc, char** argv) {
 		("camera-z-facing-offset", po::value<double>()->default_value(0.0), "This option shouldn't exist.")
 		("dof-aperture", po::value<double>()->default_value(0.0), "Depth of field Gaussian aperture standard deviation. Use 0.0 to disable DoF.")
 		("dof-distance", po::value<double>()->default_value(1.0), "Distance to the plane of focus.")
+		("max-depth", po::value<int>()->default_value(10), "Maximum number of bounces per path after the first hit.")
+		("roulette-depth", po::value<int>()->default_value(3), "Number of bounces before Russian roulette starts stopping paths. (max-depth or more to disable)")
+		("light-samples", po::value<int>()->default_value(0), "Number of shadow rays per hit, each toward a light picked at random. (0 for one toward every light)")
+		("light-sampler", po::value<string>()->default_value("tree"), "How to pick lights for light-samples: tree (favoring lights near each hit) or grid (from tables over a coarse grid of the scene, favoring lights near each hit's cell).")
+		("sampler", po::value<string>()->default_value("sobol"), "How to draw samples: sobol (Owen scrambled Sobol sequences over each pixel's samples) or random (independently at random).")
 		("tile-width", po::value<int>()->default_value(64), "Width of a rendering tile in pixels.")
 		("tile-height", po::value<int>()->default_value(64), "Height of a rendering tile in pixels.")
+		("accelerator", po::value<string>()->default_value(accelerator_names[0]), "Acceleration structure to cast rays against. (kdtree or bvh)")
+		("scene-cache", po::value<string>()->default_value(""), "Directory in which to cache the processed mesh and acceleration structure, keyed by the input's contents. (empty to disable)")
 	;
 
 	po::positional_options_description p;
@@ -55,15 +67,50 @@ int main(int argc, char** argv) {
 
 	auto inputs = vm["stl"].as<vector<string>>();
 	assert(inputs.size() > 0);
-	if (inputs.size() > 1) {
-		cout << "Too many inputs specified -- currently only one input STL is supported." << endl;
+
+	// Parse the extra instances up front, so we complain about them before doing anything slow.
+	struct InstanceOption {
+		int input;
+		AffineTransform transform;
+	};
+	vector<InstanceOption> instance_options;
+	if (vm.count("instance")) {
+		for (auto& option : vm["instance"].as<vector<string>>()) {
+			int input;
+			double x, y, z, angle = 0, scale = 1;
+			int fields = sscanf(option.c_str(), "%d,%lf,%lf,%lf,%lf,%lf", &input, &x, &y, &z, &angle, &scale);
+			if (fields < 4 or input < 0 or input >= (int)inputs.size() or scale == 0) {
+				cout << "Bad instance: " << option << endl;
+				return 1;
+			}
+			instance_options.push_back({input, AffineTransform::rotate_scale_translate(angle * M_PI / 180, scale, Vec(x, y, z))});
+		}
+	}
+
+	auto accelerator_name = vm["accelerator"].as<string>();
+	if (find(accelerator_names.begin(), accelerator_names.end(), accelerator_name) == accelerator_names.end()) {
+		cout << "Unknown accelerator: " << accelerator_name << endl;
+		return 1;
+	}
+
+	auto light_sampler = vm["light-sampler"].as<string>();
+	if (light_sampler != "tree" and light_sampler != "grid") {
+		cout << "Unknown light sampler: " << light_sampler << endl;
+		return 1;
+	}
+
+	auto sampler = vm["sampler"].as<string>();
+	if (sampler != "sobol" and sampler != "random") {
+		cout << "Unknown sampler: " << sampler << endl;
 		return 1;
 	}
-	auto path = inputs[0];
 
 	// Print out the various arguments set.
-	cout << "input        = " << path << endl;
-	for (string key : {"output", "samples", "width", "height", "threads", "angle", "camera-altitude", "dof-aperture", "dof-distance", "tile-width", "tile-height"}) {
+	for (auto& path : inputs)
+		cout << "input        = " << path << endl;
+	if (not instance_options.empty())
+		cout << "instances    = " << instance_options.size() << endl;
+	for (string key : {"output", "samples", "width", "height", "threads", "angle", "camera-altitude", "dof-aperture", "dof-distance", "max-depth", "roulette-depth", "light-samples", "light-sampler", "sampler", "tile-width", "tile-height", "accelerator", "scene-cache"}) {
 		// Skip the dof-distance if dof-aperture is zero.
 		if (key == "dof-distance" and vm["dof-aperture"].as<double>() == 0)
 			continue;
@@ -85,7 +132,19 @@ int main(int argc, char** argv) {
 	override_thread_count(vm["threads"].as<int>());
 
 	// Begin rendering!
-	auto scene = new Scene(path);
+	// Each input is read and built once, however many instances of it there are.
+	auto scene = new Scene();
+	vector<int> meshes;
+	for (auto& path : inputs) {
+		int mesh = scene->add_mesh(path, accelerator_name, vm["scene-cache"].as<string>());
+		if (mesh == -1)
+			return 1;
+		meshes.push_back(mesh);
+		scene->add_instance(mesh);
+	}
+	for (auto& option : instance_options)
+		scene->add_instance(meshes[option.input], option.transform);
+	scene->accelerator->build();
 	scene->lights->push_back(Light({Vec(0, 0, 3), 9.0 * Vec(0.8, 0.5, 0.25)}));
 	scene->lights->push_back(Light({Vec(-2, 2, 4), 9.0 * Vec(0.25, 0.8, 0.25)}));
 	scene->lights->push_back(Light({Vec(-2, -2, 4), 9.0 * Vec(0.25, 0.25, 0.8)}));
@@ -98,6 +157,11 @@ int main(int argc, char** argv) {
 	scene->main_camera.origin += Vec(0.0, 0.0, vm["camera-altitude"].as<double>());
 	scene->plane_of_focus_distance = vm["dof-distance"].as<double>();
 	scene->dof_dispersion = vm["dof-aperture"].as<double>();
+	scene->max_path_depth = vm["max-depth"].as<int>();
+	scene->roulette_depth = vm["roulette-depth"].as<int>();
+	scene->light_samples = vm["light-samples"].as<int>();
+	scene->use_light_tree = light_sampler == "tree";
+	scene->low_discrepancy = sampler == "sobol";
 
 	auto engine = new RenderEngine(vm["width"].as<int>(), vm["height"].as<int>(), scene);
 	engine->tile_width = vm["tile-width"].as<int>();
@@ -109,6 +173,8 @@ int main(int argc, char** argv) {
 	else
 		pr = new ProgressBar(engine);
 	pr->init();
+	struct timeval start, stop, elapsed;
+	gettimeofday(&start, NULL);
 	int samples_count = vm["samples"].as<int>();
 	if (vm.count("progressive")) {
 		int progressive_count = vm["progressive"].as<int>();
@@ -121,6 +187,10 @@ int main(int argc, char** argv) {
 	delete pr;
 //	engine->sync();
 	engine->rebuild_master_canvas();
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &elapsed);
+	double seconds = elapsed.tv_sec + elapsed.tv_usec * 1e-6;
+	cout << "Rendered in " << seconds << " s, " << engine->width * (double) engine->height * samples_count / seconds * 1e-6 << " Msamples/s" << endl;
 	auto output_path = vm["output"].as<string>();
 	engine->master_canvas->save(output_path);
 	cout << "Wrote to: " << output_path << endl;
@@ -0,0 +1,360 @@
+// Two-level acceleration over instances of meshes, each placed with its own transform.
+
+using namespace std;
+#include <assert.h>
+#include <math.h>
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include "instances.h"
+
+// The top level splits down to leaves of at most this many instances.
+#define INSTANCE_LEAF_SIZE 2
+// The top level is split at the median, so this is enough for any number of instances that fits in an int.
+#define INSTANCE_STACK_SIZE 64
+
+AffineTransform::AffineTransform() : linear(Mat::Identity()), translation(0, 0, 0) {
+}
+
+AffineTransform::AffineTransform(const Mat& linear, const Vec& translation) : linear(linear), translation(translation) {
+}
+
+AffineTransform AffineTransform::inverse() const {
+	Mat inverse_linear = linear.inverse();
+	return AffineTransform(inverse_linear, -(inverse_linear * translation));
+}
+
+AffineTransform AffineTransform::rotate_scale_translate(Real angle, Real scale, const Vec& translation) {
+	Real c = cos(angle), s = sin(angle);
+	Mat linear;
+	linear << c, -s, 0,
+	          s,  c, 0,
+	          0,  0, 1;
+	return AffineTransform(scale * linear, translation);
+}
+
+MeshInstance::MeshInstance(int mesh, const Accelerator* accelerator, const AABB& object_bounds, const AffineTransform& object_to_world) : mesh(mesh), accelerator(accelerator), object_bounds(object_bounds) {
+	set_transform(object_to_world);
+}
+
+void MeshInstance::set_transform(const AffineTransform& _object_to_world) {
+	object_to_world = _object_to_world;
+	is_identity = object_to_world.linear == Mat::Identity() and object_to_world.translation == Vec(0, 0, 0);
+	world_to_object = object_to_world.inverse();
+	normal_to_world = object_to_world.linear.inverse().transpose();
+	// The world box is the box around the eight corners of the object box, once they're placed.
+	world_bounds = AABB();
+	for (int corner = 0; corner < 8; corner++) {
+		Vec p((corner & 1 ? object_bounds.maxima : object_bounds.minima)(0),
+		      (corner & 2 ? object_bounds.maxima : object_bounds.minima)(1),
+		      (corner & 4 ? object_bounds.maxima : object_bounds.minima)(2));
+		world_bounds.update(object_to_world.point(p));
+	}
+}
+
+Ray MeshInstance::to_object(const Ray& ray, Real& scale) const {
+	if (is_identity) {
+		scale = 1.0;
+		return ray;
+	}
+	Vec direction = world_to_object.vector(ray.direction);
+	scale = direction.norm();
+	return Ray(world_to_object.point(ray.origin), direction);
+}
+
+InstanceTree::InstanceTree() : dirty(false) {
+}
+
+int InstanceTree::add_instance(int mesh, const Accelerator* accelerator, const AABB& object_bounds, const AffineTransform& object_to_world) {
+	instances.push_back(MeshInstance(mesh, accelerator, object_bounds, object_to_world));
+	dirty = true;
+	return instances.size() - 1;
+}
+
+void InstanceTree::set_transform(int instance, const AffineTransform& object_to_world) {
+	instances.at(instance).set_transform(object_to_world);
+	dirty = true;
+}
+
+void InstanceTree::set_mesh_bounds(int mesh, const AABB& object_bounds) {
+	for (auto& instance : instances) {
+		if (instance.mesh == mesh) {
+			instance.object_bounds = object_bounds;
+			instance.set_transform(instance.object_to_world);
+		}
+	}
+	dirty = true;
+}
+
+const MeshInstance& InstanceTree::instance(int index) const {
+	return instances.at(index);
+}
+
+int InstanceTree::instance_count() const {
+	return instances.size();
+}
+
+void InstanceTree::build() {
+	nodes.clear();
+	order.resize(instances.size());
+	iota(order.begin(), order.end(), 0);
+	vector<Vec> centroids;
+	for (auto& instance : instances)
+		centroids.push_back((instance.world_bounds.minima + instance.world_bounds.maxima) / 2);
+	if (not instances.empty())
+		build_node(0, instances.size(), centroids);
+	dirty = false;
+}
+
+uint32_t InstanceTree::build_node(int begin, int end, const vector<Vec>& centroids) {
+	uint32_t index = nodes.size();
+	nodes.push_back(InstanceNode());
+	AABB bounds, centroid_bounds;
+	for (int i = begin; i < end; i++) {
+		bounds.update(instances[order[i]].world_bounds);
+		centroid_bounds.update(centroids[order[i]]);
+	}
+	nodes[index].bounds = bounds;
+	if (end - begin <= INSTANCE_LEAF_SIZE) {
+		nodes[index].index = begin;
+		nodes[index].instance_count = end - begin;
+		return index;
+	}
+	// Split at the median centroid along the axis the centroids are most spread out on, which keeps the tree balanced.
+	int axis = centroid_bounds.longest_axis();
+	int middle = (begin + end) / 2;
+	nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) {
+		return centroids[a](axis) < centroids[b](axis);
+	});
+	build_node(begin, middle, centroids);
+	uint32_t second = build_node(middle, end, centroids);
+	nodes[index].index = second;
+	nodes[index].instance_count = 0;
+	return index;
+}
+
+bool InstanceTree::ray_test_instance(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle, const MeshInstance** hit_instance, Real t_max) const {
+	assert(not dirty);
+	if (nodes.empty())
+		return false;
+	// The ray's t_max shrinks with each hit, so that boxes beyond the closest hit so far get skipped, and each instance is only
+	// searched for hits closer than that.
+	CastingRay casting_ray(ray, 0.0, t_max);
+	const MeshInstance* closest = nullptr;
+	uint32_t stack[INSTANCE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		uint32_t index = stack[--stack_size];
+		const InstanceNode& node = nodes[index];
+		Real t_enter, t_exit;
+		if (not node.bounds.ray_interval(casting_ray, t_enter, t_exit))
+			continue;
+		if (node.instance_count == 0) {
+			assert(stack_size + 2 <= INSTANCE_STACK_SIZE);
+			stack[stack_size++] = node.index;
+			stack[stack_size++] = index + 1;
+			continue;
+		}
+		for (uint32_t i = node.index; i < node.index + node.instance_count; i++) {
+			const MeshInstance& instance = instances[order[i]];
+			Real param, u, v, scale;
+			const Triangle* triangle;
+			Ray object_ray = instance.to_object(ray, scale);
+			if (not instance.accelerator->ray_test(object_ray, param, u, v, &triangle, casting_ray.t_max * scale))
+				continue;
+			param /= scale;
+			if (param < casting_ray.t_max) {
+				casting_ray.t_max = param;
+				hit_u = u;
+				hit_v = v;
+				if (hit_triangle != nullptr)
+					*hit_triangle = triangle;
+				closest = &instance;
+			}
+		}
+	}
+	if (closest == nullptr)
+		return false;
+	hit_parameter = casting_ray.t_max;
+	if (hit_instance != nullptr)
+		*hit_instance = closest;
+	return true;
+}
+
+bool InstanceTree::occluded(const Ray& ray, Real t_max) const {
+	assert(not dirty);
+	if (nodes.empty())
+		return false;
+	CastingRay casting_ray(ray, 0.0, t_max);
+	uint32_t stack[INSTANCE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		uint32_t index = stack[--stack_size];
+		const InstanceNode& node = nodes[index];
+		Real t_enter, t_exit;
+		if (not node.bounds.ray_interval(casting_ray, t_enter, t_exit))
+			continue;
+		if (node.instance_count == 0) {
+			assert(stack_size + 2 <= INSTANCE_STACK_SIZE);
+			stack[stack_size++] = node.index;
+			stack[stack_size++] = index + 1;
+			continue;
+		}
+		for (uint32_t i = node.index; i < node.index + node.instance_count; i++) {
+			const MeshInstance& instance = instances[order[i]];
+			Real scale;
+			Ray object_ray = instance.to_object(ray, scale);
+			if (instance.accelerator->occluded(object_ray, t_max * scale))
+				return true;
+		}
+	}
+	return false;
+}
+
+// The packet walks are the same as the single ray ones, visiting a node if any ray of the packet reaches its box.
+// At each instance the whole packet is carried into object space and cast as a packet against the instance's accelerator,
+// as a transform keeps coherent rays coherent.
+
+void InstanceTree::ray_test_packet_instances(const Ray* rays, int count, PacketHits& hits, const MeshInstance** hit_instance, const Real* t_max) const {
+	assert(not dirty and count <= RAY_PACKET_SIZE);
+	for (int lane = 0; lane < count; lane++)
+		hits.hit[lane] = false;
+	if (nodes.empty() or count == 0)
+		return;
+	CastingRay casting_rays[RAY_PACKET_SIZE];
+	for (int lane = 0; lane < count; lane++)
+		casting_rays[lane] = t_max != nullptr ? CastingRay(rays[lane], 0.0, t_max[lane]) : CastingRay(rays[lane]);
+	uint32_t stack[INSTANCE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		uint32_t index = stack[--stack_size];
+		const InstanceNode& node = nodes[index];
+		bool any_reach = false;
+		for (int lane = 0; lane < count and not any_reach; lane++) {
+			Real t_enter, t_exit;
+			any_reach = node.bounds.ray_interval(casting_rays[lane], t_enter, t_exit);
+		}
+		if (not any_reach)
+			continue;
+		if (node.instance_count == 0) {
+			assert(stack_size + 2 <= INSTANCE_STACK_SIZE);
+			stack[stack_size++] = node.index;
+			stack[stack_size++] = index + 1;
+			continue;
+		}
+		for (uint32_t i = node.index; i < node.index + node.instance_count; i++) {
+			const MeshInstance& instance = instances[order[i]];
+			Ray object_rays[RAY_PACKET_SIZE];
+			Real scales[RAY_PACKET_SIZE], object_t_max[RAY_PACKET_SIZE];
+			for (int lane = 0; lane < count; lane++) {
+				object_rays[lane] = instance.to_object(rays[lane], scales[lane]);
+				object_t_max[lane] = casting_rays[lane].t_max * scales[lane];
+			}
+			PacketHits instance_hits;
+			instance.accelerator->ray_test_packet(object_rays, count, instance_hits, object_t_max);
+			for (int lane = 0; lane < count; lane++) {
+				if (not instance_hits.hit[lane])
+					continue;
+				Real param = instance_hits.hit_parameter[lane] / scales[lane];
+				if (param < casting_rays[lane].t_max) {
+					casting_rays[lane].t_max = param;
+					hits.hit[lane] = true;
+					hits.hit_parameter[lane] = param;
+					hits.hit_u[lane] = instance_hits.hit_u[lane];
+					hits.hit_v[lane] = instance_hits.hit_v[lane];
+					hits.hit_triangle[lane] = instance_hits.hit_triangle[lane];
+					hit_instance[lane] = &instance;
+				}
+			}
+		}
+	}
+}
+
+void InstanceTree::occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const {
+	assert(not dirty and count <= RAY_PACKET_SIZE);
+	for (int lane = 0; lane < count; lane++)
+		result[lane] = false;
+	if (nodes.empty() or count == 0)
+		return;
+	CastingRay casting_rays[RAY_PACKET_SIZE];
+	for (int lane = 0; lane < count; lane++)
+		casting_rays[lane] = CastingRay(rays[lane], 0.0, t_max[lane]);
+	int blocked = 0;
+	uint32_t stack[INSTANCE_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		uint32_t index = stack[--stack_size];
+		const InstanceNode& node = nodes[index];
+		bool any_reach = false;
+		for (int lane = 0; lane < count and not any_reach; lane++) {
+			Real t_enter, t_exit;
+			any_reach = not result[lane] and node.bounds.ray_interval(casting_rays[lane], t_enter, t_exit);
+		}
+		if (not any_reach)
+			continue;
+		if (node.instance_count == 0) {
+			assert(stack_size + 2 <= INSTANCE_STACK_SIZE);
+			stack[stack_size++] = node.index;
+			stack[stack_size++] = index + 1;
+			continue;
+		}
+		for (uint32_t i = node.index; i < node.index + node.instance_count; i++) {
+			const MeshInstance& instance = instances[order[i]];
+			// Only the rays that aren't blocked yet go along.
+			Ray object_rays[RAY_PACKET_SIZE];
+			Real object_t_max[RAY_PACKET_SIZE];
+			int lanes[RAY_PACKET_SIZE];
+			int object_count = 0;
+			for (int lane = 0; lane < count; lane++) {
+				if (result[lane])
+					continue;
+				Real scale;
+				object_rays[object_count] = instance.to_object(rays[lane], scale);
+				object_t_max[object_count] = t_max[lane] * scale;
+				lanes[object_count++] = lane;
+			}
+			bool object_result[RAY_PACKET_SIZE];
+			instance.accelerator->occluded_packet(object_rays, object_t_max, object_count, object_result);
+			for (int j = 0; j < object_count; j++) {
+				if (object_result[j]) {
+					result[lanes[j]] = true;
+					blocked++;
+				}
+			}
+			if (blocked == count)
+				return;
+		}
+	}
+}
+
+bool InstanceTree::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle, Real t_max) const {
+	return ray_test_instance(ray, hit_parameter, hit_u, hit_v, hit_triangle, nullptr, t_max);
+}
+
+void InstanceTree::ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max) const {
+	const MeshInstance* hit_instance[RAY_PACKET_SIZE];
+	ray_test_packet_instances(rays, count, hits, hit_instance, t_max);
+}
+
+bool InstanceTree::refit(vector<int>* order) {
+	build();
+	return true;
+}
+
+void InstanceTree::print_stats() const {
+	vector<const Accelerator*> accelerators;
+	for (auto& instance : instances)
+		if (find(accelerators.begin(), accelerators.end(), instance.accelerator) == accelerators.end())
+			accelerators.push_back(instance.accelerator);
+	size_t instance_bytes = instances.size() * sizeof(MeshInstance) + order.size() * sizeof(int);
+	size_t node_bytes = nodes.size() * sizeof(InstanceNode);
+	cout << "InstanceTree: " << instances.size() << " instances at " << sizeof(MeshInstance) << " bytes per instance (" << instance_bytes / 1e6 << " MB), ";
+	cout << "sharing " << accelerators.size() << " accelerators, ";
+	cout << nodes.size() << " top level nodes at " << sizeof(InstanceNode) << " bytes per node (" << node_bytes / 1e6 << " MB)" << endl;
+	for (auto accelerator : accelerators)
+		accelerator->print_stats();
+}
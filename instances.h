@@ -0,0 +1,94 @@
+// Two-level acceleration over instances of meshes, each placed with its own transform.
+
+#ifndef _RENDER_INSTANCES_H
+#define _RENDER_INSTANCES_H
+
+#include <stdint.h>
+#include <vector>
+#include "utils.h"
+#include "accelerator.h"
+
+// Maps x to linear * x + translation.
+struct AffineTransform {
+	Mat linear;
+	Vec translation;
+
+	// The default is the identity.
+	AffineTransform();
+	AffineTransform(const Mat& linear, const Vec& translation);
+	inline Vec point(const Vec& p) const { return linear * p + translation; }
+	inline Vec vector(const Vec& v) const { return linear * v; }
+	AffineTransform inverse() const;
+	// Rotates by the given angle in radians about the z axis, then scales uniformly, then translates.
+	static AffineTransform rotate_scale_translate(Real angle, Real scale, const Vec& translation);
+};
+
+// One placement of a mesh, whose accelerator may be shared with any number of other instances.
+struct MeshInstance {
+	// The mesh's index in the scene, and the structure over its triangles, which are in the mesh's own object space.
+	int mesh;
+	const Accelerator* accelerator;
+	AffineTransform object_to_world, world_to_object;
+	// The inverse transpose of object_to_world.linear, which carries normals out to world space.
+	Mat normal_to_world;
+	// The mesh's bounds in object space, and the box around them once placed in the world.
+	AABB object_bounds, world_bounds;
+	// Instances left in place pass rays straight through, so that they give exactly the hits their accelerator does.
+	bool is_identity;
+
+	MeshInstance(int mesh, const Accelerator* accelerator, const AABB& object_bounds, const AffineTransform& object_to_world);
+	void set_transform(const AffineTransform& object_to_world);
+	// The ray in object space. As rays always have unit directions, a distance along the world ray is scale times as far along the object ray.
+	Ray to_object(const Ray& ray, Real& scale) const;
+};
+
+// Leaves of the top level hold a few instances each, from the tree's instance order.
+struct InstanceNode {
+	AABB bounds;
+	// For interior nodes this is the index of the second child, as the first immediately follows its parent.
+	// For leaves it's the index of the leaf's first entry in InstanceTree::order.
+	uint32_t index;
+	// Zero for interior nodes, and the number of instances for leaves.
+	uint32_t instance_count;
+};
+
+// A small BVH over the instances' world boxes. Rays that reach an instance are carried into its object space and cast against
+// its mesh's own accelerator. Only this top level depends on where the instances are, so moving them only means rebuilding it.
+// That's cheap enough that it keeps the default save(), declining to be cached, while the meshes' accelerators are cached on their own.
+class InstanceTree : public Accelerator {
+	std::vector<MeshInstance> instances;
+	std::vector<InstanceNode> nodes;
+	// The instance indices, ordered so that each leaf's instances are contiguous.
+	std::vector<int> order;
+	bool dirty;
+
+	uint32_t build_node(int begin, int end, const std::vector<Vec>& centroids);
+
+public:
+	InstanceTree();
+	// Adds an instance of the mesh with the given accelerator and bounds, and returns its index. The instance is cast against once build() is called.
+	int add_instance(int mesh, const Accelerator* accelerator, const AABB& object_bounds, const AffineTransform& object_to_world);
+	// Moves an instance, which then takes effect once build() is called.
+	void set_transform(int instance, const AffineTransform& object_to_world);
+	// Gives every instance of the mesh new object space bounds, as after the mesh deforms, which then take effect once build() is called.
+	void set_mesh_bounds(int mesh, const AABB& object_bounds);
+	// (Re)builds the top level over the instances as they are now, which is cheap as it never touches the meshes' accelerators.
+	void build();
+	const MeshInstance& instance(int index) const;
+	int instance_count() const;
+
+	// Like ray_test, also reporting which instance was hit. The triangle and its barycentric coordinates are in that instance's object space.
+	bool ray_test_instance(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle, const MeshInstance** hit_instance, Real t_max=FLOAT_INF) const;
+	// Likewise for a packet, with each ray's instance in hit_instance.
+	void ray_test_packet_instances(const Ray* rays, int count, PacketHits& hits, const MeshInstance** hit_instance, const Real* t_max=nullptr) const;
+
+	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr, Real t_max=FLOAT_INF) const;
+	bool occluded(const Ray& ray, Real t_max) const;
+	void ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max=nullptr) const;
+	void occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const;
+	// The meshes are refit through their own accelerators, and set_mesh_bounds, so this just rebuilds the top level.
+	bool refit(std::vector<int>* order=nullptr);
+	void print_stats() const;
+};
+
+#endif
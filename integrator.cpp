@@ -5,10 +5,27 @@ using namespace std;
 #include <iostream>
 #include <algorithm>
 #include <ctime>
+#include <numeric>
 #include "integrator.h"
 #include "stlreader.h"
-
-Scene::Scene(string path) : main_camera(Vec(-1, 0, 0), Vec(1, 0, 0)) {
+#include "scenecache.h"
+
+// Passes are traced in tiles of this many pixels square, each cast as one packet.
+#define PACKET_TILE_SIZE 4
+static_assert(PACKET_TILE_SIZE * PACKET_TILE_SIZE <= RAY_PACKET_SIZE, "A tile's camera rays must fit in one packet.");
+// The fraction of the light arriving at a surface that it scatters on.
+#define SURFACE_REFLECTANCE 0.8
+// Even paths carrying lots of energy are stopped by Russian roulette with at least this probability, so no path goes on forever.
+#define ROULETTE_MAX_SURVIVAL 0.95
+// Low discrepancy sampling draws each part of a path from its own stream of dimensions, so that the parts see the same dimensions
+// from sample to sample, however the parts of the paths in a packet are interleaved. Each of a hit's shadow rays has its own stream.
+#define CAMERA_STREAM 0
+#define PATH_STREAM 1
+#define DIRECT_LIGHT_STREAM 2
+// The standard deviation of the random offsets to the lights, which makes them act like small fuzzy balls, with soft shadows.
+#define LIGHT_DELOCALIZATION 0.2
+
+Scene::Scene() : accelerator(new InstanceTree()), main_camera(Vec(-1, 0, 0), Vec(1, 0, 0)) {
 	// The convention is that main_camera.cross(scene_up) is camera right.
 	scene_up = Vec(0, 0, 1);
 	// Field of view is 90 degrees by default.
@@ -17,148 +34,346 @@ Scene::Scene(string path) : main_camera(Vec(-1, 0, 0), Vec(1, 0, 0)) {
 	plane_of_focus_distance = 1.0;
 	dof_dispersion = 0.0;
 	sky_color = Vec(0, 0, 0);
+	max_path_depth = 10;
+	roulette_depth = 3;
+	light_samples = 0;
+	use_light_tree = true;
+	low_discrepancy = true;
+
+	// Allocate empty storage.
+	lights = new vector<Light>();
+}
+
+Scene::Scene(string path, string accelerator_name, string cache_directory) : Scene() {
+	int mesh = add_mesh(path, accelerator_name, cache_directory);
+	if (mesh != -1)
+		add_instance(mesh);
+	accelerator->build();
+}
+
+Scene::~Scene() {
+	delete lights;
+	// The accelerators may refer into the caches, so go first.
+	delete accelerator;
+	for (auto& mesh : meshes) {
+		delete mesh.rest;
+		delete mesh.triangles;
+		delete mesh.accelerator;
+		delete mesh.cache;
+	}
+}
+
+static AABB bounds_of_triangles(const Triangle* triangles, size_t count) {
+	AABB bounds;
+	for (size_t i = 0; i < count; i++)
+		bounds.update(triangles[i].aabb);
+	return bounds;
+}
+
+int Scene::add_mesh(string path, string accelerator_name, string cache_directory) {
+	SceneMesh mesh = {nullptr, nullptr, nullptr, AABB(), nullptr};
+
+	// Look for a cache of this input first, in which case there's nothing left to do.
+	uint64_t content_hash;
+	bool use_cache = not cache_directory.empty() and hash_file_contents(path, content_hash);
+	string cache_path;
+	if (use_cache) {
+		cache_path = scene_cache_path(cache_directory, content_hash, accelerator_name);
+		mesh.cache = MappedSceneCache::open(cache_path, content_hash, accelerator_name);
+		if (mesh.cache != nullptr) {
+			SceneCacheReader reader = mesh.cache->reader();
+			AcceleratorArray<Triangle> triangles;
+			reader.read_array(triangles);
+			mesh.accelerator = load_accelerator(accelerator_name, reader, triangles.data(), triangles.size());
+			assert(mesh.accelerator != nullptr);
+			mesh.bounds = bounds_of_triangles(triangles.data(), triangles.size());
+			cout << "Loaded " << triangles.size() << " triangles from " << cache_path << endl;
+			meshes.push_back(mesh);
+			return meshes.size() - 1;
+		}
+	}
 
 	// Read in the input.
-	mesh = read_stl(path);
-	if (mesh == nullptr) {
+	mesh.triangles = read_stl(path);
+	if (mesh.triangles == nullptr) {
 		cout << "Couldn't read input file." << endl;
-		return;
+		return -1;
 	}
-	cout << "Read in " << mesh->size() << " triangles." << endl;
-
-	// Build the k-d tree.
-	tree = new kdTree(mesh);
+	cout << "Read in " << mesh.triangles->size() << " triangles." << endl;
+	mesh.bounds = bounds_of_triangles(mesh.triangles->data(), mesh.triangles->size());
+
+	// Build the acceleration structure.
+	mesh.accelerator = build_accelerator(accelerator_name, mesh.triangles);
+	assert(mesh.accelerator != nullptr);
+//	mesh.accelerator->print_stats();
+
+	// The accelerator may have reordered the mesh, so we save the mesh as it is now, which is the order the accelerator refers to.
+	if (use_cache and not write_scene_cache(cache_path, content_hash, accelerator_name, *mesh.triangles, *mesh.accelerator))
+		cout << "Couldn't write scene cache " << cache_path << endl;
+	meshes.push_back(mesh);
+	return meshes.size() - 1;
+}
 
-	// Print some stats.
-	int deepest = 0, biggest = 0;
-	tree->root->get_stats(deepest, biggest);
-//	cout << "kdTree depth = " << deepest << " max leaf size = " << biggest << endl;
+int Scene::add_instance(int mesh, const AffineTransform& object_to_world) {
+	return accelerator->add_instance(mesh, meshes.at(mesh).accelerator, meshes.at(mesh).bounds, object_to_world);
+}
 
-	// Allocate empty storage.
-	lights = new vector<Light>();
+RestPose::RestPose(const vector<Triangle>& triangles) {
+	// Find the distinct vertices by sorting all the triangles' corners by position, so that runs of equal positions are one vertex.
+	// Like compute_barycentric_normals, this relies on shared vertices being bit-identical.
+	vector<int> corners(3 * triangles.size());
+	iota(corners.begin(), corners.end(), 0);
+	auto position = [&](int corner) -> const Vec& { return triangles[corner / 3].points[corner % 3]; };
+	sort(corners.begin(), corners.end(), [&](int a, int b) {
+		const Vec &p = position(a), &q = position(b);
+		return lexicographical_compare(p.data(), p.data() + 3, q.data(), q.data() + 3);
+	});
+	vertex_ids.resize(corners.size());
+	for (size_t i = 0; i < corners.size(); i++) {
+		if (i == 0 or position(corners[i]) != position(corners[i - 1]))
+			vertices.push_back(position(corners[i]));
+		vertex_ids[corners[i]] = vertices.size() - 1;
+	}
+	order.resize(triangles.size());
+	iota(order.begin(), order.end(), 0);
 }
 
-Scene::~Scene() {
-	delete mesh;
-	delete lights;
-	delete tree;
+bool Scene::deform_mesh(int mesh_index, const function<Vec(const Vec&)>& deformation) {
+	SceneMesh& mesh = meshes.at(mesh_index);
+	// A mesh loaded from a cache lives in the read only mapping.
+	assert(mesh.triangles != nullptr);
+	if (mesh.rest == nullptr)
+		mesh.rest = new RestPose(*mesh.triangles);
+	RestPose& rest = *mesh.rest;
+
+	// Move each distinct vertex once, so that shared vertices stay bit-identical.
+	vector<Vec> positions(rest.vertices.size());
+	mesh.bounds = AABB();
+	for (size_t i = 0; i < positions.size(); i++) {
+		positions[i] = deformation(rest.vertices[i]);
+		mesh.bounds.update(positions[i]);
+	}
+	// Remake the triangles from the moved vertices, and then, as compute_barycentric_normals does, average their normals around each vertex.
+	vector<Triangle>& triangles = *mesh.triangles;
+	vector<Vec> vertex_normals(positions.size(), Vec(0, 0, 0));
+	for (size_t i = 0; i < triangles.size(); i++) {
+		const int* ids = &rest.vertex_ids[3 * rest.order[i]];
+		triangles[i] = Triangle(positions[ids[0]], positions[ids[1]], positions[ids[2]]);
+		for (int corner = 0; corner < 3; corner++)
+			vertex_normals[ids[corner]] += triangles[i].normal;
+	}
+	for (auto& normal : vertex_normals)
+		normal.normalize();
+	for (size_t i = 0; i < triangles.size(); i++) {
+		const int* ids = &rest.vertex_ids[3 * rest.order[i]];
+		triangles[i].set_normals(vertex_normals[ids[0]], vertex_normals[ids[1]], vertex_normals[ids[2]]);
+	}
+
+	// A rebuild may reorder the triangles, in which case the rest pose's order has to follow them.
+	bool rebuilt = mesh.accelerator->refit(&rest.order);
+	accelerator->set_mesh_bounds(mesh_index, mesh.bounds);
+	accelerator->build();
+	return rebuilt;
 }
 
 static inline Real square(Real x) {
 	return x * x;
 }
 
-Color Integrator::cast_ray(const Ray& ray, int recursions, int branches) {
-	normal_distribution<> light_delocalization_dist(0, 0.2);
-	Real param;
-	const Triangle* hit_triangle;
-	// These variables will hold barycentric coordinates of the hit.
-	Real u, v;
-	bool result = scene->tree->ray_test(ray, param, u, v, &hit_triangle);
-	// TODO: Remove this assert once I see that it never happens.
-//	if (not (u >= 0 and v >= 0 and u + v <= 1)) {
-//		cout << ">>>>> " << u << " " << v << " <<<<<" << endl;
-//	}
-//	assert(u >= 0 and v >= 0 and u + v <= 1);
-	Color energy(0, 0, 0);
-	if (result) {
-		// We Phong interpolate a normal for the hit, used for smooth shading.
-		Vec interpolated_normal = hit_triangle->base_normal + u * hit_triangle->u_normal + v * hit_triangle->v_normal;
-		interpolated_normal.normalize();
-//		Vec interpolated_normal = hit_triangle->normal; // XXX XXX XXX: Horrible debugging line! Don't leave this line in!
-		Vec hit = ray.origin + param * ray.direction;
-		// Lift the point off the surface.
-//		Vec embedded_hit = hit_triangle->project_point_to_given_altitude(hit, -1e-3);
-		hit = hit_triangle->project_point_to_given_altitude(hit, 1e-3);
-		Vec reflection = ray.direction - 2 * interpolated_normal.dot(ray.direction) * interpolated_normal;
-		reflection.normalize();
-		//*
-		if (recursions > 0) {
-			for (int branch = 0; branch < branches; branch++) {
-				// Compute a Lambertianly scattered ray.
-				Vec local_scatter_direction = sample_unit_sphere(engine);
-				local_scatter_direction(0) = real_abs(local_scatter_direction(0));
-				// Convert the triangle-local direction into global coordinates.
-				Vec d1 = hit_triangle->edge01.normalized();
-				Vec d2 = hit_triangle->normal.cross(d1);
-				Vec scatter_direction = local_scatter_direction(0) * hit_triangle->normal + local_scatter_direction(1) * d1 + local_scatter_direction(2) * d2;
-//				Vec scatter_direction = reflection;
+ShadingPoint Integrator::shading_point(const Ray& ray, Real param, Real u, Real v, const Triangle* hit_triangle, const MeshInstance* instance) {
+	ShadingPoint point;
+	// The triangle's normals go out to world space by the instance's normal transform, and its edges by its linear part.
+	point.normal = (instance->normal_to_world * hit_triangle->normal).normalized();
+	point.tangent = instance->object_to_world.vector(hit_triangle->edge01).normalized();
+	// We Phong interpolate a normal for the hit, used for smooth shading.
+	point.interpolated_normal = instance->normal_to_world * (hit_triangle->base_normal + u * hit_triangle->u_normal + v * hit_triangle->v_normal);
+	point.interpolated_normal.normalize();
+//	point.interpolated_normal = point.normal; // XXX XXX XXX: Horrible debugging line! Don't leave this line in!
+	// The ray parameter is the same in object and world space, so the hit comes straight from the world ray.
+	point.hit = ray.origin + param * ray.direction;
+	// Lift the point off the surface, as Triangle::project_point_to_given_altitude does, but in world space so the lift doesn't scale with the instance.
+	Vec centroid = instance->object_to_world.point((hit_triangle->points[0] + hit_triangle->points[1] + hit_triangle->points[2]) / 3.0);
+	point.hit += (point.normal.dot(centroid - point.hit) + 1e-3) * point.normal;
+	point.reflection = ray.direction - 2 * point.interpolated_normal.dot(ray.direction) * point.interpolated_normal;
+	point.reflection.normalize();
+	return point;
+}
+
+Ray Integrator::scattered_ray(const ShadingPoint& point, const Ray& ray) {
+	// Compute a Lambertianly scattered ray.
+	Vec local_scatter_direction = sampler.hemisphere();
+	// Convert the triangle-local direction, whose z axis is the normal, into global coordinates.
+	Vec d1 = point.tangent;
+	Vec d2 = point.normal.cross(d1);
+	Vec scatter_direction = local_scatter_direction(2) * point.normal + local_scatter_direction(0) * d1 + local_scatter_direction(1) * d2;
+//	Vec scatter_direction = point.reflection;
 /*
-				Real r = 1.0 / 1.05;
-				Vec opposing_normal = interpolated_normal;
-				Vec refraction_origin = embedded_hit;
-				if (interpolated_normal.dot(ray.direction) > 0) {
-					opposing_normal = - opposing_normal;
-					r = 1.0 / r;
-					refraction_origin = hit;
-				}
-//				bool totally_internally_reflected;
-//				Vec scatter_direction = fresnel_compute_refraction(r, ray.direction, opposing_normal, totally_internally_reflected);
-//				if (totally_internally_reflected)
-//					continue;
-//				Vec scatter_direction = ray.direction;
-				Vec scatter_direction = reflection;
+	Real r = 1.0 / 1.05;
+	Vec opposing_normal = point.interpolated_normal;
+	Vec refraction_origin = embedded_hit;
+	if (point.interpolated_normal.dot(ray.direction) > 0) {
+		opposing_normal = - opposing_normal;
+		r = 1.0 / r;
+		refraction_origin = hit;
+	}
+//	bool totally_internally_reflected;
+//	Vec scatter_direction = fresnel_compute_refraction(r, ray.direction, opposing_normal, totally_internally_reflected);
+//	if (totally_internally_reflected)
+//		continue;
+//	Vec scatter_direction = ray.direction;
+	Vec scatter_direction = point.reflection;
 */
-//				scatter_direction += 100 * reflection;
-//				scatter_direction.normalize();
-				scatter_direction = reflection;
-				Ray scattered_ray(hit, scatter_direction);
-				// Recursively sample the scattered light.
-				energy += (1.0 / branches) * 0.8 * cast_ray(scattered_ray, recursions-1, 1);
-			}
+//	scatter_direction += 100 * reflection;
+//	scatter_direction.normalize();
+	scatter_direction = point.reflection;
+	return Ray(point.hit, scatter_direction);
+}
+
+Vec Integrator::sample_to_light(const ShadingPoint& point, const Light& light) {
+	// First we compute a random amount to delocalize the light by.
+	// NB: Writing Vec(sampler.gaussian(), ...) would leave the order of the draws unspecified, so we draw them in separate statements.
+	Real d1 = sampler.gaussian();
+	Real d2 = sampler.gaussian();
+	Real d3 = sampler.gaussian();
+	Vec light_delocalization = LIGHT_DELOCALIZATION * Vec(d1, d2, d3);
+	return light_delocalization + light.position - point.hit;
+}
+
+Color Integrator::light_energy(const ShadingPoint& point, const Light& light, const Vec& to_light) {
+	Real distance_to_light = to_light.norm();
+	Color contribution = light.color / (distance_to_light * distance_to_light);
+	// Now we modulate the contribution by our surface shaders.
+	Real lambertian_coef = point.interpolated_normal.dot(to_light) / distance_to_light;
+	// NB: This next line took me FOREVER to debug!
+	// I had all these subtle artifacts, until eventually I tracked it down
+	// and realized that some paths were removing energy around the terminator
+	// of some illumination patterns. Eventually I realized it was because the
+	// Lambertian coefficient was negative as epsilons allowed negative normal
+	// dot products to the light. Holy cow, that took me way too long.
+	lambertian_coef = real_max(0.0, lambertian_coef);
+//	reflection.normalize();
+	Real phong_coef = real_max(0.0, point.reflection.dot(to_light) / distance_to_light);
+	phong_coef = square(square(square(square(phong_coef))));
+//	phong_coef = square(phong_coef);
+//	return contribution * phong_coef;
+	return contribution * (lambertian_coef + phong_coef); // * scene->lights->size();
+}
+
+int Integrator::light_slot_count() const {
+	return scene->light_samples == 0 ? scene->lights->size() : scene->light_samples;
+}
+
+const Light& Integrator::pick_light(const ShadingPoint& point, int slot, Real& weight) {
+	if (scene->light_samples == 0) {
+		weight = 1;
+		return (*scene->lights)[slot];
+	}
+	int light;
+	Real probability;
+	if (scene->use_light_tree) {
+		light = light_tree.sample(point.hit, sampler.uniform(), probability);
+	} else {
+		light = light_grid.sample(point.hit, sampler.uniform(), probability);
+	}
+	weight = 1.0 / (scene->light_samples * probability);
+	return (*scene->lights)[light];
+}
+
+Color Integrator::direct_energy(const ShadingPoint& point) {
+	Color energy(0, 0, 0);
+	if (scene->lights->empty())
+		return energy;
+	for (int slot = 0; slot < light_slot_count(); slot++) {
+		Real weight;
+		const Light& light = pick_light(point, slot, weight);
+		// Cast a ray to the light.
+		Vec to_light = sample_to_light(point, light);
+		Ray shadow_ray(point.hit, to_light);
+		if (not scene->accelerator->occluded(shadow_ray, to_light.norm()))
+			energy += weight * light_energy(point, light, to_light);
+	}
+	return energy;
+}
+
+Color Integrator::trace_path(ShadingPoint point, Ray ray) {
+	Color energy(0, 0, 0);
+	// The fraction of the energy arriving at the current point that makes it back along the path to the camera.
+	Color throughput(1, 1, 1);
+	for (int depth = 1; depth <= scene->max_path_depth; depth++) {
+		throughput *= SURFACE_REFLECTANCE;
+		if (depth > scene->roulette_depth) {
+			// Keep going with a probability following the throughput, and weight the surviving paths up to make up for those that stop.
+			Real survival = real_min(throughput.maxCoeff(), ROULETTE_MAX_SURVIVAL);
+			if (sampler.uniform() >= survival)
+				break;
+			throughput /= survival;
 		}
-//		*/
-		// Color by lights.
-		for (auto& light : *scene->lights) {
-//		{
-//			// Choose just one light to light with.
-//			Light& light = (*scene->lights)[(light_sample++) % scene->lights->size()];
-			// Cast a ray to the light.
-			// First we compute a random amount to delocalize the light by.
-			// I would have just written Vec ld(ldd(engine), ldd(engine), ldd(engine));, but this is actually undefined behavior!
-			// So instead I do a declaration here, because there is a sequence point at each comma in such a declaration,
-			// preventing the compiler from compiling this code as system("do something bad");
-			auto d1 = light_delocalization_dist(engine), d2 = light_delocalization_dist(engine), d3 = light_delocalization_dist(engine);
-			Vec light_delocalization(d1, d2, d3);
-			Vec to_light = light_delocalization + light.position - hit;
-			Ray shadow_ray(hit, to_light);
-			Real shadow_param;
-			Real ignore_u, ignore_v;
-			bool shadow_result = scene->tree->ray_test(shadow_ray, ignore_u, ignore_v, shadow_param);
-			Real distance_to_light = to_light.norm();
-			if ((not shadow_result) or shadow_param > distance_to_light) {
-				// Light is not obscured -- apply it.
-				Color contribution = light.color / (distance_to_light * distance_to_light);
-				// Now we modulate the contribution by our surface shaders.
-				Real lambertian_coef = interpolated_normal.dot(to_light) / distance_to_light;
-				// NB: This next line took me FOREVER to debug!
-				// I had all these subtle artifacts, until eventually I tracked it down
-				// and realized that some paths were removing energy around the terminator
-				// of some illumination patterns. Eventually I realized it was because the
-				// Lambertian coefficient was negative as epsilons allowed negative normal
-				// dot products to the light. Holy cow, that took me way too long.
-				lambertian_coef = real_max(0.0, lambertian_coef);
-//				reflection.normalize();
-				Real phong_coef = real_max(0.0, reflection.dot(to_light) / distance_to_light);
-				phong_coef = square(square(square(square(phong_coef))));
-//				phong_coef = square(phong_coef);
-				energy += (contribution * (lambertian_coef + phong_coef)); // * scene->lights->size();
-//				energy += contribution * phong_coef;
-			}
+		ray = scattered_ray(point, ray);
+		Real param;
+		const Triangle* hit_triangle;
+		const MeshInstance* hit_instance;
+		// These variables will hold barycentric coordinates of the hit.
+		Real u, v;
+		if (not scene->accelerator->ray_test_instance(ray, param, u, v, &hit_triangle, &hit_instance)) {
+			// Along this path we hit no geometry, and must sample the sky.
+			// For now we simply use a sky color (NOT an ambient color).
+			// If I implement HDR lighting this will become the panorama sampling.
+			energy += throughput.cwiseProduct(scene->sky_color);
+			break;
 		}
-	} else {
-		// Along this path we hit no geometry, and must sample the sky.
-		// For now we simply use a sky color (NOT an ambient color).
-		// If I implement HDR lighting this will become the panorama sampling.
-		energy = scene->sky_color;
+		point = shading_point(ray, param, u, v, hit_triangle, hit_instance);
+		energy += throughput.cwiseProduct(direct_energy(point));
 	}
 	return energy;
 }
 
-PassDescriptor::PassDescriptor() : start_x(0), start_y(0), width(-1), height(-1) {
+void Integrator::cast_packet(const Ray* rays, int count, const uint32_t* pixels, const uint32_t* sample_indices, Color* energies) {
+	PacketHits hits;
+	const MeshInstance* hit_instance[RAY_PACKET_SIZE];
+	scene->accelerator->ray_test_packet_instances(rays, count, hits, hit_instance);
+	ShadingPoint points[RAY_PACKET_SIZE];
+	for (int i = 0; i < count; i++) {
+		if (hits.hit[i]) {
+			points[i] = shading_point(rays[i], hits.hit_parameter[i], hits.hit_u[i], hits.hit_v[i], hits.hit_triangle[i], hit_instance[i]);
+			sampler.start_sample(pixels[i], sample_indices[i], PATH_STREAM);
+			energies[i] = trace_path(points[i], rays[i]);
+		} else {
+			energies[i] = scene->sky_color;
+		}
+	}
+	// Neighboring hits see a light along much the same directions, so we cast the shadow rays toward each light as a packet too.
+	// When lights are picked at random the hits in a packet may pick different ones, but their shadow rays still all leave from nearby points.
+	for (int slot = 0; slot < light_slot_count() and not scene->lights->empty(); slot++) {
+		Ray shadow_rays[RAY_PACKET_SIZE];
+		Vec to_light[RAY_PACKET_SIZE];
+		Real distance_to_light[RAY_PACKET_SIZE];
+		const Light* lights[RAY_PACKET_SIZE];
+		Real weights[RAY_PACKET_SIZE];
+		int lanes[RAY_PACKET_SIZE];
+		int shadow_count = 0;
+		for (int i = 0; i < count; i++) {
+			if (not hits.hit[i])
+				continue;
+			sampler.start_sample(pixels[i], sample_indices[i], DIRECT_LIGHT_STREAM + slot);
+			const Light& light = pick_light(points[i], slot, weights[shadow_count]);
+			lights[shadow_count] = &light;
+			to_light[shadow_count] = sample_to_light(points[i], light);
+			shadow_rays[shadow_count] = Ray(points[i].hit, to_light[shadow_count]);
+			distance_to_light[shadow_count] = to_light[shadow_count].norm();
+			lanes[shadow_count++] = i;
+		}
+		bool occluded[RAY_PACKET_SIZE];
+		scene->accelerator->occluded_packet(shadow_rays, distance_to_light, shadow_count, occluded);
+		for (int j = 0; j < shadow_count; j++)
+			if (not occluded[j])
+				energies[lanes[j]] += weights[j] * light_energy(points[lanes[j]], *lights[j], to_light[j]);
+	}
 }
 
-PassDescriptor::PassDescriptor(int start_x, int start_y, int width, int height) : start_x(start_x), start_y(start_y), width(width), height(height) {
+PassDescriptor::PassDescriptor() : start_x(0), start_y(0), width(-1), height(-1), sample_index(-1) {
+}
+
+PassDescriptor::PassDescriptor(int start_x, int start_y, int width, int height) : start_x(start_x), start_y(start_y), width(width), height(height), sample_index(-1) {
 }
 
 void PassDescriptor::clamp_bounds(int max_width, int max_height) {
@@ -182,9 +397,8 @@ void PassDescriptor::clamp_bounds(int max_width, int max_height) {
 		height = max_height - start_y;
 }
 
-Integrator::Integrator(int width, int height, Scene* scene) : scene(scene), engine(rd()) {
+Integrator::Integrator(int width, int height, Scene* scene) : scene(scene), sampler((uint64_t)rd() << 32 | rd()) {
 	passes = 0;
-	light_sample = 0;
 	// Allocate a canvas.
 	canvas = new Canvas(width, height);
 	canvas->zero();
@@ -209,9 +423,17 @@ Ray Integrator::get_ray_for_pixel(int x, int y) {
 }
 
 void Integrator::perform_pass(PassDescriptor desc) {
-	light_sample++;
+	// The grid costs time in the number of lights for each of its cells, so we only build the one we're picking lights with.
+	if (scene->light_samples != 0 and scene->use_light_tree) {
+		light_tree = LightTree(*scene->lights);
+	} else if (scene->light_samples != 0) {
+		AABB scene_bounds;
+		for (int i = 0; i < scene->accelerator->instance_count(); i++)
+			scene_bounds.update(scene->accelerator->instance(i).world_bounds);
+		light_grid = LightGrid(*scene->lights, scene_bounds);
+	}
+	sampler.set_low_discrepancy(scene->low_discrepancy);
 	// Iterate over the image.
-	// XXX: Use tiles instead for cache coherency.
 	Vec camera_right = scene->main_camera.direction.cross(scene->scene_up);
 	// A zero division on this next line indicates that camera_up is parallel to main_camera.
 	camera_right.normalize();
@@ -223,14 +445,6 @@ void Integrator::perform_pass(PassDescriptor desc) {
 
 	gettimeofday(&start, NULL);
 
-	// Used for DOF offsets.
-	// NB: By using a normal here I effectively have an aperature with a Gaussian response across its surface.
-	// This is a really weird assumption to make!
-	normal_distribution<> normal_dist(0, 1);
-
-	// Used for anti-aliasing sampling.
-	uniform_real_distribution<> uniform_dist(-0.5, 0.5);
-
 	Real plane_of_focus_distance = scene->plane_of_focus_distance;
 	Real dof_dispersion = scene->dof_dispersion;
 
@@ -240,29 +454,50 @@ void Integrator::perform_pass(PassDescriptor desc) {
 
 //	cout << "Got bounds: " << desc.start_x << "-" << stop_x << " " << desc.start_y << "-" << stop_y << endl;
 
+	// We trace the pass in square tiles, one packet of camera rays per tile, as rays through neighboring pixels mostly pass through
+	// the same nodes of the accelerator.
+	int stop_x = desc.start_x + desc.width, stop_y = desc.start_y + desc.height;
 	#pragma omp parallel for
-	for (int y = desc.start_y; y < desc.start_y + desc.height; y++) {
-		for (int x = desc.start_x; x < desc.start_x + desc.width; x++) {
-//	for (int y = 0; y < canvas->height; y++) {
-//		for (int x = 0; x < canvas->width; x++) {
-			Real dx = scene->camera_image_plane_width * (x + uniform_dist(engine) - canvas->width / 2.0) / (Real) canvas->width;
-			Real dy = -scene->camera_image_plane_width * (y + uniform_dist(engine) - canvas->height / 2.0) * aspect_ratio / (Real) canvas->height;
-			// Compute an offset into the image plane that the camera should face.
-			Vec offset = camera_right * dx + camera_up * dy;
-			Ray ray(scene->main_camera.origin, scene->main_camera.direction + offset);
-			// Add a depth of field perturbation.
-			Real dof_x_offset = normal_dist(engine) * dof_dispersion;
-			Real dof_y_offset = normal_dist(engine) * dof_dispersion;
-			ray.origin += dof_x_offset * camera_right;
-			ray.origin += dof_y_offset * camera_up;
-			ray.direction -= (dof_x_offset / plane_of_focus_distance) * camera_right;
-			ray.direction -= (dof_y_offset / plane_of_focus_distance) * camera_up;
+	for (int tile_y = desc.start_y; tile_y < stop_y; tile_y += PACKET_TILE_SIZE) {
+		for (int tile_x = desc.start_x; tile_x < stop_x; tile_x += PACKET_TILE_SIZE) {
+			Ray rays[RAY_PACKET_SIZE];
+			int pixel_x[RAY_PACKET_SIZE], pixel_y[RAY_PACKET_SIZE];
+			uint32_t pixels[RAY_PACKET_SIZE], sample_indices[RAY_PACKET_SIZE];
+			int count = 0;
+			for (int y = tile_y; y < min(tile_y + PACKET_TILE_SIZE, stop_y); y++) {
+				for (int x = tile_x; x < min(tile_x + PACKET_TILE_SIZE, stop_x); x++) {
+					pixels[count] = x + y * canvas->width;
+					sample_indices[count] = desc.sample_index != -1 ? desc.sample_index : *canvas->per_pixel_passes_ptr(x, y);
+					sampler.start_sample(pixels[count], sample_indices[count], CAMERA_STREAM);
+					// Jitter the ray uniformly within the pixel for anti-aliasing.
+					Real dx = scene->camera_image_plane_width * (x + sampler.uniform() - 0.5 - canvas->width / 2.0) / (Real) canvas->width;
+					Real dy = -scene->camera_image_plane_width * (y + sampler.uniform() - 0.5 - canvas->height / 2.0) * aspect_ratio / (Real) canvas->height;
+					// Compute an offset into the image plane that the camera should face.
+					Vec offset = camera_right * dx + camera_up * dy;
+					Ray ray(scene->main_camera.origin, scene->main_camera.direction + offset);
+					// Add a depth of field perturbation.
+					// NB: By using a normal here I effectively have an aperature with a Gaussian response across its surface.
+					// This is a really weird assumption to make!
+					Real dof_x_offset = sampler.gaussian() * dof_dispersion;
+					Real dof_y_offset = sampler.gaussian() * dof_dispersion;
+					ray.origin += dof_x_offset * camera_right;
+					ray.origin += dof_y_offset * camera_up;
+					ray.direction -= (dof_x_offset / plane_of_focus_distance) * camera_right;
+					ray.direction -= (dof_y_offset / plane_of_focus_distance) * camera_up;
+					rays[count] = ray;
+					pixel_x[count] = x;
+					pixel_y[count++] = y;
+				}
+			}
 			// Do the big expensive computation.
-			Color contribution = cast_ray(ray, 10, 1);
-			// Accumulate the energy into our buffer.
-			*canvas->pixel_ptr(x, y) += contribution;
-			// Mark that another pass is contributing to this pixel.
-			*canvas->per_pixel_passes_ptr(x, y) += 1;
+			Color contributions[RAY_PACKET_SIZE];
+			cast_packet(rays, count, pixels, sample_indices, contributions);
+			for (int i = 0; i < count; i++) {
+				// Accumulate the energy into our buffer.
+				*canvas->pixel_ptr(pixel_x[i], pixel_y[i]) += contributions[i];
+				// Mark that another pass is contributing to this pixel.
+				*canvas->per_pixel_passes_ptr(pixel_x[i], pixel_y[i]) += 1;
+			}
 		}
 	}
 
@@ -398,6 +633,8 @@ RenderEngine::~RenderEngine() {
 }
 
 void RenderEngine::issue_pass_desc(PassDescriptor desc) {
+	if (desc.sample_index == -1)
+		desc.sample_index = tile_samples_issued[make_pair(desc.start_x, desc.start_y)]++;
 	// Get a worker to dispatch to.
 	int worker = (total_passes_issued++) % workers.size();
 	workers[worker]->send_message(RenderMessage({false, desc}));
@@ -493,6 +730,7 @@ void RenderEngine::zero() {
 	// It is therefore safe to start mucking around with their canvases and mutating our state without locking.
 	total_passes_issued = 0;
 	total_passes_completed = 0;
+	tile_samples_issued.clear();
 	for (auto worker : workers)
 		worker->integrator->canvas->zero();
 }
@@ -3,55 +3,149 @@
 #ifndef _RENDER_INTEGRATOR_H
 #define _RENDER_INTEGRATOR_H
 
+#include <pthread.h>
+#include <semaphore.h>
 #include <string>
 #include <random>
 #include <vector>
-#include "kdtree.h"
+#include <list>
+#include <map>
+#include <functional>
+#include "accelerator.h"
+#include "instances.h"
 #include "canvas.h"
+#include "lighttree.h"
+#include "sampler.h"
 
 // Forward declaration.
 struct RenderEngine;
+class MappedSceneCache;
 
-struct Light {
-	Vec position;
-	Color color;
+// What deforming a mesh needs to remember about it as it was before the first deformation.
+struct RestPose {
+	// The distinct vertices of the mesh, and for each rest triangle the indices of its three vertices.
+	std::vector<Vec> vertices;
+	std::vector<int> vertex_ids;
+	// For each of the mesh's triangles, in their current order, the index of the rest triangle it is.
+	std::vector<int> order;
+
+	RestPose(const vector<Triangle>& triangles);
+};
+
+// A mesh read from one input, with the acceleration structure built over it, which any number of instances of it share.
+struct SceneMesh {
+	// This is nullptr when the mesh was loaded from a cache, in which case the triangles are only in the accelerator.
+	vector<Triangle>* triangles;
+	Accelerator* accelerator;
+	// The mapped cache that the accelerator refers into, if it was loaded from one.
+	MappedSceneCache* cache;
+	// The bounds of the mesh in its own object space.
+	AABB bounds;
+	// This is nullptr until the mesh is first deformed.
+	RestPose* rest;
 };
 
 struct Scene {
-	vector<Triangle>* mesh;
+	std::vector<SceneMesh> meshes;
 	vector<Light>* lights;
-	kdTree* tree;
+	// The top level over all the instances of the meshes, which is what rays are cast against.
+	// After adding or moving instances call accelerator->build(), which only rebuilds this top level.
+	InstanceTree* accelerator;
 	Ray main_camera;
 	Vec scene_up;
 	Real camera_image_plane_width;
 	Real plane_of_focus_distance;
 	Real dof_dispersion;
 	Color sky_color;
-
-	Scene(std::string path);
+	// Paths bounce at most max_path_depth times after the camera ray's hit. Past roulette_depth bounces each path goes on with a
+	// probability following how much energy it still carries, and is weighted up to make up for the paths that stop, so dim paths
+	// mostly end early at no cost in bias. Setting roulette_depth to max_path_depth or more traces every path the full depth.
+	int max_path_depth;
+	int roulette_depth;
+	// Each hit casts this many shadow rays, each toward a light picked at random, so that the cost of direct lighting doesn't grow
+	// with the number of lights. Zero casts one shadow ray toward every light instead.
+	int light_samples;
+	// Draw samples from low discrepancy sequences over each pixel's samples, rather than independently at random.
+	bool low_discrepancy;
+	// When sampling lights, pick them with a LightTree, which favors the lights near each hit, rather than a LightGrid, which favors
+	// the lights near each hit's cell of a coarse grid over the scene, in constant time.
+	bool use_light_tree;
+
+	// An empty scene, to add meshes and instances of them to.
+	Scene();
+	// A scene of just one instance of the input, left where it is. The arguments are as for add_mesh.
+	Scene(std::string path, std::string accelerator_name="kdtree", std::string cache_directory="");
 	~Scene();
+	// Reads the input and builds the named accelerator over it (as per build_accelerator), returning the index of the new mesh,
+	// or -1 if the input couldn't be read. The mesh doesn't appear in the scene until instances of it are added.
+	// If a cache directory is given then the triangles and accelerator are loaded from a cache there of the same input contents,
+	// skipping reading the STL and building altogether, or else are read and built as usual, and then saved to the cache.
+	int add_mesh(std::string path, std::string accelerator_name="kdtree", std::string cache_directory="");
+	// Places an instance of the mesh, returning the instance's index in the accelerator.
+	int add_instance(int mesh, const AffineTransform& object_to_world=AffineTransform());
+	// Moves every vertex of the mesh to where the deformation takes its position before the first deformation, and brings the mesh's
+	// accelerator (by refitting it, if that leaves it good enough) and the top level up to date. Returns true if the mesh's accelerator
+	// had to be rebuilt. Only meshes that were read, rather than loaded from a scene cache, can be deformed.
+	bool deform_mesh(int mesh, const std::function<Vec(const Vec&)>& deformation);
 };
 
 struct PassDescriptor {
 	int start_x, start_y;
 	// If these values are set to -1 then it indicates full width/height.
 	int width, height;
+	// Which sample of each of its pixels the pass takes, for low discrepancy sampling. If this is -1 then the integrator counts its
+	// own samples of each pixel, which is right as long as it's the only integrator rendering them.
+	int sample_index;
 
 	PassDescriptor();
 	PassDescriptor(int start_x, int start_y, int width, int height);
 	void clamp_bounds(int max_width, int max_height);
 };
 
+// What shading needs to know about a hit, all in world space.
+struct ShadingPoint {
+	// The hit, lifted slightly off the surface so that rays leaving it don't hit the same triangle again.
+	Vec hit;
+	// The triangle's own normal, and the direction of its first edge, which together give a frame for scattering.
+	Vec normal, tangent;
+	Vec interpolated_normal;
+	Vec reflection;
+};
+
 struct Integrator {
 	Scene* scene;
 	Canvas* canvas;
 	int passes;
 	double last_pass_seconds;
 	random_device rd;
-	mt19937 engine;
-	int light_sample;
-
-	Color cast_ray(const Ray& ray, int recursions, int branches);
+	// Each thread has its own integrator, and so its own sampler.
+	Sampler sampler;
+	// Pick lights by roughly how much they light each point, as per scene->use_light_tree.
+	// Whichever is in use is rebuilt at the start of each pass in case the lights have changed.
+	LightTree light_tree;
+	LightGrid light_grid;
+
+	// Casts up to RAY_PACKET_SIZE coherent rays, such as the camera rays through a block of pixels, writing the energy along each into energies.
+	// The shadow rays from their hits toward each light are cast as a packet too, and then each path carries on by itself.
+	// Each ray's path draws from the given sample of the given pixel.
+	void cast_packet(const Ray* rays, int count, const uint32_t* pixels, const uint32_t* sample_indices, Color* energies);
+	// The hit triangle and its barycentric coordinates are in the instance's object space, as the accelerator reports them.
+	ShadingPoint shading_point(const Ray& ray, Real param, Real u, Real v, const Triangle* hit_triangle, const MeshInstance* instance);
+	// The direction light arriving along the ray leaves the point in.
+	Ray scattered_ray(const ShadingPoint& point, const Ray& ray);
+	// The light reaching the point straight from the lights, casting a shadow ray toward each light picked.
+	Color direct_energy(const ShadingPoint& point);
+	// Follows the path from the point, reached along the ray, bouncing until it escapes, is stopped by Russian roulette, or reaches
+	// the scene's max_path_depth, and returns the energy it gathers from all the bounces after the point itself.
+	Color trace_path(ShadingPoint point, Ray ray);
+	// How many shadow rays each hit casts, as per scene->light_samples.
+	int light_slot_count() const;
+	// Picks the light for one of the point's shadow rays, setting weight to what its contribution must be scaled by to keep the sum unbiased.
+	const Light& pick_light(const ShadingPoint& point, int slot, Real& weight);
+	// Picks a random point around the light, and returns the offset to it from the point being shaded.
+	Vec sample_to_light(const ShadingPoint& point, const Light& light);
+	// The light's contribution through the given offset to it, assuming nothing blocks it.
+	Color light_energy(const ShadingPoint& point, const Light& light, const Vec& to_light);
 	Ray get_ray_for_pixel(int x, int y);
 
 	Integrator(int width, int height, Scene* scene);
@@ -94,6 +188,8 @@ struct RenderEngine {
 	Canvas* master_canvas;
 	int total_passes_issued;
 	int tile_width, tile_height;
+	// How many samples of each tile, keyed by its corner, have been issued, which numbers the tiles' samples across all the workers.
+	std::map<std::pair<int, int>, int> tile_samples_issued;
 
 	std::vector<RenderThread*> workers;
 	// This semaphore gets posted to once for each completed pass by a worker thread.
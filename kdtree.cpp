@@ -7,575 +7,1200 @@ using namespace std;
 #include <algorithm>
 #include <iostream>
 #include <map>
+#include <limits>
 #include "kdtree.h"
+#include "scheduler.h"
+#include "radixsort.h"
+#include "arena.h"
+#include "scenecache.h"
 
-#define LEAF_THRESHOLD 8
-#define MAXIMUM_DEPTH 19 //8
+// The relative costs of visiting a node and testing a triangle, used by the Surface Area Heuristic.
+// Nodes are compact and cheap to step through, while a triangle test (or a whole block, with SIMD_LEAVES) is a lot more arithmetic.
+#define SAH_TRAVERSAL_COST 1.0
+#define SAH_INTERSECTION_COST 2.0
+#ifdef PRECISE_BVH
+#define SAH_BINS 256
+#else
+#define SAH_BINS 32
+#endif
+// When leaves are intersected a block at a time, a partly full block costs as much as a full one.
+#ifdef LEAF_BLOCK_WIDTH
+#define SAH_TRIANGLE_COUNT_COST(count) ((Real)(((count) + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH))
+#else
+#define SAH_TRIANGLE_COUNT_COST(count) ((Real)(count))
+#endif
+// The SAH decides when to stop splitting, so this depth limit is only a safety net against degenerate geometry.
+#define MAXIMUM_DEPTH 48
+// Traversal only stacks a node's far child when both children need visiting, which only happens at real splits on the
+// current path, never at the cut nodes inserted when flattening, so the stack can't get deeper than the tree.
+#define TRAVERSAL_STACK_SIZE MAXIMUM_DEPTH
 // If a child would have this many or fewer triangles then we just build its node ourselves, rather than paying the overhead of dispatching to a thread.
 #define THREADED_DISPATCH_THRESHOLD 16
+// Nodes with at least this many triangles spread the passes over their triangles across every thread.
+#define PARALLEL_NODE_THRESHOLD 32768
+// When flattening, if a node leaves at least this fraction of its region's extent empty on one side, then we insert a node to cut the empty space off.
+#define EMPTY_SPACE_CUT_FRACTION 0.1
+// The clip on the empty side of a cut node, which is so far out that no ray's interval reaches it. It's the largest finite Real rather
+// than infinity, so that refitting can spot the empty side by comparing against it, which -ffast-math doesn't promise for infinities.
+#define CUT_NODE_EMPTY_CLIP (numeric_limits<Real>::max())
+
+// Everything shared by the nodes of one build, which all goes away at once when the build is done.
+struct kdBuildContext {
+	// This is nullptr to build serially.
+	TaskScheduler* scheduler;
+	vector<Triangle>* all_triangles;
+	int triangle_count;
+	// Each node's six sorted lists are ranges at the same offset in each of six lists, all of which are stored in one of two buffers.
+	// A node partitions its lists into its children's, at the same offsets in the other buffer, with the low child's lists first.
+	// A node's range of the other buffer held its parent's lists, which are no longer needed, and siblings' ranges never overlap,
+	// so the two buffers, allocated up front at exactly the size of the presorted lists, hold the lists of the whole tree.
+	// This also means that a leaf can just point to its range of the lists, as nothing ever overwrites it.
+	vector<int> buffers[2];
+	// The nodes are allocated from an arena for each thread, so the threads don't contend over the heap.
+	vector<BumpArena*> arenas;
+
+	// Returns the list of the triangles sorted by their minima (minmax = 0) or maxima (minmax = 1) along the axis, in the given buffer.
+	int* list(int buffer, int minmax, int axis) {
+		return buffers[buffer].data() + (size_t)(minmax * 3 + axis) * triangle_count;
+	}
+
+	BumpArena& arena() {
+		return *arenas[scheduler != nullptr ? scheduler->worker_index() : 0];
+	}
+};
+
+// Builds the subtree over the triangles at the given range of the lists in the buffer into *destination.
+static void build_subtree(kdTreeNode** destination, kdBuildContext* context, int depth, int buffer, int offset, int triangle_count) {
+	*destination = context->arena().create<kdTreeNode>(context, depth, buffer, offset, triangle_count);
+}
+
+// The SAH bins along each axis, as filled in by one chunk of a node's triangles.
+struct SAHBins {
+	int counts[3][SAH_BINS] = {};
+	AABB bounds[3][SAH_BINS];
+};
+
+// How many triangles in one chunk of each of a node's six lists go to the low side, and then where in the low side's lists they go.
+struct LowSideCounts {
+	int lists[6];
+};
+
+// Per-chunk scratch for one of a node's passes over its triangles. Almost every node does its passes in a single chunk, which we
+// keep on the stack; only the few big nodes near the root, which split their passes across threads, put their chunks on the heap.
+template <typename T>
+class ChunkScratch {
+	T single;
+	vector<T> many;
+	T* chunks;
 
-void kdTreeNode::form_as_leaf_from(vector<int>* indices, vector<Triangle>* all_triangles) {
-	unsigned int triangle_count = indices->size();
+public:
+	ChunkScratch(int chunk_count) : single(), many(chunk_count > 1 ? chunk_count : 0), chunks(chunk_count > 1 ? many.data() : &single) {
+	}
+
+	T& operator[](int chunk) {
+		return chunks[chunk];
+	}
+};
+
+void kdTreeNode::form_as_leaf_from(int* indices, int triangle_count) {
 	is_leaf = true;
 	stored_triangle_count = triangle_count;
-	// This allocation is freed at deletion time.
-	stored_triangles = new Triangle[triangle_count]();
-	// Copy the triangles over.
-	int i = 0;
-	for (auto iter = indices->begin(); iter != indices->end(); iter++, i++) {
-		stored_triangles[i] = (*all_triangles)[*iter];
-	}
+	stored_indices = indices;
 	// We're done building!
 	low_side = high_side = nullptr;
 }
 
-kdTreeNode::kdTreeNode(kdTree* parent, int depth, vector<int>* sorted_indices_by_min[3], vector<int>* sorted_indices_by_max[3], vector<Triangle>* all_triangles) : depth(depth) {
-	// Pull out an arbitrary ordering of all our indices for convenience use later.
-	vector<int>& all_our_indices = *sorted_indices_by_min[0];
+kdTreeNode::kdTreeNode(kdBuildContext* context, int depth, int buffer, int offset, int _triangle_count) : depth(depth) {
+	TaskScheduler* scheduler = context->scheduler;
+	vector<Triangle>* all_triangles = context->all_triangles;
 	// Make a quick way of accessing both _by_min and _by_max via an index to keep the following code DRYer.
-	vector<int>** sorted_indices_by[2] = {sorted_indices_by_min, sorted_indices_by_max};
+	int* sorted_indices_by[2][3];
+	for (int minmax = 0; minmax < 2; minmax++)
+		for (int axis = 0; axis < 3; axis++)
+			sorted_indices_by[minmax][axis] = context->list(buffer, minmax, axis) + offset;
+	// Pull out an arbitrary ordering of all our indices for convenience use later.
+	int* all_our_indices = sorted_indices_by[0][0];
 	// Store the total number of triangles that will be managed from here on down in the tree.
-	unsigned int triangle_count = sorted_indices_by_min[0]->size();
+	unsigned int triangle_count = _triangle_count;
 	total_triangles = triangle_count;
-	// Make sure the six sorted indices lists are the same length.
-	assert(triangle_count == sorted_indices_by_min[1]->size() and triangle_count == sorted_indices_by_min[2]->size());
-	assert(triangle_count == sorted_indices_by_max[0]->size() and triangle_count == sorted_indices_by_max[1]->size() and triangle_count == sorted_indices_by_max[2]->size());
+	// Each pass over our triangles below is done in chunks. Near the top of the tree there are only a few nodes, each with a huge
+	// number of triangles, so there we give every thread a chunk; otherwise all but a few threads would sit idle until the tree had
+	// branched out enough to keep them all busy with subtrees. Lower down, we do each pass as one chunk.
+	TaskScheduler* chunk_scheduler = nullptr;
+	int chunk_count = 1;
+	if (scheduler != nullptr and triangle_count >= PARALLEL_NODE_THRESHOLD) {
+		chunk_scheduler = scheduler;
+		chunk_count = scheduler->thread_count();
+	}
 	// Debug: Confirm that our input lists are sorted.
-	for (int axis = 0; axis < 3; axis++) {
-		for (int minmax = 0; minmax < 2; minmax++) {
-			// Be careful with signs here: If triangle_count (an unsigned quantity) is 0 then subtracting one yields a huge loop. Thus the cast.
-			for (int i = 0; i < ((int)triangle_count) - 1; i++) {
-				int index1 = (*sorted_indices_by[minmax][axis])[i];
-				int index2 = (*sorted_indices_by[minmax][axis])[i+1];
-				Triangle& tri1 = (*all_triangles)[index1];
-				Triangle& tri2 = (*all_triangles)[index2];
-				if (minmax == 0)
-					assert(tri1.aabb.minima(axis) <= tri2.aabb.minima(axis));
-				else
-					assert(tri1.aabb.maxima(axis) <= tri2.aabb.maxima(axis));
+	for_each_chunk(chunk_scheduler, triangle_count, chunk_count, [&](int chunk, int chunk_begin, int chunk_end) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (int minmax = 0; minmax < 2; minmax++) {
+				// Be careful with signs here: If triangle_count (an unsigned quantity) is 0 then subtracting one yields a huge loop. Thus the cast.
+				for (int i = chunk_begin; i < chunk_end and i < ((int)triangle_count) - 1; i++) {
+					int index1 = sorted_indices_by[minmax][axis][i];
+					int index2 = sorted_indices_by[minmax][axis][i+1];
+					Triangle& tri1 = (*all_triangles)[index1];
+					Triangle& tri2 = (*all_triangles)[index2];
+					if (minmax == 0)
+						assert(tri1.aabb.minima(axis) <= tri2.aabb.minima(axis));
+					else
+						assert(tri1.aabb.maxima(axis) <= tri2.aabb.maxima(axis));
+				}
 			}
 		}
-	}
-	// Update our AABB.
-	for (int index : all_our_indices)
-		aabb.update((*all_triangles)[index].aabb);
+	});
+	// Update our AABB, with each chunk bounding its own triangles.
+	ChunkScratch<AABB> chunk_bounds(chunk_count);
+	for_each_chunk(chunk_scheduler, triangle_count, chunk_count, [&](int chunk, int chunk_begin, int chunk_end) {
+		AABB bounds;
+		for (int i = chunk_begin; i < chunk_end; i++)
+			bounds.update((*all_triangles)[all_our_indices[i]].aabb);
+		chunk_bounds[chunk] = bounds;
+	});
+	for (int chunk = 0; chunk < chunk_count; chunk++)
+		aabb.update(chunk_bounds[chunk]);
 	// We should never get zero triangles to a node!
 //	if (triangle_count == 0)
 //		cout << "Zero at depth: " << depth << endl;
 //	assert(triangle_count > 0);
-	// If the there are fewer than three triangles left then store the one or two.
-	if (triangle_count <= LEAF_THRESHOLD or depth >= MAXIMUM_DEPTH) {
-		form_as_leaf_from(&all_our_indices, all_triangles);
-		return;
-	}
-	// Otherwise we perform a split, and have no triangles.
-	is_leaf = false;
-	stored_triangle_count = 0;
-	stored_triangles = nullptr;
-	// Find the best split height and axis.
-	// We initialize best_sh_so_far and best_sh_axis only to suppress compiler warnings -- these values should never be used.
+	// Find the best split height and axis by the Surface Area Heuristic (SAH).
+	// We estimate the cost of a ray that reaches us as SAH_TRAVERSAL_COST plus SAH_INTERSECTION_COST times the number of
+	// triangles in each child, weighted by the probability that the ray also hits that child, which for uniformly distributed
+	// rays is the ratio of the child's surface area to ours. Because we weigh by the children's actual AABBs rather than the
+	// half-spaces on either side of the split, empty space costs something: a child whose box is padded out with nothing still
+	// pays for every ray that passes through the padding, so splits that cut empty space away from the geometry are favored.
+	// Rather than trying every triangle as a candidate we drop the triangles into SAH_BINS bins by their minima along each axis,
+	// and only consider splitting on the bin boundaries.
+	Real node_area = aabb.surface_area();
+	// We become a leaf if no split beats the cost of simply testing all our triangles.
+	Real best_sh_score = SAH_INTERSECTION_COST * SAH_TRIANGLE_COUNT_COST(triangle_count);
+	// We initialize best_sh_so_far only to suppress compiler warnings -- this value should never be used.
 	Real best_sh_so_far = 0.0;
 	int best_sh_axis = -1;
-	Real best_sh_score = FLOAT_INF;
-	// Here we pick the sparsity with which to check the triangles as potential splits.
-	// A simple exponential scheme is chosen, with more refinement for fewer triangles.
-	// Some quick experiments I ran showed that this scheme results in about 0.4% more
-	// ray-triangle intersections per ray than simply trying every triangle. However,
-	// this scheme more than doubles the speed of building on a 1.1M triangle test
-	// model, specifically taking it down from ~15 seconds to ~7 seconds. If we say
-	// that thirty minutes of rendering per BVH rebuild is our typical use case when
-	// being used for animation then this is net neutral.
-//#define PRECISE_BVH
-#ifdef PRECISE_BVH
-	int triangle_increment = 1;
-#else
-	int triangle_increment = 8;
-	if (triangle_count < 10000)
-		triangle_increment = 4;
-	if (triangle_count < 1000)
-		triangle_increment = 2;
-	if (triangle_count < 100)
-		triangle_increment = 1;
-#endif
-	// XXX: Debugging.
-	if (depth == 0)
-		start_performance_counter();
-//	#pragma omp parallel for if(depth==0)
-	for (int potential_split_axis = 0; potential_split_axis < 3; potential_split_axis++) {
-//	{
-//		int potential_split_axis = aabb.longest_axis();
-		for (unsigned int tri_test = 0; tri_test < triangle_count; tri_test += triangle_increment) {
-			Real sample_sh = (*all_triangles)[all_our_indices[tri_test]].aabb.maxima(potential_split_axis);
-			// Apply binary search to count in log(n) time how many triangles will be above and how many will be below.
-			int count_on_side[2] = {0, 0};
-			for (int minmax = 0; minmax < 2; minmax++) {
-				unsigned int low = 0, high = triangle_count;
-				while (low + 1 < high) {
-					unsigned int mid = (low + high) / 2;
-					int triangle_index = (*sorted_indices_by[minmax][potential_split_axis])[mid];
-					Triangle& tri = (*all_triangles)[triangle_index];
-					Real coord = minmax == 0 ? tri.aabb.minima(potential_split_axis) : tri.aabb.maxima(potential_split_axis);
-					// If you check very carefully, the following line is actually equivalent to the obvious implementation, as given by this command:
-					/* python -c 'print "eJxTUMAEmWkKGrmZebmJFQq2tgoGmgrVXFhUwZUm5+cXpSjY2CoUJ+YW5KTGF2do4lQPAjn55Qq2\
-					   CrmZKdY4laXmFKfiNSMjMz0DnyG1YCOIcrgdse4mZCdRDifg+VouAAh/Svc=".decode("base64").decode("zlib")' */
-					(coord <= sample_sh ? low : high) = mid;
+	if (triangle_count > 1 and node_area > 0) {
+		Real low_edges[3], bin_scales[3];
+		bool binnable[3];
+		for (int axis = 0; axis < 3; axis++) {
+			low_edges[axis] = aabb.minima(axis);
+			Real extent = aabb.maxima(axis) - low_edges[axis];
+			binnable[axis] = extent > 0;
+			bin_scales[axis] = binnable[axis] ? SAH_BINS / extent : 0;
+		}
+		// Each chunk fills in its own bins for all three axes in a single pass over its triangles, and then we merge them.
+		// The counts add up and the bounds union up to exactly what binning everything in one go would have given.
+		ChunkScratch<SAHBins> chunk_bins(chunk_count);
+		for_each_chunk(chunk_scheduler, triangle_count, chunk_count, [&](int chunk, int chunk_begin, int chunk_end) {
+			SAHBins& bins = chunk_bins[chunk];
+			for (int i = chunk_begin; i < chunk_end; i++) {
+				const AABB& tri_aabb = (*all_triangles)[all_our_indices[i]].aabb;
+				for (int axis = 0; axis < 3; axis++) {
+					if (not binnable[axis])
+						continue;
+					int bin = min(SAH_BINS - 1, (int)((tri_aabb.minima(axis) - low_edges[axis]) * bin_scales[axis]));
+					bins.counts[axis][bin]++;
+					bins.bounds[axis][bin].update(tri_aabb);
 				}
-				if (minmax == 0)
-					count_on_side[minmax] = low + 1;
-				else
-					count_on_side[minmax] = triangle_count - high;
 			}
-			// Current heuristic: Minimize the size of the largest subtree.
-			Real score = real_max(count_on_side[0], count_on_side[1]);
-			// New heuristic: Surface Area Heuristic (SAH)
-//			Real low_sa = sample_sh - aabb.minima(potential_split_axis);
-//			Real high_sa = aabb.maxima(potential_split_axis) - sample_sh;
-//			assert(low_sa >= 0);
-//			assert(high_sa >= 0);
-//			Real score = low_sa * count_on_side[0] + high_sa * count_on_side[1];
-//			score /= (low_sa + high_sa);
-//			score += mini_score * 0.2;
-//			score = mini_score;
-			if (score < best_sh_score) {
-				best_sh_so_far = sample_sh;
-				best_sh_axis = potential_split_axis;
-				best_sh_score = score;
+		});
+		SAHBins& bins = chunk_bins[0];
+		for (int chunk = 1; chunk < chunk_count; chunk++) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int bin = 0; bin < SAH_BINS; bin++) {
+					bins.counts[axis][bin] += chunk_bins[chunk].counts[axis][bin];
+					bins.bounds[axis][bin].update(chunk_bins[chunk].bounds[axis][bin]);
+				}
+			}
+		}
+		for (int potential_split_axis = 0; potential_split_axis < 3; potential_split_axis++) {
+			if (not binnable[potential_split_axis])
+				continue;
+			const int* bin_counts = bins.counts[potential_split_axis];
+			const AABB* bin_bounds = bins.bounds[potential_split_axis];
+			// Sweep down from the top to get the area and count above each boundary, where high_areas[i] and high_counts[i] cover bins i and up.
+			Real high_areas[SAH_BINS];
+			int high_counts[SAH_BINS];
+			AABB accumulated;
+			int count = 0;
+			for (int bin = SAH_BINS - 1; bin > 0; bin--) {
+				accumulated.update(bin_bounds[bin]);
+				count += bin_counts[bin];
+				high_areas[bin] = accumulated.surface_area();
+				high_counts[bin] = count;
+			}
+			// Then sweep up, scoring a split between each bin and the next.
+			accumulated = AABB();
+			count = 0;
+			for (int bin = 0; bin < SAH_BINS - 1; bin++) {
+				accumulated.update(bin_bounds[bin]);
+				count += bin_counts[bin];
+				// Splits with nothing on one side make no progress, as the other child would be the same as us.
+				if (count == 0 or count == (int)triangle_count)
+					continue;
+				Real weighted_triangles = accumulated.surface_area() * SAH_TRIANGLE_COUNT_COST(count) + high_areas[bin+1] * SAH_TRIANGLE_COUNT_COST(high_counts[bin+1]);
+				Real score = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * weighted_triangles / node_area;
+				if (score < best_sh_score) {
+					best_sh_so_far = low_edges[potential_split_axis] + (bin + 1) / bin_scales[potential_split_axis];
+					best_sh_axis = potential_split_axis;
+					best_sh_score = score;
+				}
 			}
 		}
 	}
-	if (depth == 0) {
-//		cout << "Time for first sort: ";
-//		print_performance_counter();
-//		cout << endl;
+	// If no split is worth it (or we've hit our safety net on depth) then we store all our triangles.
+	if (best_sh_axis == -1 or depth >= MAXIMUM_DEPTH) {
+		form_as_leaf_from(all_our_indices, triangle_count);
+		return;
 	}
+	// Otherwise we perform a split, and have no triangles.
+	is_leaf = false;
+	stored_triangle_count = 0;
+	stored_indices = nullptr;
 	split_axis = best_sh_axis;
 	assert(split_axis == 0 or split_axis == 1 or split_axis == 2);
 	split_height = best_sh_so_far;
-	// Produce three new sorted lists for each side of the divider.
-	vector<int>* low_side_sorted_by_min[3];
-	vector<int>* low_side_sorted_by_max[3];
-	vector<int>** low_side_sorted_by[2] = {low_side_sorted_by_min, low_side_sorted_by_max};
-	vector<int>* high_side_sorted_by_min[3];
-	vector<int>* high_side_sorted_by_max[3];
-	vector<int>** high_side_sorted_by[2] = {high_side_sorted_by_min, high_side_sorted_by_max};
-	// Produce the sorted index sublists for the high and low sides.
-	for (int axis = 0; axis < 3; axis++) {
-		for (int minmax = 0; minmax < 2; minmax++) {
-			low_side_sorted_by[minmax][axis] = new vector<int>();
-			high_side_sorted_by[minmax][axis] = new vector<int>();
-			// Filter through the various indices.
-			for (unsigned int i = 0; i < triangle_count; i++) {
-				// Pick out the ith triangle index from the given sorted index list.
-				int triangle_index = (*sorted_indices_by[minmax][axis])[i];
-				Triangle& tri = (*all_triangles)[triangle_index];
-				// Figure out if this triangle is crossing the boundary, above, or below.
-				bool overlaps_below = tri.aabb.minima(split_axis) <= split_height;
-				bool overlaps_above = tri.aabb.maxima(split_axis) > split_height;
-				assert(tri.aabb.minima(split_axis) <= tri.aabb.maxima(split_axis));
-				assert(overlaps_below or overlaps_above);
-//				if (overlaps_below and overlaps_above)
-//					continue;
-				if (overlaps_below) {
-					low_side_sorted_by[minmax][axis]->push_back(triangle_index);
-					continue;
-				}
-				if (overlaps_above)
-					high_side_sorted_by[minmax][axis]->push_back(triangle_index);
-			}
-		}
+	// Triangles that straddle the split go to the low side, along with those entirely below it.
+	int axis_to_split = split_axis;
+	Real height = split_height;
+	auto goes_low = [=](const Triangle& tri) {
+		assert(tri.aabb.minima(axis_to_split) <= tri.aabb.maxima(axis_to_split));
+		return tri.aabb.minima(axis_to_split) <= height;
+	};
+	// We partition each of our six lists into a list for each side, keeping the order, so the new lists come out sorted too.
+	// This is a parallel prefix sum: each chunk of each list counts how many of its triangles go low, summing the counts of the
+	// chunks before it then gives where its triangles go in each new list, and so every chunk can copy its triangles into place
+	// without regard to the others. The lists are numbered minmax * 3 + axis, and list_chunk_count pieces of work cover them all.
+	int list_chunk_count = 6 * chunk_count;
+	ChunkScratch<LowSideCounts> low_offsets(chunk_count);
+	for_each_chunk(chunk_scheduler, list_chunk_count, list_chunk_count, [&](int list_chunk, int, int) {
+		int list = list_chunk / chunk_count, chunk = list_chunk % chunk_count;
+		const int* indices = sorted_indices_by[list / 3][list % 3];
+		int chunk_begin = (long long)triangle_count * chunk / chunk_count;
+		int chunk_end = (long long)triangle_count * (chunk + 1) / chunk_count;
+		int count = 0;
+		for (int i = chunk_begin; i < chunk_end; i++)
+			count += goes_low((*all_triangles)[indices[i]]);
+		low_offsets[chunk].lists[list] = count;
+	});
+	// Each list covers the same triangles, so they all split the same way, and the first list's counts give the sizes of the sides.
+	unsigned int low_size = 0;
+	for (int chunk = 0; chunk < chunk_count; chunk++)
+		low_size += low_offsets[chunk].lists[0];
+	unsigned int high_size = triangle_count - low_size;
+	// The SAH never picks a split with an empty side, but the bins are only an estimate of the actual partition -- a triangle
+	// whose minimum lands right on the split height can fall either way -- so we still check for "non-improvement" here.
+	// If either our high or low side ends up being the same size as we are then we become a leaf, as recursing would be pointless.
+	if (high_size == triangle_count or low_size == triangle_count) {
+		form_as_leaf_from(all_our_indices, triangle_count);
+		return;
 	}
-	// Make sure the different axis sortings have the same number of nodes.
-	for (int axis = 0; axis < 3; axis++) {
-		for (int minmax = 0; minmax < 2; minmax++) {
-			assert(low_side_sorted_by[minmax][0]->size() == low_side_sorted_by[minmax][axis]->size());
-			assert(high_side_sorted_by[minmax][0]->size() == high_side_sorted_by[minmax][axis]->size());
+	// Turn the counts into offsets, restarting at zero for each list.
+	for (int list = 0; list < 6; list++) {
+		int offset = 0;
+		for (int chunk = 0; chunk < chunk_count; chunk++) {
+			int count = low_offsets[chunk].lists[list];
+			low_offsets[chunk].lists[list] = offset;
+			offset += count;
 		}
+		// Make sure the different lists split into the same number of triangles.
+		assert(offset == (int)low_size);
 	}
-	// Now we compute whether or not to become a leaf anyway (not just because we have too few triangles or hit our depth limit), or subdivide.
-	// We choose to be a leaf if either our high or low side ends up being the same size as we are -- "non-improvement".
-	// Becoming a leaf if this "non-improvement" occurs prevents a pointless recursion up to our depth limit building huge trees.
-	// XXX: This ONLY works because the above code currently optimizes for the split axis that minimizes maximum subtree total triangle count!
-	// Once I switch to SAH I'll have to change this heuristic, because then we will very frequently want to
-	// subdivide with an entire empty subtree, and this heuristic here would prematurely terminate the subdivision.
-	unsigned int low_size = low_side_sorted_by_min[0]->size();
-	unsigned int high_size = high_side_sorted_by_min[0]->size();
-	// Make sure we didn't drop any triangles.
-	// This assert should be mutually redundant with the above assert of (overlaps_below or overlaps_above).
-	assert(low_size + high_size == triangle_count);
-	// If we failed to improve, become a leaf.
-	if (high_size == triangle_count or low_size == triangle_count) {
-//	if (high_size == triangle_count and low_size == triangle_count) {
-		form_as_leaf_from(&all_our_indices, all_triangles);
-	} else {
-		// Otherwise, recursively subdivide.
+	// Produce three new sorted lists for each side of the divider, in the other buffer.
+	for_each_chunk(chunk_scheduler, list_chunk_count, list_chunk_count, [&](int list_chunk, int, int) {
+		int list = list_chunk / chunk_count, chunk = list_chunk % chunk_count;
+		const int* indices = sorted_indices_by[list / 3][list % 3];
+		int* low_side_indices = context->list(buffer ^ 1, list / 3, list % 3) + offset;
+		int* high_side_indices = low_side_indices + low_size;
+		int chunk_begin = (long long)triangle_count * chunk / chunk_count;
+		int chunk_end = (long long)triangle_count * (chunk + 1) / chunk_count;
+		// Everything before this chunk that didn't go low went high.
+		int low_offset = low_offsets[chunk].lists[list];
+		int high_offset = chunk_begin - low_offset;
+		for (int i = chunk_begin; i < chunk_end; i++) {
+			int triangle_index = indices[i];
+			if (goes_low((*all_triangles)[triangle_index]))
+				low_side_indices[low_offset++] = triangle_index;
+			else
+				high_side_indices[high_offset++] = triangle_index;
+		}
+	});
+	// Otherwise, recursively subdivide.
+	// A big high side becomes a task that an idle thread can steal, while we carry straight on with the low side ourselves.
 #ifdef THREADED_KD_BUILD
-		if (low_size > THREADED_DISPATCH_THRESHOLD) {
-			JobDescriptor job;
-			// Acquire the job variable for our thread.
-			pthread_mutex_lock(&parent->job_lock);
-			job.do_quit = false;
-			job.destination = &low_side;
-			job.depth = depth+1;
-			for (int i = 0; i < 3; i++) {
-				job.sorted_indices_by_min[i] = low_side_sorted_by_min[i];
-				job.sorted_indices_by_max[i] = low_side_sorted_by_max[i];
-			}
-			parent->job_list.push_back(job);
-			parent->total_job_count++;
-			pthread_mutex_unlock(&parent->job_lock);
-			// Release the job, so a processing thread can begin processing it.
-			sem_post(&parent->job_available);
-		} else
+	if (scheduler != nullptr and high_size > THREADED_DISPATCH_THRESHOLD)
+		scheduler->spawn([=]() {
+			build_subtree(&high_side, context, depth+1, buffer ^ 1, offset + low_size, high_size);
+		});
+	else
 #endif
-			low_side = new kdTreeNode(parent, depth+1, low_side_sorted_by_min, low_side_sorted_by_max, all_triangles);
+		build_subtree(&high_side, context, depth+1, buffer ^ 1, offset + low_size, high_size);
+	build_subtree(&low_side, context, depth+1, buffer ^ 1, offset, low_size);
+}
+
+kdTree::kdTree(vector<Triangle>* _all_triangles) : all_triangles(_all_triangles) {
+	build(nullptr);
+}
+
+void kdTree::build(vector<int>* order) {
+	struct timeval start, sorted, stop, result;
+	gettimeofday(&start, NULL);
+
+	// Throw away whatever we built last time, if anything.
+	nodes.building().clear();
+#ifdef LEAF_BLOCK_WIDTH
+	blocks.building().clear();
+#else
+	records.building().clear();
+#endif
+
+	kdTreeNode* build_root;
+	kdBuildContext context;
+	context.all_triangles = all_triangles;
+	context.triangle_count = all_triangles->size();
+	for (auto& buffer : context.buffers)
+		buffer.resize(6 * all_triangles->size());
+	auto build = [&]() {
+		// First we build six lists, sorting the indices of the triangles by their min and max bounds along each of the three axes.
+		presort(&context);
+		gettimeofday(&sorted, NULL);
+		// Actually build the tree!
+		build_subtree(&build_root, &context, 0, 0, 0, all_triangles->size());
+	};
+	// With threading, the build runs as a task on a scheduler of our own, and is done once it and every task it spawned have finished.
 #ifdef THREADED_KD_BUILD
-		if (high_size > THREADED_DISPATCH_THRESHOLD) {
-			JobDescriptor job;
-			// Acquire the job variable for our thread.
-			pthread_mutex_lock(&parent->job_lock);
-			job.do_quit = false;
-			job.destination = &high_side;
-			job.depth = depth+1;
-			for (int i = 0; i < 3; i++) {
-				job.sorted_indices_by_min[i] = high_side_sorted_by_min[i];
-				job.sorted_indices_by_max[i] = high_side_sorted_by_max[i];
-			}
-			parent->job_list.push_back(job);
-			parent->total_job_count++;
-			pthread_mutex_unlock(&parent->job_lock);
-			// Release the job, so a processing thread can begin processing it.
-			sem_post(&parent->job_available);
-		} else
+	TaskScheduler scheduler(get_optimal_thread_count());
+	context.scheduler = &scheduler;
+	for (int i = 0; i < scheduler.thread_count(); i++)
+		context.arenas.push_back(new BumpArena());
+	scheduler.run(build);
+#else
+	context.scheduler = nullptr;
+	context.arenas.push_back(new BumpArena());
+	build();
 #endif
-			high_side = new kdTreeNode(parent, depth+1, high_side_sorted_by_min, high_side_sorted_by_max, all_triangles);
-	}
-	// Freeing occurs in the worker thread when threaded building is being used, so in that case we don't free here.
-#ifndef THREADED_KD_BUILD
-	// Finally, free our scratch lists.
-	for (int axis = 0; axis < 3; axis++) {
-		for (int minmax = 0; minmax < 2; minmax++) {
-			delete low_side_sorted_by[minmax][axis];
-			delete high_side_sorted_by[minmax][axis];
-		}
+
+	// Flatten the tree into a contiguous array for traversal, and throw away the pointer-linked form.
+	bounds = build_root->aabb;
+	deepest_depth = biggest_leaf = 0;
+	vector<int> triangle_order;
+	triangle_order.reserve(all_triangles->size());
+	flatten(build_root, bounds, 0, triangle_order);
+	nodes.built();
+	for (BumpArena* arena : context.arenas)
+		delete arena;
+
+	// Reorder the triangles into the order the leaves refer to them in, so each leaf just stores a range.
+	// Each triangle lands in exactly one leaf, so this is a permutation, and the triangles are never duplicated.
+	assert(triangle_order.size() == all_triangles->size());
+	vector<Triangle> reordered_triangles;
+	reordered_triangles.reserve(all_triangles->size());
+	for (int index : triangle_order)
+		reordered_triangles.push_back((*all_triangles)[index]);
+	all_triangles->swap(reordered_triangles);
+	triangles.refer_to(all_triangles->data(), all_triangles->size());
+	if (order != nullptr) {
+		assert(order->size() == triangle_order.size());
+		vector<int> reordered;
+		reordered.reserve(order->size());
+		for (int index : triangle_order)
+			reordered.push_back((*order)[index]);
+		order->swap(reordered);
 	}
+#ifdef LEAF_BLOCK_WIDTH
+	blocks.built();
+#else
+	records.building().reserve(all_triangles->size());
+	for (auto& triangle : *all_triangles)
+		records.building().push_back(triangle.intersection_record());
+	records.built();
 #endif
-}
 
-kdTreeNode::~kdTreeNode() {
-	// This is safe because stored_triangles is either nullptr or allocated.
-	delete[] stored_triangles;
-	delete low_side;
-	delete high_side;
+	// Measure the tree as built, for refits to compare against. As the clips are already tight this doesn't change anything.
+#ifdef THREADED_KD_BUILD
+	scheduler.run([&]() { build_cost = refit_nodes(&scheduler); });
+#else
+	build_cost = refit_nodes(nullptr);
+#endif
+
+	gettimeofday(&stop, NULL);
+	timersub(&sorted, &start, &result);
+	presort_time = result.tv_sec + result.tv_usec * 1e-6;
+	timersub(&stop, &start, &result);
+	build_time = result.tv_sec + result.tv_usec * 1e-6;
 }
 
-bool kdTreeNode::ray_test(const CastingRay& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle) const {
-	// Do a quick AABB based early out.
-	if (not aabb.does_ray_intersect(ray))
+bool kdTree::refit(vector<int>* order) {
+	assert(all_triangles != nullptr and all_triangles->size() == triangles.size());
+	Real cost;
+#ifdef THREADED_KD_BUILD
+	TaskScheduler scheduler(get_optimal_thread_count());
+	scheduler.run([&]() { cost = refit_nodes(&scheduler); });
+#else
+	cost = refit_nodes(nullptr);
+#endif
+	if (cost <= REFIT_REBUILD_THRESHOLD * build_cost)
 		return false;
-	// If we're a leaf we simply try intersecting against all of our triangles.
-	if (is_leaf) {
-		bool overall_result = false;
-		Real best_hit_parameter = FLOAT_INF;
-		Real best_u, best_v;
-		const Triangle* best_hit_triangle = nullptr;
-		for (int i = 0; i < stored_triangle_count; i++) {
-			Real temp_hit_parameter;
-			const Triangle* temp_hit_triangle;
-			Real u, v;
-			bool result = stored_triangles[i].ray_test(ray.ray, temp_hit_parameter, u, v, &temp_hit_triangle);
-			if (result and temp_hit_parameter < best_hit_parameter) {
-				best_hit_parameter = temp_hit_parameter;
-				best_u = u;
-				best_v = v;
-				best_hit_triangle = temp_hit_triangle;
-				overall_result = true;
-			}
+	build(order);
+	return true;
+}
+
+Real kdTree::refit_nodes(TaskScheduler* scheduler) {
+	RefitResult root = refit_node(0, scheduler, 0);
+	bounds = root.aabb;
+	return root.cost / root.area();
+}
+
+RefitResult kdTree::refit_node(uint32_t index, TaskScheduler* scheduler, int depth) {
+	// The triangles below a node are exactly those in the leaves below it, so working up from the leaves gives each node's tight bounds,
+	// and since a node's clips are just the extents of its children along its split axis, the tree stays valid however the triangles move.
+	// Children come after their parents in the array, so we can write nodes in place while traversal isn't going on.
+	kdFlatNode& node = nodes.building()[index];
+	RefitResult result;
+	if (node.is_leaf()) {
+		int count = node.triangle_count();
+#ifdef LEAF_BLOCK_WIDTH
+		vector<TriangleBlock>& flat_blocks = blocks.building();
+		for (int i = 0; i < count; i++) {
+			TriangleBlock& block = flat_blocks[node.first_block + i / LEAF_BLOCK_WIDTH];
+			uint32_t triangle_index = block.triangle_index[i % LEAF_BLOCK_WIDTH];
+			const Triangle& triangle = (*all_triangles)[triangle_index];
+			block.set_lane(i % LEAF_BLOCK_WIDTH, triangle.intersection_record(), triangle_index);
+			result.aabb.update(triangle.aabb);
 		}
-		if (overall_result) {
-			hit_parameter = best_hit_parameter;
-			hit_u = best_u;
-			hit_v = best_v;
-			if (hit_triangle != nullptr)
-				*hit_triangle = best_hit_triangle;
+#else
+		vector<IntersectionRecord>& flat_records = records.building();
+		for (uint32_t i = node.first_triangle; i < node.first_triangle + count; i++) {
+			const Triangle& triangle = (*all_triangles)[i];
+			flat_records[i] = triangle.intersection_record();
+			result.aabb.update(triangle.aabb);
 		}
-		return overall_result;
+#endif
+		result.cost = result.area() * SAH_INTERSECTION_COST * SAH_TRIANGLE_COUNT_COST(count);
+		return result;
 	}
-	// If not, we perform early out search against our nodes.
-	// Determine which side of the splitting plane the origin of the ray starts on.
-//	Real high_side_minimum = high_side != nullptr ? high_side->aabb.minima(split_axis) : 0.0;
-//	Real low_side_maximum  = low_side != nullptr ? low_side->aabb.minima(split_axis) : 0.0;
-	Real origin = ray.ray.origin(split_axis);
-	// Check if we're in both AABBs
-//	bool in_middle = origin < low_side_maximum and high_side_minimum < origin and low_side != nullptr and high_side != nullptr;
-	bool overlaps_high_side = high_side != nullptr and high_side->aabb.minima(split_axis) < origin;
-	bool overlaps_low_side  = low_side  != nullptr and origin <= low_side->aabb.maxima(split_axis);
-	bool overlaps_both = overlaps_high_side and overlaps_low_side;
-//	bool on_high_side = ray.origin(split_axis) > split_height;
-//	Real temp_hit_parameter;
-	kdTreeNode* near_side = overlaps_high_side ? high_side : low_side;
-	kdTreeNode* far_side  = overlaps_high_side ? low_side : high_side;
-//	// First we try intersecting against the near side.
-//	if (near_side != nullptr) {
-//		near_side->ray_test(ray, hit_parameter, hit_triangle);
-//	}
-//	// Next we 
-
-	// If we overlap both children, then we must test against both children.
-	if (overlaps_both) {
-		bool low_result = low_side->ray_test(ray, hit_parameter, hit_u, hit_v, hit_triangle);
-		Real temp_hit_parameter;
-		Real temp_u, temp_v;
-		const Triangle* temp_triangle;
-		bool high_result = high_side->ray_test(ray, temp_hit_parameter, temp_u, temp_v, &temp_triangle);
-		// If there's no high side hit use the low side hit.
-		if (not high_result)
-			return low_result;
-		// If there's no low side hit use the high side hit.
-		if ((not low_result) or temp_hit_parameter < hit_parameter) {
-			hit_parameter = temp_hit_parameter;
-			hit_u = temp_u;
-			hit_v = temp_v;
-			if (hit_triangle != nullptr)
-				*hit_triangle = temp_triangle;
-		}
-		return true;
+	int axis = node.split_axis();
+	// Cut nodes have the same node as both children, with CUT_NODE_EMPTY_CLIP on the empty side, which stays as it is.
+	if (node.high_child() == index + 1) {
+		RefitResult child = refit_node(index + 1, scheduler, depth);
+		if (node.clip[1] == CUT_NODE_EMPTY_CLIP)
+			node.clip[0] = child.aabb.maxima(axis);
+		else
+			node.clip[1] = child.aabb.minima(axis);
+		result.aabb = child.aabb;
+		result.cost = child.cost + child.area() * SAH_TRAVERSAL_COST;
+		return result;
 	}
-//	bool near_result = near_side->ray_test(ray, hit_parameter, hit_triangle);
-//	if (near_result)
-//if (overlaps_low_side) {
-//		// Here we know we're on the low side and not on the high side.
-//		bool low_result = low_side->ray_test(ray, hit_parameter, hit_triangle);
-//		// If we get a hit then we can early out.
-//		if 
-//	}
-	if (near_side != nullptr) {
-		if (near_side->ray_test(ray, hit_parameter, hit_u, hit_v, hit_triangle)) {
-			// If we hit a near side triangle it is possible that it is a shared near/far triangle.
-			// If this is the case then it is possible that we hit it on the far side in a way that is occluded
-			// by some other far side triangle.
-			// NB: If all we want is hit/no-hit then this is an irrelevant check, but it is critical to get
-			// the closest hit. Maybe I should add an "occlusion only" flag that skips this path for shadow rays?
-
-			// Compute the ray parameter of the split plane.
-			if (far_side == nullptr)
-				return true;
-			Real effective_far_side_split = near_side == low_side ? far_side->aabb.minima(split_axis) : far_side->aabb.maxima(split_axis);
-//			Real split_plane_ray_parameter_times_slope_towards_plane = effective_far_side_split - origin;
-			Real hit_parameter_of_far_side_aabb = (effective_far_side_split - origin) / ray.ray.direction(split_axis);
-//			bool hit_above_plane = hit_parameter * ray.direction(split_axis) > split_plane_ray_parameter_times_slope_towards_plane;
-//			if (overlaps_high_side != hit_above_plane) {
-			if (hit_parameter > hit_parameter_of_far_side_aabb) {
-				Real temp_hit_parameter;
-				Real temp_u, temp_v;
-				const Triangle* temp_triangle;
-				bool temp_result = far_side->ray_test(ray, temp_hit_parameter, temp_u, temp_v, &temp_triangle);
-				// We MUST get a far side hit, because the near side triangle we hit must also be a far side triangle.
-//				assert(temp_result);
-				if (temp_result and temp_hit_parameter < hit_parameter) {
-					// It never makes sense to get a worse collision from a far side hit from the far node.
-					// This is because the near side triangle we hit on the far side must also be a far side triangle!
-//					if (temp_hit_parameter > hit_parameter) {
-//						cout << temp_hit_parameter << " " << hit_parameter << "\n";
-//					}
-//					assert(temp_hit_parameter <= hit_parameter);
-//					hit_parameter = real_min(temp_hit_parameter, hit_parameter);
-					hit_parameter = temp_hit_parameter;
-					hit_u = temp_u;
-					hit_v = temp_v;
-					if (hit_triangle != nullptr)
-						*hit_triangle = temp_triangle;
-				}
+	RefitResult low, high;
+	if (scheduler != nullptr and depth < PARALLEL_REFIT_DEPTH) {
+		scheduler->parallel_for(0, 2, 2, [&](int chunk, int, int) {
+			if (chunk == 0)
+				low = refit_node(index + 1, scheduler, depth + 1);
+			else
+				high = refit_node(node.high_child(), scheduler, depth + 1);
+		});
+	} else {
+		low = refit_node(index + 1, scheduler, depth + 1);
+		high = refit_node(node.high_child(), scheduler, depth + 1);
+	}
+	node.clip[0] = low.aabb.maxima(axis);
+	node.clip[1] = high.aabb.minima(axis);
+	result.aabb = low.aabb;
+	result.aabb.update(high.aabb);
+	result.cost = low.cost + high.cost + result.area() * SAH_TRAVERSAL_COST;
+	return result;
+}
+
+void kdTree::presort(kdBuildContext* context) const {
+	// We radix sort the triangles by their bounds, rather than comparison sorting indices, so each pass just streams through
+	// (key, index) pairs instead of chasing every index into its triangle, and all six lists get sorted together.
+	TaskScheduler* scheduler = context->scheduler;
+	int triangle_count = all_triangles->size();
+	int chunk_count = 1;
+	if (scheduler != nullptr and triangle_count >= PARALLEL_NODE_THRESHOLD)
+		chunk_count = scheduler->thread_count();
+	else
+		scheduler = nullptr;
+	// The lists are numbered minmax * 3 + axis.
+	vector<RadixSortEntry> lists[6];
+	for (auto& list : lists)
+		list.resize(triangle_count);
+	for_each_chunk(scheduler, triangle_count, chunk_count, [&](int chunk, int chunk_begin, int chunk_end) {
+		for (int i = chunk_begin; i < chunk_end; i++) {
+			const AABB& aabb = (*all_triangles)[i].aabb;
+			for (int axis = 0; axis < 3; axis++) {
+				lists[axis][i] = RadixSortEntry{radix_key(aabb.minima(axis)), i};
+				lists[3 + axis][i] = RadixSortEntry{radix_key(aabb.maxima(axis)), i};
 			}
-			// If the above check fails, then the hit is near side, and there's no need to check the far side.
-			return true;
 		}
-	}
-	if (far_side != nullptr)
-		return far_side->ray_test(ray, hit_parameter, hit_u, hit_v, hit_triangle);
-	return false;
+	});
+	radix_sort(lists, 6, scheduler, chunk_count);
+	// The root's lists are the whole of the first buffer.
+	for_each_chunk(scheduler, 6 * chunk_count, 6 * chunk_count, [&](int list_chunk, int, int) {
+		int list = list_chunk / chunk_count, chunk = list_chunk % chunk_count;
+		int* indices = context->list(0, list / 3, list % 3);
+		int chunk_begin = (long long)triangle_count * chunk / chunk_count;
+		int chunk_end = (long long)triangle_count * (chunk + 1) / chunk_count;
+		for (int i = chunk_begin; i < chunk_end; i++)
+			indices[i] = lists[list][i].index;
+	});
+}
+
+kdTree::kdTree(SceneCacheReader& reader, const Triangle* _triangles, size_t triangle_count) : all_triangles(nullptr) {
+	triangles.refer_to(_triangles, triangle_count);
+	reader.read_array(nodes);
+#ifdef LEAF_BLOCK_WIDTH
+	reader.read_array(blocks);
+#else
+	reader.read_array(records);
+#endif
+	reader.read_value(bounds);
+	reader.read_value(deepest_depth);
+	reader.read_value(biggest_leaf);
+	build_time = presort_time = 0;
+	build_cost = 0;
 }
 
-// Try not to puke at this global storage used for configuring the following comparison function in leu of closures.
-vector<Triangle>* global_triangles;
-int global_comparison_axis;
-bool global_use_maxima;
-
-// Check whether the xth triangle's AABB starts (resp. ends) on the nth axis lower than the triangle with index y, where n is equal to global_comparison_axis.
-bool compare_on_nth_axis(const int& x, const int& y) {
-	vector<Triangle>& all_triangles = *global_triangles;
-	bool answer1 = all_triangles[x].aabb.maxima(global_comparison_axis) < all_triangles[y].aabb.maxima(global_comparison_axis);
-	bool answer2 = all_triangles[x].aabb.minima(global_comparison_axis) < all_triangles[y].aabb.minima(global_comparison_axis);
-	return global_use_maxima ? answer1 : answer2;
+kdTree::~kdTree() {
 }
 
-void kdTreeNode::get_stats(int& deepest_depth, int& biggest_set) {
+bool kdTree::save(SceneCacheWriter& writer) const {
+	writer.write_array(nodes);
+#ifdef LEAF_BLOCK_WIDTH
+	writer.write_array(blocks);
+#else
+	writer.write_array(records);
+#endif
+	writer.write_value(bounds);
+	writer.write_value(deepest_depth);
+	writer.write_value(biggest_leaf);
+	return true;
+}
+
+uint32_t kdTree::flatten(const kdTreeNode* node, const AABB& region, int depth, vector<int>& triangle_order) {
+	// Our nodes only bound their children along the split axis, so the region that a node's ancestors confine it to can be much bigger than its actual AABB.
+	// Wherever this leaves a big slab of empty space on one side of the node, we emit a cut node in front of it, with the node as one
+	// child and an empty child on the other side, whose clip of CUT_NODE_EMPTY_CLIP guarantees that its interval is always empty.
+	// Both children of a cut node are given as the next node, so it doesn't matter which side is the empty one.
+	vector<kdFlatNode>& flat_nodes = nodes.building();
+#ifdef LEAF_BLOCK_WIDTH
+	vector<TriangleBlock>& flat_blocks = blocks.building();
+#endif
+	uint32_t first_index = flat_nodes.size();
+	for (int axis = 0; axis < 3; axis++) {
+		Real threshold = EMPTY_SPACE_CUT_FRACTION * (region.maxima(axis) - region.minima(axis));
+		kdFlatNode cut;
+		if (region.maxima(axis) - node->aabb.maxima(axis) > threshold) {
+			cut.flags = axis | ((flat_nodes.size() + 1) << 2);
+			cut.clip[0] = node->aabb.maxima(axis);
+			cut.clip[1] = CUT_NODE_EMPTY_CLIP;
+			flat_nodes.push_back(cut);
+		}
+		if (node->aabb.minima(axis) - region.minima(axis) > threshold) {
+			cut.flags = axis | ((flat_nodes.size() + 1) << 2);
+			cut.clip[0] = -CUT_NODE_EMPTY_CLIP;
+			cut.clip[1] = node->aabb.minima(axis);
+			flat_nodes.push_back(cut);
+		}
+	}
+	uint32_t index = flat_nodes.size();
+	flat_nodes.push_back(kdFlatNode());
 	if (depth > deepest_depth)
 		deepest_depth = depth;
-	if (stored_triangle_count > biggest_set)
-		biggest_set = stored_triangle_count;
-	if (low_side != nullptr)
-		low_side->get_stats(deepest_depth, biggest_set);
-	if (high_side != nullptr)
-		high_side->get_stats(deepest_depth, biggest_set);
+	if (node->is_leaf) {
+		if (node->stored_triangle_count > biggest_leaf)
+			biggest_leaf = node->stored_triangle_count;
+		flat_nodes[index].flags = 3 | (node->stored_triangle_count << 2);
+#ifdef LEAF_BLOCK_WIDTH
+		// Pack the leaf's triangles into blocks, noting the index each triangle will have once all_triangles has been reordered.
+		flat_nodes[index].first_block = flat_blocks.size();
+		for (int i = 0; i < node->stored_triangle_count; i++) {
+			if (i % LEAF_BLOCK_WIDTH == 0)
+				flat_blocks.push_back(TriangleBlock());
+			flat_blocks.back().set_lane(i % LEAF_BLOCK_WIDTH, (*all_triangles)[node->stored_indices[i]].intersection_record(), triangle_order.size());
+			triangle_order.push_back(node->stored_indices[i]);
+		}
+#else
+		flat_nodes[index].first_triangle = triangle_order.size();
+		for (int i = 0; i < node->stored_triangle_count; i++)
+			triangle_order.push_back(node->stored_indices[i]);
+#endif
+		return first_index;
+	}
+	int axis = node->split_axis;
+	flat_nodes[index].clip[0] = node->low_side->aabb.maxima(axis);
+	flat_nodes[index].clip[1] = node->high_side->aabb.minima(axis);
+	// Work out the regions that the split confines each child to.
+	AABB low_region = node->aabb, high_region = node->aabb;
+	low_region.maxima(axis) = flat_nodes[index].clip[0];
+	high_region.minima(axis) = flat_nodes[index].clip[1];
+	// The low child is implicitly the next node, so we only have to record where the high child lands.
+	// NB: We must index into flat_nodes rather than holding a reference, because the recursion reallocates it.
+	flatten(node->low_side, low_region, depth + 1, triangle_order);
+	uint32_t high_child = flatten(node->high_side, high_region, depth + 1, triangle_order);
+	flat_nodes[index].flags = axis | (high_child << 2);
+	return first_index;
 }
 
-#ifdef THREADED_KD_BUILD
-void BuildingThread::spawn_thread(kdTree* _tree) {
-	tree = _tree;
-	pthread_create(&thread, nullptr, BuildingThread::computation_thread_main, (void*)this);
+void kdTree::get_stats(int& _deepest_depth, int& biggest_set) const {
+	_deepest_depth = deepest_depth;
+	biggest_set = biggest_leaf;
 }
 
-void* BuildingThread::computation_thread_main(void* cookie) {
-	BuildingThread* self = (BuildingThread*) cookie;
-	JobDescriptor current_job;
-	// Begin waiting on a task.
+void kdTree::print_stats() const {
+	size_t node_bytes = nodes.size() * sizeof(kdFlatNode);
+	size_t triangle_bytes = triangles.size() * sizeof(Triangle);
+	cout << "kdTree: " << nodes.size() << " nodes at " << sizeof(kdFlatNode) << " bytes per node (" << node_bytes / 1e6 << " MB), ";
+#ifdef LEAF_BLOCK_WIDTH
+	size_t record_bytes = blocks.size() * sizeof(TriangleBlock);
+	cout << blocks.size() << " " << LEAF_BLOCK_WIDTH << "-wide triangle blocks at " << sizeof(TriangleBlock) << " bytes per block (" << record_bytes / 1e6 << " MB), ";
+#else
+	size_t record_bytes = records.size() * sizeof(IntersectionRecord);
+	cout << records.size() << " intersection records at " << sizeof(IntersectionRecord) << " bytes per record (" << record_bytes / 1e6 << " MB), ";
+#endif
+	cout << "shading triangles " << triangle_bytes / 1e6 << " MB, ";
+	cout << "total " << (node_bytes + record_bytes + triangle_bytes) / 1e6 << " MB, ";
+	cout << "depth = " << deepest_depth << " max leaf size = " << biggest_leaf;
+	if (all_triangles != nullptr)
+		cout << ", built in " << build_time << " s (presort " << presort_time << " s)";
+	cout << endl;
+}
+
+// Works out which of a node's children the ray visits first, and the intervals of the ray spent in the near and far children.
+// If the ray is heading up the split axis then the low child is the near side, otherwise it's the high child.
+// Either interval may come out empty (enter > exit), in which case that child needn't be visited.
+static inline void order_children(const kdFlatNode& node, uint32_t index, const CastingRay& ray, Real t_enter, Real t_exit, uint32_t& near_side, Real& near_exit, uint32_t& far_side, Real& far_enter) {
+	int axis = node.split_axis();
+	Real origin = ray.ray.origin(axis);
+	// Compute the ray parameters at which we cross the far face of the low child and the near face of the high child.
+	Real low_clip_parameter = (node.clip[0] - origin) * ray.recip_deltas(axis);
+	Real high_clip_parameter = (node.clip[1] - origin) * ray.recip_deltas(axis);
+	bool heading_up = ray.recip_deltas(axis) >= 0;
+	near_side = heading_up ? index + 1 : node.high_child();
+	far_side  = heading_up ? node.high_child() : index + 1;
+	near_exit = real_min(t_exit, heading_up ? low_clip_parameter : high_clip_parameter);
+	far_enter = real_max(t_enter, heading_up ? high_clip_parameter : low_clip_parameter);
+}
+
+bool kdTree::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle, Real t_max) const {
+	//rays_cast++;
+	CastingRay casting_ray(ray, 0.0, t_max);
+	// Clip the ray to the bounds of the whole tree, which gives us the interval of the ray the root is responsible for.
+	Real t_enter, t_exit;
+	if (not bounds.ray_interval(casting_ray, t_enter, t_exit))
+		return false;
+	// We walk the tree front to back, always descending into the near child and stacking the far child's interval for later.
+	kdStackEntry stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+	uint32_t index = 0;
+	uint32_t hit_index = 0;
+	bool overall_result = false;
 	while (true) {
-		sem_wait(&self->tree->job_available);
-		pthread_mutex_lock(&self->tree->job_lock);
-		// Copy over the job descriptor.
-		current_job = self->tree->job_list.front();
-		self->tree->job_list.pop_front();
-		// Release the job_writable semaphore, allowing other threads to be issued jobs.
-		pthread_mutex_unlock(&self->tree->job_lock);
-		// Iff the job tells to quit then we're being signaled that work is done, and we do so.
-		if (current_job.do_quit)
-			break;
-		// Begin processing.
-		auto new_node = new kdTreeNode(self->tree, current_job.depth, current_job.sorted_indices_by_min, current_job.sorted_indices_by_max, self->tree->all_triangles);
-		*current_job.destination = new_node;
-		// Free the lists.
-		// Finally, free our scratch lists.
-		for (int axis = 0; axis < 3; axis++) {
-			delete current_job.sorted_indices_by_min[axis];
-			delete current_job.sorted_indices_by_max[axis];
+		const kdFlatNode& node = nodes[index];
+#ifdef TRAVERSAL_STATS
+		node_visits++;
+#endif
+		if (not node.is_leaf()) {
+			uint32_t near_side, far_side;
+			Real near_exit, far_enter;
+			order_children(node, index, casting_ray, t_enter, t_exit, near_side, near_exit, far_side, far_enter);
+			bool visit_near = t_enter <= near_exit;
+			bool visit_far = far_enter <= t_exit;
+			if (visit_near and visit_far) {
+				// Whatever happens on the near side, we're quite likely to visit the far side.
+				__builtin_prefetch(&nodes[far_side]);
+				assert(stack_size < TRAVERSAL_STACK_SIZE);
+				stack[stack_size++] = kdStackEntry({far_side, far_enter, t_exit});
+			}
+			if (visit_near) {
+				index = near_side;
+				t_exit = near_exit;
+				continue;
+			}
+			if (visit_far) {
+				index = far_side;
+				t_enter = far_enter;
+				continue;
+			}
+		} else {
+			// If we're a leaf we simply try intersecting against all of our triangles.
+			// Each hit we take shrinks the ray's interval, so only strictly closer hits are taken after it.
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				int lane = blocks[i].ray_test(casting_ray, temp_hit_parameter, u, v);
+				if (lane != -1) {
+					casting_ray.t_max = temp_hit_parameter;
+					hit_u = u;
+					hit_v = v;
+					hit_index = blocks[i].triangle_index[lane];
+					overall_result = true;
+				}
+			}
+#else
+			uint32_t end = node.first_triangle + node.triangle_count();
+			for (uint32_t i = node.first_triangle; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				bool result = records[i].ray_test(casting_ray.ray, temp_hit_parameter, u, v);
+				if (result and casting_ray.t_min <= temp_hit_parameter and temp_hit_parameter < casting_ray.t_max) {
+					casting_ray.t_max = temp_hit_parameter;
+					hit_u = u;
+					hit_v = v;
+					hit_index = i;
+					overall_result = true;
+				}
+			}
+#endif
 		}
-		// Decrement the total job count.
-		pthread_mutex_lock(&self->tree->job_lock);
-		self->tree->total_job_count--;
-		if (self->tree->total_job_count == 0)
-			sem_post(&self->tree->jobs_all_done);
-		pthread_mutex_unlock(&self->tree->job_lock);
+		// Pop the next stacked interval, dropping any that begin after the closest hit so far, as every triangle in that
+		// subtree lies within its interval. We can't stop at the first such interval, because the builder's children may
+		// overlap, so a stacked interval may begin after one stacked beneath it. Dropping the rest is cheap, though.
+		do {
+			if (stack_size == 0) {
+				if (overall_result) {
+					hit_parameter = casting_ray.t_max;
+					// Only now that we know the closest hit do we touch the full triangle, for its shading data.
+					if (hit_triangle != nullptr)
+						*hit_triangle = &triangles[hit_index];
+				}
+				return overall_result;
+			}
+			stack_size--;
+		} while (stack[stack_size].t_enter > casting_ray.t_max);
+		index = stack[stack_size].index;
+		t_enter = stack[stack_size].t_enter;
+		t_exit = real_min(stack[stack_size].t_exit, casting_ray.t_max);
 	}
-	return nullptr;
 }
-#endif
 
-// Use this storage to prevent multiple threads from calling kdTree::kdTree() at once.
-bool currently_building = false;
+bool kdTree::occluded(const Ray& ray, Real t_max) const {
+	// Nothing past t_max matters, so clipping to the ray's interval means we needn't even walk the parts of the tree beyond it.
+	CastingRay casting_ray(ray, 0.0, t_max);
+	Real t_enter, t_exit;
+	if (not bounds.ray_interval(casting_ray, t_enter, t_exit))
+		return false;
+	// This is the same walk as in ray_test, only the interval never shrinks, as any hit at all lets us stop immediately.
+	kdStackEntry stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+	uint32_t index = 0;
+	while (true) {
+		const kdFlatNode& node = nodes[index];
+#ifdef TRAVERSAL_STATS
+		node_visits++;
+#endif
+		if (not node.is_leaf()) {
+			uint32_t near_side, far_side;
+			Real near_exit, far_enter;
+			order_children(node, index, casting_ray, t_enter, t_exit, near_side, near_exit, far_side, far_enter);
+			bool visit_near = t_enter <= near_exit;
+			bool visit_far = far_enter <= t_exit;
+			if (visit_near and visit_far) {
+				__builtin_prefetch(&nodes[far_side]);
+				assert(stack_size < TRAVERSAL_STACK_SIZE);
+				stack[stack_size++] = kdStackEntry({far_side, far_enter, t_exit});
+			}
+			if (visit_near) {
+				index = near_side;
+				t_exit = near_exit;
+				continue;
+			}
+			if (visit_far) {
+				index = far_side;
+				t_enter = far_enter;
+				continue;
+			}
+		} else {
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end; i++)
+				if (blocks[i].occludes(casting_ray))
+					return true;
+#else
+			const IntersectionRecord* leaf_records = &records[node.first_triangle];
+			for (uint32_t i = 0; i < node.triangle_count(); i++)
+				if (leaf_records[i].occludes(casting_ray.ray, casting_ray.t_max))
+					return true;
+#endif
+		}
+		if (stack_size == 0)
+			return false;
+		stack_size--;
+		index = stack[stack_size].index;
+		t_enter = stack[stack_size].t_enter;
+		t_exit = stack[stack_size].t_exit;
+	}
+}
 
-kdTree::kdTree(vector<Triangle>* _all_triangles) {
-	struct timeval start, stop, result;
-	gettimeofday(&start, NULL);
+// The rays of a packet, with their origins and reciprocal deltas also laid out as a structure of arrays, so that the work at each
+// node is a loop over the lanes of the packet that the compiler can vectorize. Lanes past count are padding, which never visit anything.
+struct kdPacket {
+	int count;
+	CastingRay rays[RAY_PACKET_SIZE];
+	Real origin[3][RAY_PACKET_SIZE];
+	Real recip_deltas[3][RAY_PACKET_SIZE];
+	// Whether the rays head up each axis, which must be the same for the whole packet, so that they all agree on which child is near.
+	bool heading_up[3];
 
-	if (currently_building) {
-		cerr << "Error: kdTree::kdTree is currently not re-entrant." << endl;
-		assert(false);
-	}
-	currently_building = true;
-	// First we build three lists, sorting the indices of the triangles by their min and max bounds along each of the three axes.
-	all_triangles = _all_triangles;
-	vector<int>* sorted_indices_by_min[3];
-	vector<int>* sorted_indices_by_max[3];
-	for (int axis = 0; axis < 3; axis++) {
-		sorted_indices_by_min[axis] = new vector<int>();
-		sorted_indices_by_max[axis] = new vector<int>();
-		for (unsigned int i = 0; i < all_triangles->size(); i++) {
-			sorted_indices_by_min[axis]->push_back(i);
-			sorted_indices_by_max[axis]->push_back(i);
+	// Returns false if the rays don't all head the same way along every axis, in which case they can't be walked together.
+	// Each ray is live up to its entry of t_max, or without limit if t_max is nullptr.
+	bool set(const Ray* _rays, const Real* t_max, int _count) {
+		assert(0 < _count and _count <= RAY_PACKET_SIZE);
+		count = _count;
+		for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+			// Padding lanes just copy the first ray, so that they don't spoil the direction check or compute anything strange.
+			if (lane < count)
+				rays[lane] = t_max != nullptr ? CastingRay(_rays[lane], 0.0, t_max[lane]) : CastingRay(_rays[lane]);
+			else
+				rays[lane] = CastingRay(_rays[0], 0.0, 0.0);
+			for (int axis = 0; axis < 3; axis++) {
+				origin[axis][lane] = rays[lane].ray.origin(axis);
+				recip_deltas[axis][lane] = rays[lane].recip_deltas(axis);
+			}
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			heading_up[axis] = recip_deltas[axis][0] >= 0;
+			for (int lane = 1; lane < count; lane++)
+				if ((recip_deltas[axis][lane] >= 0) != heading_up[axis])
+					return false;
 		}
-		// In leu of closures, simply assign into globals.
-		// XXX: Not re-entrant. :(
-		global_triangles = all_triangles;
-		global_comparison_axis = axis;
-		global_use_maxima = false;
-		sort(sorted_indices_by_min[axis]->begin(), sorted_indices_by_min[axis]->end(), compare_on_nth_axis);
-		global_use_maxima = true;
-		sort(sorted_indices_by_max[axis]->begin(), sorted_indices_by_max[axis]->end(), compare_on_nth_axis);
+		return true;
 	}
+};
 
-	// Start up a thread pool to spawn the jobs off to.
-#ifdef THREADED_KD_BUILD
-	int thread_count = get_optimal_thread_count();
-	total_job_count = 0;
-	// Initialize our synchronization structures.
-	// NB: I had a horrible bug where I had these three lines below the thread spawning, and it caused subtle misbehavior.
-	sem_init(&job_available, 0, 0);
-	sem_init(&jobs_all_done, 0, 0);
-	pthread_mutex_init(&job_lock, NULL);
-	auto computation_threads = new BuildingThread[thread_count];
-	for (int i = 0; i < thread_count; i++)
-		computation_threads[i].spawn_thread(this);
+// This is the walk of ray_test done for a whole packet at once. Each lane keeps its own interval, which goes through exactly the
+// arithmetic it would have in ray_test, and the packet descends into a child if any lane's interval there is non-empty. So every
+// lane visits the leaves it would have alone, in the same order and with the same intervals, and the results are bit-identical.
+// Lanes that don't reach a node simply ride along with an empty interval, which stays empty all the way down.
+template <typename LeafVisitor>
+void kdTree::walk_packet(kdPacket& packet, LeafVisitor visit_leaf) const {
+	Real t_enter[RAY_PACKET_SIZE], t_exit[RAY_PACKET_SIZE];
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+		if (lane >= packet.count or not bounds.ray_interval(packet.rays[lane], t_enter[lane], t_exit[lane])) {
+			t_enter[lane] = 1.0;
+			t_exit[lane] = 0.0;
+		}
+	}
+	kdPacketStackEntry stack[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+	uint32_t index = 0;
+	while (true) {
+		const kdFlatNode& node = nodes[index];
+#ifdef TRAVERSAL_STATS
+		node_visits++;
 #endif
+		if (not node.is_leaf()) {
+			int axis = node.split_axis();
+			bool heading_up = packet.heading_up[axis];
+			uint32_t near_side = heading_up ? index + 1 : node.high_child();
+			uint32_t far_side  = heading_up ? node.high_child() : index + 1;
+			// The face of the near child we leave through, and the face of the far child we enter through.
+			Real near_clip = heading_up ? node.clip[0] : node.clip[1];
+			Real far_clip  = heading_up ? node.clip[1] : node.clip[0];
+			Real near_exit[RAY_PACKET_SIZE], far_enter[RAY_PACKET_SIZE];
+			int visit_near = 0, visit_far = 0;
+			for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+				Real near_clip_parameter = (near_clip - packet.origin[axis][lane]) * packet.recip_deltas[axis][lane];
+				Real far_clip_parameter = (far_clip - packet.origin[axis][lane]) * packet.recip_deltas[axis][lane];
+				near_exit[lane] = real_min(t_exit[lane], near_clip_parameter);
+				far_enter[lane] = real_max(t_enter[lane], far_clip_parameter);
+				visit_near |= t_enter[lane] <= near_exit[lane];
+				visit_far |= far_enter[lane] <= t_exit[lane];
+			}
+			if (visit_near and visit_far) {
+				__builtin_prefetch(&nodes[far_side]);
+				assert(stack_size < TRAVERSAL_STACK_SIZE);
+				kdPacketStackEntry& entry = stack[stack_size++];
+				entry.index = far_side;
+				for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+					entry.t_enter[lane] = far_enter[lane];
+					entry.t_exit[lane] = t_exit[lane];
+				}
+			}
+			if (visit_near) {
+				index = near_side;
+				for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+					t_exit[lane] = near_exit[lane];
+				continue;
+			}
+			if (visit_far) {
+				index = far_side;
+				for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+					t_enter[lane] = far_enter[lane];
+				continue;
+			}
+		} else {
+			bool active[RAY_PACKET_SIZE];
+			for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+				active[lane] = t_enter[lane] <= t_exit[lane];
+			if (visit_leaf(node, active))
+				return;
+		}
+		// Pop the next stacked node that any lane still has a live interval in, clipping each interval to the lane's closest hit so far.
+		while (true) {
+			if (stack_size == 0)
+				return;
+			const kdPacketStackEntry& entry = stack[--stack_size];
+			int any_live = 0;
+			for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+				t_enter[lane] = entry.t_enter[lane];
+				t_exit[lane] = real_min(entry.t_exit[lane], packet.rays[lane].t_max);
+				any_live |= t_enter[lane] <= t_exit[lane];
+			}
+			if (any_live) {
+				index = entry.index;
+				break;
+			}
+		}
+	}
+}
 
-#ifdef THREADED_KD_BUILD
-	// Acquire the job variable for our thread.
-	pthread_mutex_lock(&job_lock);
-	JobDescriptor job;
-	job.do_quit = false;
-	job.destination = &root;
-	job.depth = 0;
-	for (int i = 0; i < 3; i++) {
-		job.sorted_indices_by_min[i] = sorted_indices_by_min[i];
-		job.sorted_indices_by_max[i] = sorted_indices_by_max[i];
+void kdTree::ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max) const {
+	if (count == 0)
+		return;
+	kdPacket packet;
+	if (not packet.set(rays, t_max, count)) {
+		Accelerator::ray_test_packet(rays, count, hits, t_max);
+		return;
 	}
-	job_list.push_back(job);
-	total_job_count++;
-	// Release the job, so a processing thread can begin processing it.
-	pthread_mutex_unlock(&job_lock);
-	sem_post(&job_available);
+	uint32_t hit_index[RAY_PACKET_SIZE];
+	for (int lane = 0; lane < count; lane++)
+		hits.hit[lane] = false;
+	walk_packet(packet, [&](const kdFlatNode& node, const bool* active) {
+		for (int lane = 0; lane < count; lane++) {
+			if (not active[lane])
+				continue;
+			CastingRay& casting_ray = packet.rays[lane];
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				int block_lane = blocks[i].ray_test(casting_ray, temp_hit_parameter, u, v);
+				if (block_lane != -1) {
+					casting_ray.t_max = temp_hit_parameter;
+					hits.hit_u[lane] = u;
+					hits.hit_v[lane] = v;
+					hit_index[lane] = blocks[i].triangle_index[block_lane];
+					hits.hit[lane] = true;
+				}
+			}
 #else
-	// Actually build the tree!
-	root = new kdTreeNode(this, 0, sorted_indices_by_min, sorted_indices_by_max, all_triangles);
+			uint32_t end = node.first_triangle + node.triangle_count();
+			for (uint32_t i = node.first_triangle; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				bool result = records[i].ray_test(casting_ray.ray, temp_hit_parameter, u, v);
+				if (result and casting_ray.t_min <= temp_hit_parameter and temp_hit_parameter < casting_ray.t_max) {
+					casting_ray.t_max = temp_hit_parameter;
+					hits.hit_u[lane] = u;
+					hits.hit_v[lane] = v;
+					hit_index[lane] = i;
+					hits.hit[lane] = true;
+				}
+			}
 #endif
-
-#ifdef THREADED_KD_BUILD
-	// Make sure all our threads exit.
-	// Our protocol is that job.do_quit = true indicates to a thread that we're done.
-	// Thus, we set this flag, and then post to the semaphore once per thread.
-	// We must first grab job_writable to avoid overwriting a job being read.
-	sem_wait(&jobs_all_done);
-	job.do_quit = true;
-	// NB: These loops can't be merged without creating a deadlock.
-	for (int i = 0; i < thread_count; i++) {
-		pthread_mutex_lock(&job_lock);
-		job_list.push_back(job);
-		pthread_mutex_unlock(&job_lock);
-		sem_post(&job_available);
+		}
+		return false;
+	});
+	for (int lane = 0; lane < count; lane++) {
+		if (hits.hit[lane]) {
+			hits.hit_parameter[lane] = packet.rays[lane].t_max;
+			hits.hit_triangle[lane] = &triangles[hit_index[lane]];
+		}
 	}
-	for (int i = 0; i < thread_count; i++)
-		pthread_join(computation_threads[i].thread, nullptr);
-	sem_destroy(&job_available);
-	sem_destroy(&jobs_all_done);
-	pthread_mutex_destroy(&job_lock);
-#endif
+}
 
-	// Freeing occurs in the worker thread when threaded building is being used, so in that case we don't free here.
-#ifndef THREADED_KD_BUILD
-	// Free our scratches.
-	for (int axis = 0; axis < 3; axis++) {
-		delete sorted_indices_by_min[axis];
-		delete sorted_indices_by_max[axis];
+void kdTree::occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const {
+	if (count == 0)
+		return;
+	kdPacket packet;
+	if (not packet.set(rays, t_max, count)) {
+		Accelerator::occluded_packet(rays, t_max, count, result);
+		return;
 	}
+	for (int lane = 0; lane < count; lane++)
+		result[lane] = false;
+	int blocked = 0;
+	walk_packet(packet, [&](const kdFlatNode& node, const bool* active) {
+		for (int lane = 0; lane < count; lane++) {
+			if (not active[lane] or result[lane])
+				continue;
+			CastingRay& casting_ray = packet.rays[lane];
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end and not result[lane]; i++)
+				result[lane] = blocks[i].occludes(casting_ray);
 #else
-	delete[] computation_threads;
+			const IntersectionRecord* leaf_records = &records[node.first_triangle];
+			for (uint32_t i = 0; i < node.triangle_count() and not result[lane]; i++)
+				result[lane] = leaf_records[i].occludes(casting_ray.ray, casting_ray.t_max);
 #endif
-
-	currently_building = false;
-
-	gettimeofday(&stop, NULL);
-	timersub(&stop, &start, &result);
-	double elapsed_time = result.tv_sec + result.tv_usec * 1e-6;
-//	cout << "Elapsed build time: " << elapsed_time << endl;
+			if (result[lane]) {
+				// This lane is done, so pull its t_max in before any interval it has, which empties them all as they're popped.
+				casting_ray.t_max = -1.0;
+				blocked++;
+			}
+		}
+		// Once every ray is blocked there's nothing left to find.
+		return blocked == count;
+	});
 }
 
-kdTree::~kdTree() {
-	delete root;
+// Rather than walking each ray through the tree on its own, which for incoherent rays fetches most nodes from memory again for every
+// ray that reaches them, a stream walk takes the whole batch of rays through each node at once. Each node splits the list of rays
+// that reach it into a list for each child, with each ray's interval clipped as ray_test would clip it, dropping the rays that miss
+// a child or have already hit something before it. The children's lists go on a stack of lists that mirrors the stack of subtrees
+// still to visit, so a subtree's list is always on top when it's popped, and everything above it can be thrown away.
+// Rays disagree about which child is near, so we go first into the child that most of them reach first. Rays heading the other way
+// may then find hits in the far child before the near one, which is still correct, as a leaf only takes hits closer than the ray's
+// closest so far, but culls less well than ray_test.
+template <typename LeafVisitor>
+void kdTree::walk_stream(CastingRay* rays, int count, LeafVisitor visit_leaf) const {
+	vector<kdStreamEntry> entries, first_entries;
+	entries.reserve(2 * count);
+	for (int i = 0; i < count; i++) {
+		Real t_enter, t_exit;
+		if (bounds.ray_interval(rays[i], t_enter, t_exit))
+			entries.push_back(kdStreamEntry({(uint32_t)i, t_enter, t_exit}));
+	}
+	vector<kdStreamFrame> frames;
+	frames.push_back(kdStreamFrame({0, 0, entries.size()}));
+	while (not frames.empty()) {
+		kdStreamFrame frame = frames.back();
+		frames.pop_back();
+		entries.resize(frame.end);
+		const kdFlatNode& node = nodes[frame.index];
+		// Filter out the rays whose closest hits so far come before this subtree, and count which way the rest are heading.
+		int axis = node.is_leaf() ? 0 : node.split_axis();
+		int heading_up_count = 0;
+		size_t live_end = frame.begin;
+		for (size_t i = frame.begin; i < frame.end; i++) {
+			kdStreamEntry entry = entries[i];
+			entry.t_exit = real_min(entry.t_exit, rays[entry.ray].t_max);
+			if (entry.t_enter <= entry.t_exit) {
+				entries[live_end++] = entry;
+				heading_up_count += rays[entry.ray].recip_deltas(axis) >= 0;
+			}
+		}
+		if (live_end == frame.begin)
+			continue;
+#ifdef TRAVERSAL_STATS
+		node_visits++;
+#endif
+		if (node.is_leaf()) {
+			visit_leaf(node, &entries[frame.begin], live_end - frame.begin);
+			continue;
+		}
+		// The child we visit second goes lower on both stacks. Each ray adds at most one entry to its list, so we can write that
+		// list over our own as we read it, and only the first child's list needs to go somewhere else until we're done.
+		bool low_first = 2 * heading_up_count >= (int)(live_end - frame.begin);
+		uint32_t first_index = low_first ? frame.index + 1 : node.high_child();
+		uint32_t second_index = low_first ? node.high_child() : frame.index + 1;
+		first_entries.clear();
+		size_t second_end = frame.begin;
+		for (size_t i = frame.begin; i < live_end; i++) {
+			kdStreamEntry entry = entries[i];
+			uint32_t near_side, far_side;
+			Real near_exit, far_enter;
+			order_children(node, frame.index, rays[entry.ray], entry.t_enter, entry.t_exit, near_side, near_exit, far_side, far_enter);
+			bool near_is_first = (near_side == frame.index + 1) == low_first;
+			kdStreamEntry near_entry({entry.ray, entry.t_enter, near_exit}), far_entry({entry.ray, far_enter, entry.t_exit});
+			if (entry.t_enter <= near_exit) {
+				if (near_is_first)
+					first_entries.push_back(near_entry);
+				else
+					entries[second_end++] = near_entry;
+			}
+			if (far_enter <= entry.t_exit) {
+				if (near_is_first)
+					entries[second_end++] = far_entry;
+				else
+					first_entries.push_back(far_entry);
+			}
+		}
+		entries.resize(second_end);
+		if (second_end != frame.begin)
+			frames.push_back(kdStreamFrame({second_index, frame.begin, second_end}));
+		if (not first_entries.empty()) {
+			frames.push_back(kdStreamFrame({first_index, second_end, second_end + first_entries.size()}));
+			entries.insert(entries.end(), first_entries.begin(), first_entries.end());
+		}
+	}
 }
 
-long long rays_cast = 0;
-
-bool kdTree::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle) {
-	//rays_cast++;
-	return root->ray_test(ray, hit_parameter, hit_u, hit_v, hit_triangle);
+void kdTree::ray_test_stream(const Ray* rays, int count, RayHit* hits) const {
+	vector<CastingRay> casting_rays(rays, rays + count);
+	vector<uint32_t> hit_index(count);
+	for (int i = 0; i < count; i++)
+		hits[i].hit = false;
+	walk_stream(casting_rays.data(), count, [&](const kdFlatNode& node, const kdStreamEntry* entries, size_t entry_count) {
+		for (size_t j = 0; j < entry_count; j++) {
+			uint32_t ray = entries[j].ray;
+			CastingRay& casting_ray = casting_rays[ray];
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				int block_lane = blocks[i].ray_test(casting_ray, temp_hit_parameter, u, v);
+				if (block_lane != -1) {
+					casting_ray.t_max = temp_hit_parameter;
+					hits[ray].hit_u = u;
+					hits[ray].hit_v = v;
+					hit_index[ray] = blocks[i].triangle_index[block_lane];
+					hits[ray].hit = true;
+				}
+			}
+#else
+			uint32_t end = node.first_triangle + node.triangle_count();
+			for (uint32_t i = node.first_triangle; i < end; i++) {
+				Real temp_hit_parameter;
+				Real u, v;
+				bool result = records[i].ray_test(casting_ray.ray, temp_hit_parameter, u, v);
+				if (result and casting_ray.t_min <= temp_hit_parameter and temp_hit_parameter < casting_ray.t_max) {
+					casting_ray.t_max = temp_hit_parameter;
+					hits[ray].hit_u = u;
+					hits[ray].hit_v = v;
+					hit_index[ray] = i;
+					hits[ray].hit = true;
+				}
+			}
+#endif
+		}
+	});
+	for (int i = 0; i < count; i++) {
+		if (hits[i].hit) {
+			hits[i].hit_parameter = casting_rays[i].t_max;
+			hits[i].hit_triangle = &triangles[hit_index[i]];
+		}
+	}
 }
 
+void kdTree::occluded_stream(const Ray* rays, const Real* t_max, int count, bool* result) const {
+	vector<CastingRay> casting_rays;
+	casting_rays.reserve(count);
+	for (int i = 0; i < count; i++) {
+		casting_rays.push_back(CastingRay(rays[i], 0.0, t_max[i]));
+		result[i] = false;
+	}
+	walk_stream(casting_rays.data(), count, [&](const kdFlatNode& node, const kdStreamEntry* entries, size_t entry_count) {
+		for (size_t j = 0; j < entry_count; j++) {
+			uint32_t ray = entries[j].ray;
+			CastingRay& casting_ray = casting_rays[ray];
+#ifdef LEAF_BLOCK_WIDTH
+			uint32_t end = node.first_block + (node.triangle_count() + LEAF_BLOCK_WIDTH - 1) / LEAF_BLOCK_WIDTH;
+			for (uint32_t i = node.first_block; i < end and not result[ray]; i++)
+				result[ray] = blocks[i].occludes(casting_ray);
+#else
+			const IntersectionRecord* leaf_records = &records[node.first_triangle];
+			for (uint32_t i = 0; i < node.triangle_count() and not result[ray]; i++)
+				result[ray] = leaf_records[i].occludes(casting_ray.ray, casting_ray.t_max);
+#endif
+			// A blocked ray is done, so pull its t_max in before any interval it has, which filters it out of the rest of the walk.
+			if (result[ray])
+				casting_ray.t_max = -1.0;
+		}
+	});
+}
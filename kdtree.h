@@ -3,19 +3,16 @@
 #ifndef _KDTREE_H
 #define _KDTREE_H
 
-#ifdef THREADED_KD_BUILD
-#include <pthread.h>
-#include <semaphore.h>
-#endif
-
+#include <stdint.h>
 #include <vector>
-#include <list>
 #include "utils.h"
-
-extern long long rays_cast;
+#include "accelerator.h"
 
 class kdTree;
+struct kdBuildContext;
 
+// Nodes in this pointer-linked form only exist while building, and are flattened into kdFlatNodes for traversal.
+// They live in the build's arenas, which are freed all at once when the build is done, so they have no destructor.
 class kdTreeNode {
 public:
 	// Depth is 0 for the root of the tree, and increments going down the tree.
@@ -26,62 +23,124 @@ public:
 	kdTreeNode* low_side;
 	kdTreeNode* high_side;
 	AABB aabb;
-	// Leaf nodes have is_leaf true, stored_triangle_count positive, and stored_triangles non-null.
-	// stored_triangles points to an array of triangles stored in the leaf.
+	// Leaf nodes have is_leaf true, stored_triangle_count positive, and stored_indices non-null.
+	// stored_indices points to an array of indices into all_triangles of the triangles stored in the leaf, within the build's lists.
 	bool is_leaf;
 	int stored_triangle_count;
-	Triangle* stored_triangles;
+	int* stored_indices;
 	// In contrast, total_triangles counts all the triangles in the tree from this node down.
 	int total_triangles;
 
-	void form_as_leaf_from(vector<int>* indices, vector<Triangle>* all_triangles);
+	void form_as_leaf_from(int* indices, int triangle_count);
 
 public:
-	kdTreeNode(kdTree* parent, int depth, vector<int>* sorted_indices_by_min[3], vector<int>* sorted_indices_by_max[3], vector<Triangle>* all_triangles);
-	~kdTreeNode();
-	void get_stats(int& deepest_depth, int& biggest_set);
-	bool ray_test(const CastingRay& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr) const;
+	// Builds the node over the triangles in the build's sorted lists in the given buffer from offset to offset + triangle_count.
+	kdTreeNode(kdBuildContext* context, int depth, int buffer, int offset, int triangle_count);
 };
 
-#ifdef THREADED_KD_BUILD
-struct JobDescriptor {
-	bool do_quit;
-	kdTreeNode** destination;
-	int depth;
-	vector<int>* sorted_indices_by_min[3];
-	vector<int>* sorted_indices_by_max[3];
+// Compact node used for traversal, stored depth-first in one contiguous array so that the low child of an interior node immediately follows it.
+// Rather than a full AABB we store only the extents of the two children along the split axis, because the
+// builder sends straddling triangles to the low side, so the children may overlap around the split height.
+struct kdFlatNode {
+	// The low two bits hold the split axis, or 3 for a leaf.
+	// The remaining bits hold the index of the high child for interior nodes, or the triangle count for leaves.
+	uint32_t flags;
+	union {
+		// clip[0] is the maximum of the low child along the split axis, and clip[1] is the minimum of the high child.
+		Real clip[2];
+		// Leaves store the index of their first triangle in kdTree::all_triangles (and kdTree::records), which hold each leaf's triangles contiguously.
+		uint32_t first_triangle;
+		// Or, when intersecting in SIMD blocks, the index of their first block in kdTree::blocks.
+		uint32_t first_block;
+	};
+
+	inline bool is_leaf() const { return (flags & 3) == 3; }
+	inline int split_axis() const { return flags & 3; }
+	inline uint32_t high_child() const { return flags >> 2; }
+	inline uint32_t triangle_count() const { return flags >> 2; }
 };
 
-struct BuildingThread {
-	pthread_t thread;
-	kdTree* tree;
+// A node still to be visited during traversal, along with the interval of the ray that lies within it.
+struct kdStackEntry {
+	uint32_t index;
+	Real t_enter, t_exit;
+};
 
-	void spawn_thread(kdTree* _tree);
-	static void* computation_thread_main(void* cookie);
+// A node still to be visited by a packet of rays, along with the interval of each ray of the packet that lies within it.
+// Rays that don't pass through the node have an empty interval (t_enter > t_exit).
+struct kdPacketStackEntry {
+	uint32_t index;
+	Real t_enter[RAY_PACKET_SIZE], t_exit[RAY_PACKET_SIZE];
 };
-#endif
 
-class kdTree {
-#ifdef THREADED_KD_BUILD
-	friend class BuildingThread;
-#endif
-	std::vector<Triangle>* all_triangles;
+// One ray of a stream that reaches a subtree, along with the interval of the ray that lies within it.
+struct kdStreamEntry {
+	uint32_t ray;
+	Real t_enter, t_exit;
+};
 
-public:
-	kdTreeNode* root;
-
-#ifdef THREADED_KD_BUILD
-	// The following data is used for synchronizing with the building threads.
-	sem_t job_available;
-	sem_t jobs_all_done;
-	pthread_mutex_t job_lock;
-	list<JobDescriptor> job_list;
-	int total_job_count;
+// A subtree still to be visited by a stream, with the rays that reach it, which are a range of the walk's list of entries.
+struct kdStreamFrame {
+	uint32_t index;
+	size_t begin, end;
+};
+
+struct kdPacket;
+class TaskScheduler;
+
+class kdTree : public Accelerator {
+	// NB: The tree reorders this array when it's built, so that every leaf's triangles form one contiguous range of it.
+	// This is nullptr if the tree was loaded from a scene cache rather than built.
+	std::vector<Triangle>* all_triangles;
+	// The triangles in that order, which is all that traversal needs.
+	AcceleratorArray<Triangle> triangles;
+	// The flattened tree, with the root at index 0.
+	AcceleratorArray<kdFlatNode> nodes;
+#ifdef LEAF_BLOCK_WIDTH
+	// Each leaf's triangles packed into consecutive blocks, with the last block of each leaf padded out.
+	AcceleratorArray<TriangleBlock> blocks;
+#else
+	// The intersection records of the triangles, in the same order. Traversal only reads these, and only touches the triangles to report the closest hit.
+	AcceleratorArray<IntersectionRecord> records;
 #endif
+	AABB bounds;
+	int deepest_depth, biggest_leaf;
+	// Wall clock seconds for the whole build, and for the presort at its start.
+	double build_time, presort_time;
+	// The estimated cost of casting a ray as of the last build, which refits compare against to decide when to rebuild.
+	Real build_cost;
+
+	// Builds the tree over all_triangles, reordering them, along with order if it's given.
+	void build(std::vector<int>* order);
+	// Refits every node to the triangles as they are now, returning the estimated cost of casting a ray.
+	Real refit_nodes(TaskScheduler* scheduler);
+	RefitResult refit_node(uint32_t index, TaskScheduler* scheduler, int depth);
+	// Fills in the build's six lists of triangle indices sorted by the minima and maxima of their AABBs along each axis.
+	void presort(kdBuildContext* context) const;
+	uint32_t flatten(const kdTreeNode* node, const AABB& region, int depth, std::vector<int>& triangle_order);
+	// Walks a packet of rays through the tree together, calling visit_leaf(node, active) on each leaf that any of them reach,
+	// where active[i] says whether ray i passes through the leaf. The walk stops early if visit_leaf returns true.
+	template <typename LeafVisitor>
+	void walk_packet(kdPacket& packet, LeafVisitor visit_leaf) const;
+	// Walks a stream of rays through the tree together, calling visit_leaf(node, entries, entry_count) on each leaf that any of them
+	// reach, with the entries of the rays that do. The rays' t_max are read at each node, so shrinking them culls the rest of the walk.
+	template <typename LeafVisitor>
+	void walk_stream(CastingRay* rays, int count, LeafVisitor visit_leaf) const;
 
+public:
 	kdTree(std::vector<Triangle>* all_triangles);
+	kdTree(SceneCacheReader& reader, const Triangle* triangles, size_t triangle_count);
 	~kdTree();
-	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr);
+	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle=nullptr, Real t_max=FLOAT_INF) const;
+	bool occluded(const Ray& ray, Real t_max) const;
+	void ray_test_packet(const Ray* rays, int count, PacketHits& hits, const Real* t_max=nullptr) const;
+	void occluded_packet(const Ray* rays, const Real* t_max, int count, bool* result) const;
+	void ray_test_stream(const Ray* rays, int count, RayHit* hits) const;
+	void occluded_stream(const Ray* rays, const Real* t_max, int count, bool* result) const;
+	bool refit(std::vector<int>* order=nullptr);
+	void get_stats(int& deepest_depth, int& biggest_set) const;
+	void print_stats() const;
+	bool save(SceneCacheWriter& writer) const;
 };
 
 #endif
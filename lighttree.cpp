@@ -0,0 +1,142 @@
+// Hierarchy over the lights, for picking the ones that matter at each point.
+
+using namespace std;
+#include <assert.h>
+#include <algorithm>
+#include <numeric>
+#include "lighttree.h"
+
+// Points closer than this to a cluster are treated as though they were this far away, so that a point right next to a light
+// doesn't make it soak up every sample. This is about the scale of the integrator's random offsets to the lights.
+#define LIGHT_TREE_MINIMUM_DISTANCE 0.2
+// LightGrid splits the scene into this many cells along each axis.
+#define LIGHT_GRID_RESOLUTION 8
+
+LightTree::LightTree(const vector<Light>& lights) {
+	if (lights.empty())
+		return;
+	vector<int> order(lights.size());
+	iota(order.begin(), order.end(), 0);
+	nodes.reserve(2 * lights.size() - 1);
+	build_node(order, 0, lights.size(), lights);
+}
+
+uint32_t LightTree::build_node(vector<int>& order, int begin, int end, const vector<Light>& lights) {
+	uint32_t index = nodes.size();
+	nodes.push_back(LightNode());
+	AABB bounds;
+	Real power = 0;
+	for (int i = begin; i < end; i++) {
+		bounds.update(lights[order[i]].position);
+		power += lights[order[i]].color.sum();
+	}
+	nodes[index].bounds = bounds;
+	nodes[index].power = power;
+	if (end - begin == 1) {
+		nodes[index].index = order[begin];
+		nodes[index].is_leaf = true;
+		return index;
+	}
+	// Split at the median along the longest axis, which keeps the tree balanced and the clusters compact.
+	int axis = bounds.longest_axis();
+	int middle = (begin + end) / 2;
+	nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b) {
+		return lights[a].position(axis) < lights[b].position(axis);
+	});
+	build_node(order, begin, middle, lights);
+	uint32_t second = build_node(order, middle, end, lights);
+	nodes[index].index = second;
+	nodes[index].is_leaf = false;
+	return index;
+}
+
+bool LightTree::empty() const {
+	return nodes.empty();
+}
+
+Real LightTree::importance(const LightNode& node, const Vec& point) const {
+	// The lights fall off with the square of distance, but any of the cluster's lights could be as close as the edge of its box,
+	// so we don't let the distance to the box's center count for less than half the box's diagonal.
+	Vec center = 0.5 * (node.bounds.minima + node.bounds.maxima);
+	Real radius_squared = 0.25 * (node.bounds.maxima - node.bounds.minima).squaredNorm();
+	Real distance_squared = real_max((point - center).squaredNorm(), radius_squared);
+	distance_squared = real_max(distance_squared, LIGHT_TREE_MINIMUM_DISTANCE * LIGHT_TREE_MINIMUM_DISTANCE);
+	return node.power / distance_squared;
+}
+
+int LightTree::sample(const Vec& point, Real u, Real& probability) const {
+	assert(not nodes.empty());
+	probability = 1;
+	uint32_t index = 0;
+	while (not nodes[index].is_leaf) {
+		const LightNode& low = nodes[index + 1];
+		const LightNode& high = nodes[nodes[index].index];
+		Real low_importance = importance(low, point), high_importance = importance(high, point);
+		Real total = low_importance + high_importance;
+		// If neither child has any power then neither matters, so just pick evenly.
+		Real low_probability = total > 0 ? low_importance / total : 0.5;
+		// We reuse the one sample all the way down, by rescaling the part of it that picked the child to cover [0, 1) again.
+		if (u < low_probability) {
+			u = u / low_probability;
+			probability *= low_probability;
+			index = index + 1;
+		} else {
+			u = (u - low_probability) / (1 - low_probability);
+			probability *= 1 - low_probability;
+			index = nodes[index].index;
+		}
+		// Rounding can push the rescaled sample up to one, which would always pick the high child from here on.
+		u = real_min(u, 0.99999994f);
+	}
+	return nodes[index].index;
+}
+
+LightGrid::LightGrid(const vector<Light>& lights, const AABB& _bounds) : bounds(_bounds) {
+	if (lights.empty())
+		return;
+	// With nothing to cover, a single cell around the lights will do.
+	if (bounds.minima(0) > bounds.maxima(0))
+		for (auto& light : lights)
+			bounds.update(light.position);
+	Vec extent = bounds.maxima - bounds.minima;
+	for (int axis = 0; axis < 3; axis++)
+		cells_per_unit(axis) = extent(axis) > 0 ? LIGHT_GRID_RESOLUTION / extent(axis) : 0;
+	// Weight the lights for each cell as LightTree weights a cluster for a point, with the roles swapped: any point in the cell could
+	// be as close to a light as the edge of the cell, so we don't let the distance to its center count for less than half its diagonal.
+	Vec cell_extent = extent / LIGHT_GRID_RESOLUTION;
+	Real radius_squared = real_max(0.25 * cell_extent.squaredNorm(), LIGHT_TREE_MINIMUM_DISTANCE * LIGHT_TREE_MINIMUM_DISTANCE);
+	vector<Real> weights(lights.size());
+	tables.reserve(LIGHT_GRID_RESOLUTION * LIGHT_GRID_RESOLUTION * LIGHT_GRID_RESOLUTION);
+	for (int z = 0; z < LIGHT_GRID_RESOLUTION; z++) {
+		for (int y = 0; y < LIGHT_GRID_RESOLUTION; y++) {
+			for (int x = 0; x < LIGHT_GRID_RESOLUTION; x++) {
+				Vec center = bounds.minima + cell_extent.cwiseProduct(Vec(x + 0.5, y + 0.5, z + 0.5));
+				for (int i = 0; i < (int)lights.size(); i++)
+					weights[i] = lights[i].color.sum() / real_max((lights[i].position - center).squaredNorm(), radius_squared);
+				tables.push_back(AliasTable(weights));
+			}
+		}
+	}
+}
+
+bool LightGrid::empty() const {
+	return tables.empty();
+}
+
+int LightGrid::cell(const Vec& point) const {
+	int index[3];
+	for (int axis = 0; axis < 3; axis++) {
+		Real offset = (point(axis) - bounds.minima(axis)) * cells_per_unit(axis);
+		index[axis] = offset < 0 ? 0 : offset >= LIGHT_GRID_RESOLUTION ? LIGHT_GRID_RESOLUTION - 1 : (int)offset;
+	}
+	return index[0] + LIGHT_GRID_RESOLUTION * (index[1] + LIGHT_GRID_RESOLUTION * index[2]);
+}
+
+int LightGrid::sample(const Vec& point, Real u, Real& probability) const {
+	assert(not tables.empty());
+	const AliasTable& table = tables[cell(point)];
+	int light = table.sample(u);
+	probability = table.probabilities[light];
+	return light;
+}
+
@@ -0,0 +1,62 @@
+// Hierarchy over the lights, for picking the ones that matter at each point.
+
+#ifndef _RENDER_LIGHTTREE_H
+#define _RENDER_LIGHTTREE_H
+
+#include <stdint.h>
+#include <vector>
+#include "utils.h"
+
+struct Light {
+	Vec position;
+	Color color;
+};
+
+// Each node bounds a cluster of lights, and adds up their power.
+struct LightNode {
+	AABB bounds;
+	Real power;
+	// For interior nodes this is the index of the second child, as the first immediately follows its parent.
+	// For leaves, which each hold one light, it's the index of the light.
+	uint32_t index;
+	bool is_leaf;
+};
+
+// A binary tree over the lights, which picks a light for a point by walking down from the root, going into each child with a
+// probability following how much light the child's cluster could send to the point. This picks lights in proportion to roughly
+// their contributions, in time that grows only with the log of the number of lights.
+class LightTree {
+	std::vector<LightNode> nodes;
+
+	uint32_t build_node(std::vector<int>& order, int begin, int end, const std::vector<Light>& lights);
+	// A guess at how much light from the node reaches the point, which is never zero for a node with any power.
+	Real importance(const LightNode& node, const Vec& point) const;
+
+public:
+	LightTree(const std::vector<Light>& lights=std::vector<Light>());
+	bool empty() const;
+	// Picks the index of a light for the point from a uniform sample in [0, 1), setting probability to the chance of picking it.
+	int sample(const Vec& point, Real u, Real& probability) const;
+};
+
+// A coarse grid over the scene, with an alias table for each cell that picks lights in proportion to roughly how much light they
+// could send to the cell. Building it takes time in the number of cells times the number of lights, but it then picks a light for
+// any point in constant time, from the table of the cell the point is in.
+class LightGrid {
+	AABB bounds;
+	// How many cells there are per unit of length along each axis, for finding the cell a point is in.
+	Vec cells_per_unit;
+	std::vector<AliasTable> tables;
+
+	int cell(const Vec& point) const;
+
+public:
+	// The grid covers the given bounds, which should cover everything that's shaded, as points outside use the nearest cell.
+	LightGrid(const std::vector<Light>& lights=std::vector<Light>(), const AABB& bounds=AABB());
+	bool empty() const;
+	// Likewise for LightTree::sample.
+	int sample(const Vec& point, Real u, Real& probability) const;
+};
+
+#endif
+
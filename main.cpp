@@ -7,8 +7,8 @@ using namespace std;
 #include "visualizer.h"
 
 int main(int argc, char** argv) {
-	// Load up an STL file.
-	auto scene = new Scene(argv[1]);
+	// Load up an STL file, using the scene cache directory given after it, if any.
+	auto scene = new Scene(argv[1], accelerator_names[0], argc > 2 ? argv[2] : "");
 	// Make a light.
 	scene->lights->push_back(Light({Vec(0, 0, 3), 9.0 * Vec(0.8, 0.5, 0.25)}));
 	scene->lights->push_back(Light({Vec(-2, 2, 4), 9.0 * Vec(0.25, 0.8, 0.25)}));
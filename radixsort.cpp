@@ -0,0 +1,93 @@
+// Parallel radix sort of indices by floating point keys.
+
+using namespace std;
+#include <string.h>
+#include <assert.h>
+#include "radixsort.h"
+#include "scheduler.h"
+
+// Each pass sorts by this many bits of the keys.
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+RadixKey radix_key(Real value) {
+	RadixKey bits;
+	memcpy(&bits, &value, sizeof(bits));
+	// Positive values already order correctly once the sign bit is set, to put them above the negatives.
+	// Negative values are stored as magnitudes, so they order backwards unless every bit is flipped.
+	RadixKey sign_bit = ((RadixKey)1) << (8 * sizeof(RadixKey) - 1);
+	return bits & sign_bit ? ~bits : bits | sign_bit;
+}
+
+void radix_sort(vector<RadixSortEntry>* lists, int list_count, TaskScheduler* scheduler, int chunk_count) {
+	// Each list and chunk of it is one piece of work, numbered list * chunk_count + chunk.
+	int piece_count = list_count * chunk_count;
+	auto piece_range = [&](int piece, int& begin, int& end) {
+		int size = lists[piece / chunk_count].size(), chunk = piece % chunk_count;
+		begin = (long long)size * chunk / chunk_count;
+		end = (long long)size * (chunk + 1) / chunk_count;
+	};
+	// Each pass moves the entries from one buffer to the other, so we need a second buffer per list.
+	vector<vector<RadixSortEntry>> scratch(list_count);
+	for_each_chunk(scheduler, list_count, list_count, [&](int list, int, int) {
+		scratch[list].resize(lists[list].size());
+	});
+	vector<RadixSortEntry*> sources(list_count), destinations(list_count);
+	for (int list = 0; list < list_count; list++) {
+		sources[list] = lists[list].data();
+		destinations[list] = scratch[list].data();
+	}
+	// The number of entries in each bucket for each piece, which then become where the piece puts its entries in that bucket.
+	vector<int> offsets(piece_count * RADIX_BUCKETS);
+	vector<bool> skip(list_count);
+	for (int shift = 0; shift < (int)(8 * sizeof(RadixKey)); shift += RADIX_BITS) {
+		for_each_chunk(scheduler, piece_count, piece_count, [&](int piece, int, int) {
+			int begin, end;
+			piece_range(piece, begin, end);
+			const RadixSortEntry* source = sources[piece / chunk_count];
+			int* counts = &offsets[piece * RADIX_BUCKETS];
+			fill(counts, counts + RADIX_BUCKETS, 0);
+			for (int i = begin; i < end; i++)
+				counts[(source[i].key >> shift) & (RADIX_BUCKETS - 1)]++;
+		});
+		// Each bucket's entries go after those of all lower buckets, and within a bucket each chunk's go after those of earlier chunks.
+		for (int list = 0; list < list_count; list++) {
+			int offset = 0;
+			skip[list] = false;
+			for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+				int bucket_start = offset;
+				for (int chunk = 0; chunk < chunk_count; chunk++) {
+					int& entry = offsets[(list * chunk_count + chunk) * RADIX_BUCKETS + bucket];
+					int count = entry;
+					entry = offset;
+					offset += count;
+				}
+				// If every key has the same digit then this pass wouldn't change the order, so the list sits it out.
+				// This is common for the top bits of keys, which all share a sign and similar exponents.
+				if (offset - bucket_start == (int)lists[list].size())
+					skip[list] = true;
+			}
+			assert(offset == (int)lists[list].size());
+		}
+		for_each_chunk(scheduler, piece_count, piece_count, [&](int piece, int, int) {
+			int list = piece / chunk_count;
+			if (skip[list])
+				return;
+			int begin, end;
+			piece_range(piece, begin, end);
+			const RadixSortEntry* source = sources[list];
+			RadixSortEntry* destination = destinations[list];
+			int* next = &offsets[piece * RADIX_BUCKETS];
+			for (int i = begin; i < end; i++)
+				destination[next[(source[i].key >> shift) & (RADIX_BUCKETS - 1)]++] = source[i];
+		});
+		for (int list = 0; list < list_count; list++)
+			if (not skip[list])
+				swap(sources[list], destinations[list]);
+	}
+	// Lists that finished up in their scratch buffer swap it in.
+	for (int list = 0; list < list_count; list++)
+		if (sources[list] != lists[list].data())
+			lists[list].swap(scratch[list]);
+}
+
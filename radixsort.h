@@ -0,0 +1,32 @@
+// Parallel radix sort of indices by floating point keys.
+
+#ifndef _RENDER_RADIXSORT_H
+#define _RENDER_RADIXSORT_H
+
+#include <stdint.h>
+#include <vector>
+#include "utils.h"
+
+class TaskScheduler;
+
+// Keys are Reals with their bits rearranged so that comparing them as unsigned integers orders them the same as the Reals.
+#ifdef DOUBLE_PRECISION
+typedef uint64_t RadixKey;
+#else
+typedef uint32_t RadixKey;
+#endif
+
+struct RadixSortEntry {
+	RadixKey key;
+	int index;
+};
+
+RadixKey radix_key(Real value);
+
+// Stably sorts each of the lists by key, all at once, in passes over a digit of the keys at a time from the lowest up.
+// Each list is cut into chunk_count chunks, which are spread across the scheduler's threads if it's given.
+// This keeps no state between calls, so any number of sorts can run at once.
+void radix_sort(std::vector<RadixSortEntry>* lists, int list_count, TaskScheduler* scheduler, int chunk_count);
+
+#endif
+
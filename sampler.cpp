@@ -0,0 +1,162 @@
+// Random number generation and sampling for the integrator.
+
+using namespace std;
+#include <math.h>
+#include "sampler.h"
+
+Xoshiro128::Xoshiro128(uint64_t seed) {
+	for (int i = 0; i < 4; i += 2) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z = z ^ (z >> 31);
+		state[i] = z;
+		state[i + 1] = z >> 32;
+	}
+}
+
+static inline uint32_t hash_bits(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline uint32_t hash_combine(uint32_t seed, uint32_t value) {
+	return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+static inline uint32_t reverse_bits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+	x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+	x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+	x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+	return x;
+}
+
+// A random permutation of the values that only ever changes a bit according to the bits below it, which applied to the reversed bits
+// of a point is exactly an Owen scramble: each bit of the point is flipped according to a hash of the bits above it.
+static inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x ^= x * 0x3d20adea;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56;
+	x ^= x * 0x53a22864;
+	return reverse_bits(x);
+}
+
+// The second dimension of the Sobol sequence XORs together a direction for each set bit of the index, so we precompute the XORs for
+// every value of each byte of the index, to take four lookups rather than a step per bit.
+struct SobolTable {
+	uint32_t byte_directions[4][256];
+
+	SobolTable() {
+		uint32_t directions[32];
+		directions[0] = 1u << 31;
+		for (int bit = 1; bit < 32; bit++)
+			directions[bit] = directions[bit - 1] ^ (directions[bit - 1] >> 1);
+		for (int byte = 0; byte < 4; byte++) {
+			for (int value = 0; value < 256; value++) {
+				byte_directions[byte][value] = 0;
+				for (int bit = 0; bit < 8; bit++)
+					if (value & (1 << bit))
+						byte_directions[byte][value] ^= directions[8 * byte + bit];
+			}
+		}
+	}
+};
+
+static const SobolTable sobol_table;
+
+// The first two dimensions of the Sobol sequence, as 32-bit fractions. (The first is just the van der Corput sequence.)
+static inline uint32_t sobol(uint32_t index, uint32_t dimension) {
+	if (dimension == 0)
+		return reverse_bits(index);
+	return sobol_table.byte_directions[0][index & 0xff] ^ sobol_table.byte_directions[1][(index >> 8) & 0xff] ^
+	       sobol_table.byte_directions[2][(index >> 16) & 0xff] ^ sobol_table.byte_directions[3][index >> 24];
+}
+
+Sampler::Sampler(uint64_t seed) : generator(seed), has_spare_gaussian(false), spare_gaussian(0), low_discrepancy(false), sample_seed(0), sample_index(0), dimension(0), pair_second_bits(0) {
+}
+
+void Sampler::set_low_discrepancy(bool enabled) {
+	low_discrepancy = enabled;
+	has_spare_gaussian = false;
+}
+
+void Sampler::start_sample(uint32_t pixel, uint32_t index, uint32_t stream) {
+	if (not low_discrepancy)
+		return;
+	sample_seed = hash_bits(hash_combine(hash_bits(pixel), stream));
+	sample_index = index;
+	dimension = 0;
+	// A spare Gaussian left over from another sample would tie the two samples together.
+	has_spare_gaussian = false;
+}
+
+uint32_t Sampler::low_discrepancy_bits() {
+	// We only ever reach an odd dimension by drawing the one before it, which works out both halves of the pair.
+	if (dimension++ & 1)
+		return pair_second_bits;
+	// Each pair of dimensions shuffles the order of the samples differently, so that the pairs are independent of each other, and then
+	// scrambles each of its two dimensions.
+	uint32_t pair_seed = hash_bits(hash_combine(sample_seed, dimension >> 1));
+	uint32_t index = owen_scramble(sample_index, pair_seed);
+	pair_second_bits = owen_scramble(sobol(index, 1), hash_bits(hash_combine(pair_seed, 2)));
+	return owen_scramble(sobol(index, 0), hash_bits(hash_combine(pair_seed, 1)));
+}
+
+void Sampler::uniform_pair(Real& u, Real& v) {
+	// Start on a fresh pair of dimensions, so that the two uniforms are stratified together.
+	if (low_discrepancy)
+		dimension += dimension & 1;
+	u = uniform();
+	v = uniform();
+}
+
+Real Sampler::gaussian() {
+	if (has_spare_gaussian) {
+		has_spare_gaussian = false;
+		return spare_gaussian;
+	}
+	// Box-Muller, which gives two independent normals from two uniforms. We keep 1 - u away from zero for the log.
+	Real u, v;
+	uniform_pair(u, v);
+	Real radius = real_sqrt(-2 * log(1 - u));
+	Real angle = 2 * M_PI * v;
+	spare_gaussian = radius * sin(angle);
+	has_spare_gaussian = true;
+	return radius * cos(angle);
+}
+
+Vec Sampler::disk() {
+	Real u, v;
+	uniform_pair(u, v);
+	Real radius = real_sqrt(u);
+	Real angle = 2 * M_PI * v;
+	return Vec(radius * cos(angle), radius * sin(angle), 0);
+}
+
+Vec Sampler::unit_sphere() {
+	// By Archimedes' hat-box theorem the height of a uniform point on the sphere is uniform, whatever its angle about the axis.
+	Real u, v;
+	uniform_pair(u, v);
+	Real z = 1 - 2 * u;
+	Real radius = real_sqrt(real_max(0.0, 1 - z * z));
+	Real angle = 2 * M_PI * v;
+	return Vec(radius * cos(angle), radius * sin(angle), z);
+}
+
+Vec Sampler::hemisphere() {
+	Real u, v;
+	uniform_pair(u, v);
+	Real z = u;
+	Real radius = real_sqrt(real_max(0.0, 1 - z * z));
+	Real angle = 2 * M_PI * v;
+	return Vec(radius * cos(angle), radius * sin(angle), z);
+}
+
@@ -0,0 +1,77 @@
+// Random number generation and sampling for the integrator.
+
+#ifndef _RENDER_SAMPLER_H
+#define _RENDER_SAMPLER_H
+
+#include <stdint.h>
+#include "utils.h"
+
+// A small fast generator (xoshiro128+), whose whole state is four 32-bit words, so that it's cheap to keep one per thread (or even
+// one per SIMD lane). Only the top bits of its output are used, which are the good ones for this generator.
+struct Xoshiro128 {
+	uint32_t state[4];
+
+	// Expands the seed into the state with splitmix64, as recommended, so that similar seeds give unrelated streams.
+	Xoshiro128(uint64_t seed=0);
+	inline uint32_t next() {
+		uint32_t result = state[0] + state[3];
+		uint32_t t = state[1] << 9;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = (state[3] << 11) | (state[3] >> 21);
+		return result;
+	}
+};
+
+// Draws the samples the integrator needs from one generator, with no distribution objects to construct along the way.
+// Each thread's integrator owns one of these, so no locking is needed.
+// With low discrepancy sampling on, draws instead come from the dimensions of the current sample, as set by start_sample. Each pair of
+// dimensions of a pixel is its own Owen scrambled 2D Sobol sequence over the pixel's samples (Burley, "Practical Hash-based Owen
+// Scrambling", 2020), so that over the samples each pair covers the unit square far more evenly than independent draws would.
+class Sampler {
+	Xoshiro128 generator;
+	// Gaussians come in pairs, so we keep the second of each pair for the next call.
+	bool has_spare_gaussian;
+	Real spare_gaussian;
+	bool low_discrepancy;
+	// The hash of the pixel and stream of the current sample, the sample's index among the pixel's samples, and the next dimension to draw.
+	uint32_t sample_seed, sample_index, dimension;
+	// The second half of the current pair of dimensions, worked out along with the first.
+	uint32_t pair_second_bits;
+
+	// The next dimension of the current sample.
+	uint32_t low_discrepancy_bits();
+	// Two uniforms, which with low discrepancy sampling on are the two halves of one pair of dimensions.
+	void uniform_pair(Real& u, Real& v);
+
+public:
+	Sampler(uint64_t seed=0);
+	void set_low_discrepancy(bool enabled);
+	// Starts drawing the dimensions of the pixel's sample with the given index, from the first dimension of the given stream.
+	// Separate parts of a sample (say, the camera ray and the rest of the path) can draw from separate streams, so that each part
+	// sees the same dimensions from sample to sample, whatever order the parts of different samples are drawn in.
+	// This does nothing unless low discrepancy sampling is on.
+	void start_sample(uint32_t pixel, uint32_t index, uint32_t stream);
+	// Uniform in [0, 1).
+	inline Real uniform() {
+		// The top 24 bits fill a float's mantissa exactly, so this can't round up to one.
+		return (next_bits() >> 8) * (Real)(1.0 / (1 << 24));
+	}
+	inline uint32_t next_bits() {
+		return low_discrepancy ? low_discrepancy_bits() : generator.next();
+	}
+	// Standard normal.
+	Real gaussian();
+	// Uniform on the unit disk in the xy plane.
+	Vec disk();
+	// Uniform on the unit sphere.
+	Vec unit_sphere();
+	// Uniform on the half of the unit sphere with z >= 0.
+	Vec hemisphere();
+};
+
+#endif
+
@@ -0,0 +1,159 @@
+// On-disk cache of preprocessed scenes, mapped straight back into memory.
+
+using namespace std;
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <iomanip>
+#include "scenecache.h"
+#include "kdtree.h"
+#include "bvh.h"
+
+static const char scene_cache_magic[8] = {'R', 'N', 'D', 'R', 'S', 'C', 'N', 0};
+
+// The sizes of everything we store, which is what a cache from another build configuration would disagree on.
+static uint32_t layout_fingerprint() {
+	uint64_t sizes[] = {
+		sizeof(Real), sizeof(Triangle), sizeof(IntersectionRecord), sizeof(kdFlatNode), sizeof(WideBVHNode),
+#ifdef LEAF_BLOCK_WIDTH
+		LEAF_BLOCK_WIDTH, sizeof(TriangleBlock),
+#endif
+	};
+	uint32_t fingerprint = 2166136261u;
+	for (uint64_t size : sizes)
+		fingerprint = (fingerprint ^ (uint32_t)size) * 16777619u;
+	return fingerprint;
+}
+
+SceneCacheWriter::SceneCacheWriter(FILE* fp) : fp(fp), offset(ftell(fp)), failed(false) {
+}
+
+void SceneCacheWriter::write(const void* data, size_t bytes) {
+	static const char padding[SCENE_CACHE_ALIGNMENT] = {0};
+	uint64_t size = bytes;
+	failed |= fwrite(&size, sizeof(size), 1, fp) != 1;
+	offset += sizeof(size);
+	size_t padding_bytes = (SCENE_CACHE_ALIGNMENT - offset % SCENE_CACHE_ALIGNMENT) % SCENE_CACHE_ALIGNMENT;
+	failed |= fwrite(padding, 1, padding_bytes, fp) != padding_bytes;
+	failed |= fwrite(data, 1, bytes, fp) != bytes;
+	offset += padding_bytes + bytes;
+}
+
+bool SceneCacheWriter::ok() const {
+	return not failed;
+}
+
+uint64_t SceneCacheWriter::file_bytes() const {
+	return offset;
+}
+
+SceneCacheReader::SceneCacheReader(const char* begin, const char* end) : next(begin), end(end) {
+}
+
+const char* SceneCacheReader::read(size_t& bytes) {
+	// The file size in the header has already been checked, so running off the end means the sections were read back wrong.
+	assert(next + sizeof(uint64_t) <= end);
+	uint64_t size;
+	memcpy(&size, next, sizeof(size));
+	next += sizeof(size);
+	next += (SCENE_CACHE_ALIGNMENT - (uintptr_t)next % SCENE_CACHE_ALIGNMENT) % SCENE_CACHE_ALIGNMENT;
+	assert(next + size <= end);
+	const char* data = next;
+	next += size;
+	bytes = size;
+	return data;
+}
+
+MappedSceneCache::MappedSceneCache(void* mapping, size_t bytes) : mapping(mapping), bytes(bytes) {
+}
+
+MappedSceneCache::~MappedSceneCache() {
+	munmap(mapping, bytes);
+}
+
+MappedSceneCache* MappedSceneCache::open(const string& path, uint64_t content_hash, const string& accelerator_name) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return nullptr;
+	struct stat info;
+	void* mapping = MAP_FAILED;
+	if (fstat(fd, &info) == 0 and (size_t)info.st_size >= sizeof(SceneCacheHeader))
+		mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping stays valid after the file is closed.
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return nullptr;
+	auto cache = new MappedSceneCache(mapping, info.st_size);
+	const SceneCacheHeader* header = (const SceneCacheHeader*)mapping;
+	bool valid = memcmp(header->magic, scene_cache_magic, sizeof(scene_cache_magic)) == 0 and
+		header->version == SCENE_CACHE_VERSION and
+		header->layout == layout_fingerprint() and
+		header->content_hash == content_hash and
+		header->file_bytes == (uint64_t)info.st_size and
+		strncmp(header->accelerator_name, accelerator_name.c_str(), sizeof(header->accelerator_name)) == 0;
+	if (not valid) {
+		delete cache;
+		return nullptr;
+	}
+	return cache;
+}
+
+SceneCacheReader MappedSceneCache::reader() const {
+	const char* begin = (const char*)mapping;
+	return SceneCacheReader(begin + sizeof(SceneCacheHeader), begin + bytes);
+}
+
+bool hash_file_contents(const string& path, uint64_t& hash) {
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (fp == NULL)
+		return false;
+	hash = 14695981039346656037ull;
+	vector<unsigned char> buffer(1 << 16);
+	size_t count;
+	while ((count = fread(buffer.data(), 1, buffer.size(), fp)) > 0)
+		for (size_t i = 0; i < count; i++)
+			hash = (hash ^ buffer[i]) * 1099511628211ull;
+	bool ok = not ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+string scene_cache_path(const string& directory, uint64_t content_hash, const string& accelerator_name) {
+	stringstream path;
+	path << directory << "/" << hex << setw(16) << setfill('0') << content_hash << "-" << accelerator_name << ".scene";
+	return path.str();
+}
+
+bool write_scene_cache(const string& path, uint64_t content_hash, const string& accelerator_name, const vector<Triangle>& triangles, const Accelerator& accelerator) {
+	if (accelerator_name.size() >= sizeof(SceneCacheHeader().accelerator_name))
+		return false;
+	stringstream temporary_path;
+	temporary_path << path << ".tmp" << getpid();
+	FILE* fp = fopen(temporary_path.str().c_str(), "wb");
+	if (fp == NULL)
+		return false;
+	// We write the header last, once we know how big the file came out.
+	SceneCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	SceneCacheWriter writer(fp);
+	writer.write_array(triangles);
+	ok = accelerator.save(writer) and ok;
+	memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+	header.version = SCENE_CACHE_VERSION;
+	header.layout = layout_fingerprint();
+	header.content_hash = content_hash;
+	header.file_bytes = writer.file_bytes();
+	strcpy(header.accelerator_name, accelerator_name.c_str());
+	ok = ok and writer.ok() and fseek(fp, 0, SEEK_SET) == 0 and fwrite(&header, sizeof(header), 1, fp) == 1;
+	ok = fclose(fp) == 0 and ok;
+	if (ok)
+		ok = rename(temporary_path.str().c_str(), path.c_str()) == 0;
+	if (not ok)
+		remove(temporary_path.str().c_str());
+	return ok;
+}
+
@@ -0,0 +1,110 @@
+// On-disk cache of preprocessed scenes, mapped straight back into memory.
+
+#ifndef _RENDER_SCENECACHE_H
+#define _RENDER_SCENECACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "accelerator.h"
+
+// Bump this whenever anything changes what gets written, so stale caches are rebuilt rather than misread.
+#define SCENE_CACHE_VERSION 4
+// Every section starts on a multiple of this within the file, so the arrays are suitably aligned in the mapping.
+#define SCENE_CACHE_ALIGNMENT 64
+
+// The file is this header, followed by a sequence of sections, each of which is a uint64_t byte count, padding, and then the bytes.
+// Readers get the sections back in the order they were written, so there's no table of contents.
+struct SceneCacheHeader {
+	char magic[8];
+	uint32_t version;
+	// Fingerprints the sizes of the structures stored, which depend on build options such as DOUBLE_PRECISION and SIMD_LEAVES.
+	uint32_t layout;
+	uint64_t content_hash;
+	uint64_t file_bytes;
+	char accelerator_name[32];
+};
+
+class SceneCacheWriter {
+	FILE* fp;
+	uint64_t offset;
+	bool failed;
+
+public:
+	// Writes sections from the file's current position on.
+	SceneCacheWriter(FILE* fp);
+	void write(const void* data, size_t bytes);
+	// Whether every write so far has succeeded.
+	bool ok() const;
+	// The size of the file once the last section written is in it.
+	uint64_t file_bytes() const;
+
+	template <typename T>
+	void write_array(const AcceleratorArray<T>& array) {
+		write(array.data(), array.size() * sizeof(T));
+	}
+	template <typename T>
+	void write_array(const std::vector<T>& array) {
+		write(array.data(), array.size() * sizeof(T));
+	}
+	template <typename T>
+	void write_value(const T& value) {
+		write(&value, sizeof(T));
+	}
+};
+
+class SceneCacheReader {
+	const char* next;
+	const char* end;
+
+public:
+	SceneCacheReader(const char* begin, const char* end);
+	// Returns a pointer to the next section's bytes, which stay in the mapping rather than being copied.
+	const char* read(size_t& bytes);
+
+	template <typename T>
+	void read_array(AcceleratorArray<T>& array) {
+		size_t bytes;
+		const char* data = read(bytes);
+		assert(bytes % sizeof(T) == 0);
+		array.refer_to((const T*)data, bytes / sizeof(T));
+	}
+	template <typename T>
+	void read_value(T& value) {
+		size_t bytes;
+		const char* data = read(bytes);
+		assert(bytes == sizeof(T));
+		value = *(const T*)data;
+	}
+};
+
+// A scene cache file mapped read only into memory, which a scene's triangles and accelerator then refer into.
+class MappedSceneCache {
+	void* mapping;
+	size_t bytes;
+
+	MappedSceneCache(void* mapping, size_t bytes);
+
+public:
+	~MappedSceneCache();
+	// Maps the cache at the path, returning nullptr if there's no such file, or if it was written for different input
+	// contents, a different accelerator, a different build configuration, or an older version of the format.
+	static MappedSceneCache* open(const std::string& path, uint64_t content_hash, const std::string& accelerator_name);
+	// Reads the sections that follow the header.
+	SceneCacheReader reader() const;
+};
+
+// Hashes the contents of the file with 64-bit FNV-1a, returning false if it can't be read.
+bool hash_file_contents(const std::string& path, uint64_t& hash);
+// The cache file for the given input contents and accelerator in the directory.
+std::string scene_cache_path(const std::string& directory, uint64_t content_hash, const std::string& accelerator_name);
+// Writes the triangles (in the order the accelerator refers to them) followed by the accelerator itself, returning false on failure,
+// including when the accelerator can't be cached.
+// The file is written under a temporary name and then renamed into place, so readers never map a partly written cache.
+bool write_scene_cache(const std::string& path, uint64_t content_hash, const std::string& accelerator_name, const std::vector<Triangle>& triangles, const Accelerator& accelerator);
+
+#endif
+
@@ -0,0 +1,199 @@
+// Work-stealing task scheduler for parallel builds.
+
+using namespace std;
+#include <assert.h>
+#include "scheduler.h"
+
+// The worker and task currently running on this thread, if any.
+static thread_local SchedulerWorker* current_worker = nullptr;
+static thread_local SchedulerTask* current_task = nullptr;
+
+SchedulerTask::SchedulerTask(function<void()> work, SchedulerTask* parent, atomic<bool>* finished_flag) : work(work), parent(parent), pending(1), finished_flag(finished_flag) {
+}
+
+void* SchedulerWorker::worker_thread_main(void* cookie) {
+	SchedulerWorker* self = (SchedulerWorker*) cookie;
+	TaskScheduler* scheduler = self->scheduler;
+	current_worker = self;
+	while (not scheduler->quitting) {
+		SchedulerTask* task = scheduler->find_task(self);
+		if (task != nullptr)
+			scheduler->execute(task);
+		else
+			scheduler->wait_for_work(scheduler->quitting);
+	}
+	return nullptr;
+}
+
+TaskScheduler::TaskScheduler(int thread_count) : queued_tasks(0), sleeping_workers(0), root_finished(false), quitting(false) {
+	assert(thread_count >= 1);
+	pthread_mutex_init(&sleep_lock, nullptr);
+	pthread_cond_init(&wake, nullptr);
+	// Worker 0 is whichever thread calls run(), so it doesn't get a thread of its own.
+	for (int i = 0; i < thread_count; i++) {
+		auto worker = new SchedulerWorker();
+		worker->scheduler = this;
+		worker->index = i;
+		pthread_mutex_init(&worker->lock, nullptr);
+		workers.push_back(worker);
+	}
+	for (int i = 1; i < thread_count; i++)
+		pthread_create(&workers[i]->thread, nullptr, SchedulerWorker::worker_thread_main, (void*)workers[i]);
+}
+
+TaskScheduler::~TaskScheduler() {
+	quitting = true;
+	wake_workers(true);
+	for (int i = 1; i < (int)workers.size(); i++)
+		pthread_join(workers[i]->thread, nullptr);
+	for (auto worker : workers) {
+		assert(worker->tasks.empty());
+		pthread_mutex_destroy(&worker->lock);
+		delete worker;
+	}
+	pthread_mutex_destroy(&sleep_lock);
+	pthread_cond_destroy(&wake);
+}
+
+int TaskScheduler::thread_count() const {
+	return workers.size();
+}
+
+int TaskScheduler::worker_index() const {
+	assert(current_worker != nullptr and current_worker->scheduler == this);
+	return current_worker->index;
+}
+
+SchedulerTask* TaskScheduler::find_task(SchedulerWorker* worker) {
+	// Try our own deque first, taking the task we most recently pushed.
+	SchedulerTask* task = nullptr;
+	pthread_mutex_lock(&worker->lock);
+	if (not worker->tasks.empty()) {
+		task = worker->tasks.back();
+		worker->tasks.pop_back();
+	}
+	pthread_mutex_unlock(&worker->lock);
+	// Otherwise go around the other workers, stealing the oldest task of the first one that has any.
+	for (int offset = 1; task == nullptr and offset < (int)workers.size() and queued_tasks > 0; offset++) {
+		SchedulerWorker* victim = workers[(worker->index + offset) % workers.size()];
+		pthread_mutex_lock(&victim->lock);
+		if (not victim->tasks.empty()) {
+			task = victim->tasks.front();
+			victim->tasks.pop_front();
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	if (task != nullptr)
+		queued_tasks--;
+	return task;
+}
+
+void TaskScheduler::execute(SchedulerTask* task) {
+	SchedulerTask* previous_task = current_task;
+	current_task = task;
+	if (task->work)
+		task->work();
+	current_task = previous_task;
+	finish(task);
+}
+
+void TaskScheduler::finish(SchedulerTask* task) {
+	// Each task that finishes is one less pending child for its parent, which may in turn finish its parent, and so on.
+	while (task != nullptr and --task->pending == 0) {
+		SchedulerTask* parent = task->parent;
+		atomic<bool>* finished_flag = task->finished_flag;
+		delete task;
+		if (finished_flag != nullptr) {
+			// Someone is waiting on this task (in run or parallel_for), so wake them up to return.
+			*finished_flag = true;
+			wake_workers(true);
+		}
+		task = parent;
+	}
+}
+
+void TaskScheduler::wait_for_work(const atomic<bool>& flag) {
+	pthread_mutex_lock(&sleep_lock);
+	// NB: Whoever queues a task increments queued_tasks before checking sleeping_workers, while we do the reverse here, so
+	// either they see that we're asleep and wake us, or we see their task and don't sleep.
+	sleeping_workers++;
+	while (queued_tasks == 0 and not flag and not quitting)
+		pthread_cond_wait(&wake, &sleep_lock);
+	sleeping_workers--;
+	pthread_mutex_unlock(&sleep_lock);
+}
+
+void TaskScheduler::wake_workers(bool everyone) {
+	if (sleeping_workers == 0 and not everyone)
+		return;
+	pthread_mutex_lock(&sleep_lock);
+	if (everyone)
+		pthread_cond_broadcast(&wake);
+	else
+		pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&sleep_lock);
+}
+
+void TaskScheduler::run(function<void()> root) {
+	// Act as worker 0 for the duration, remembering what this thread was doing before in case we're nested inside another scheduler.
+	SchedulerWorker* previous_worker = current_worker;
+	SchedulerTask* previous_task = current_task;
+	current_worker = workers[0];
+	current_task = nullptr;
+	root_finished = false;
+	execute(new SchedulerTask(root, nullptr, &root_finished));
+	// The root's work has run, but it may have spawned children that are still going, so help out until they're done.
+	help_until(root_finished);
+	current_worker = previous_worker;
+	current_task = previous_task;
+}
+
+void TaskScheduler::help_until(const atomic<bool>& flag) {
+	while (not flag) {
+		SchedulerTask* task = find_task(current_worker);
+		if (task != nullptr)
+			execute(task);
+		else
+			wait_for_work(flag);
+	}
+}
+
+void TaskScheduler::spawn(function<void()> work) {
+	assert(current_task != nullptr and current_worker != nullptr and current_worker->scheduler == this);
+	current_task->pending++;
+	auto task = new SchedulerTask(work, current_task);
+	pthread_mutex_lock(&current_worker->lock);
+	current_worker->tasks.push_back(task);
+	pthread_mutex_unlock(&current_worker->lock);
+	queued_tasks++;
+	wake_workers(false);
+}
+
+void TaskScheduler::parallel_for(int begin, int end, int chunk_count, function<void(int, int, int)> body) {
+	assert(current_task != nullptr and current_worker != nullptr and current_worker->scheduler == this);
+	// The chunks are spawned as children of a group task of their own, rather than of the current task, so we can wait for just them.
+	atomic<bool> finished(false);
+	auto group = new SchedulerTask(nullptr, nullptr, &finished);
+	SchedulerTask* previous_task = current_task;
+	current_task = group;
+	for (int chunk = 1; chunk < chunk_count; chunk++) {
+		int chunk_begin = begin + (long long)(end - begin) * chunk / chunk_count;
+		int chunk_end = begin + (long long)(end - begin) * (chunk + 1) / chunk_count;
+		spawn([=]() { body(chunk, chunk_begin, chunk_end); });
+	}
+	current_task = previous_task;
+	// Do the first chunk ourselves, then count the group's own work as done, and help out until the rest of the chunks are done too.
+	body(0, begin, begin + (long long)(end - begin) / chunk_count);
+	finish(group);
+	help_until(finished);
+}
+
+void for_each_chunk(TaskScheduler* scheduler, int count, int chunk_count, const function<void(int, int, int)>& body) {
+	if (scheduler != nullptr) {
+		scheduler->parallel_for(0, count, chunk_count, body);
+		return;
+	}
+	for (int chunk = 0; chunk < chunk_count; chunk++)
+		body(chunk, (long long)count * chunk / chunk_count, (long long)count * (chunk + 1) / chunk_count);
+}
+
@@ -0,0 +1,86 @@
+// Work-stealing task scheduler for parallel builds.
+
+#ifndef _RENDER_SCHEDULER_H
+#define _RENDER_SCHEDULER_H
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+
+class TaskScheduler;
+
+// A task finishes once its own work has run and all the children it spawned have finished, at which point it counts as
+// a finished child of its own parent. Thus there's no global count of outstanding work: finishing propagates up the tree of tasks.
+struct SchedulerTask {
+	std::function<void()> work;
+	SchedulerTask* parent;
+	// One for the task's own work, plus one for each unfinished child.
+	std::atomic<int> pending;
+	// For tasks without a parent, this flag gets set when the task finishes.
+	std::atomic<bool>* finished_flag;
+
+	SchedulerTask(std::function<void()> work, SchedulerTask* parent, std::atomic<bool>* finished_flag=nullptr);
+};
+
+// Each worker owns a deque of tasks. It pushes and pops at the back, so it works depth first on what it just spawned,
+// while idle workers steal from the front, where the oldest (and so usually biggest) tasks are.
+struct SchedulerWorker {
+	pthread_t thread;
+	TaskScheduler* scheduler;
+	int index;
+	pthread_mutex_t lock;
+	std::deque<SchedulerTask*> tasks;
+
+	static void* worker_thread_main(void* cookie);
+};
+
+// Each scheduler has its own threads, so any number of them can run at once (e.g. building several trees in parallel).
+class TaskScheduler {
+	friend struct SchedulerWorker;
+	std::vector<SchedulerWorker*> workers;
+	// The number of tasks sitting in all the deques, used to decide when there's no point looking for work.
+	std::atomic<int> queued_tasks;
+	std::atomic<int> sleeping_workers;
+	std::atomic<bool> root_finished;
+	std::atomic<bool> quitting;
+	// Idle workers sleep on this until there's something to steal.
+	pthread_mutex_t sleep_lock;
+	pthread_cond_t wake;
+
+	SchedulerTask* find_task(SchedulerWorker* worker);
+	void execute(SchedulerTask* task);
+	void finish(SchedulerTask* task);
+	// Sleeps until there may be work to find, or until the given flag is set.
+	void wait_for_work(const std::atomic<bool>& flag);
+	void wake_workers(bool everyone);
+	// Works on tasks until the flag gets set.
+	void help_until(const std::atomic<bool>& flag);
+
+public:
+	// The calling thread of run() counts as one of the threads, so this spawns thread_count - 1 more.
+	TaskScheduler(int thread_count);
+	~TaskScheduler();
+	int thread_count() const;
+	// The index, from 0 to thread_count() - 1, of the worker running on this thread, which lets tasks keep per-thread state.
+	// May only be called from within a task running on this scheduler.
+	int worker_index() const;
+	// Runs the task, and every task it spawns, returning once they have all finished.
+	// The calling thread works on the tasks too, rather than idling.
+	void run(std::function<void()> root);
+	// Spawns a child of the task currently running on this thread.
+	// May only be called from within a task running on this scheduler.
+	void spawn(std::function<void()> work);
+	// Splits [begin, end) into chunk_count nearly equal chunks, and calls body(chunk, chunk_begin, chunk_end) on each in parallel,
+	// returning once they've all been done. While waiting, this thread works on whatever tasks it can find.
+	// May only be called from within a task running on this scheduler.
+	void parallel_for(int begin, int end, int chunk_count, std::function<void(int, int, int)> body);
+};
+
+// Calls body(chunk, chunk_begin, chunk_end) on each of chunk_count nearly equal chunks of [0, count), spreading them across the
+// scheduler's threads (with parallel_for) if we're given one, or otherwise just doing them in turn.
+void for_each_chunk(TaskScheduler* scheduler, int count, int chunk_count, const std::function<void(int, int, int)>& body);
+
+#endif
+
@@ -3,11 +3,16 @@
 #include <math.h>
 #include <sys/time.h>
 #include "utils.h"
+#ifdef LEAF_BLOCK_WIDTH
+#include <immintrin.h>
+#endif
 
 #define EPSILON 1e-8
+#define MINIMUM_RAY_DELTA 1e-20
 
 using namespace std;
 #include <iostream>
+#include <algorithm>
 #include <thread>
 
 long long triangle_tests;
@@ -26,10 +31,20 @@ Real Ray::distance_along_ray(Vec p) const {
 	return direction.dot(p - origin);
 }
 
-CastingRay::CastingRay(const Ray& _ray) {
+CastingRay::CastingRay() {
+}
+
+CastingRay::CastingRay(const Ray& _ray, Real t_min, Real t_max) : t_min(t_min), t_max(t_max) {
 	ray = _ray;
-	for (int i = 0; i < 3; i++)
-		recip_deltas(i) = 1.0 / ray.direction(i);
+	// A zero component of the direction would give an infinite reciprocal, which -ffast-math doesn't promise to handle (comparisons
+	// against it get folded away), and slab tests would compute 0 * inf = NaN for rays lying in a box's face. So we clamp tiny components
+	// away from zero, keeping their sign, with zero of either sign going positive. This only moves slab crossings to beyond 1e20.
+	for (int i = 0; i < 3; i++) {
+		Real delta = ray.direction(i);
+		if (real_abs(delta) < MINIMUM_RAY_DELTA)
+			delta = delta < 0 ? -MINIMUM_RAY_DELTA : MINIMUM_RAY_DELTA;
+		recip_deltas(i) = 1.0 / delta;
+	}
 }
 
 AABB::AABB() {
@@ -57,12 +72,17 @@ void AABB::update(const AABB& other) {
 	cout << v(0) << ", " << v(1) << ", " << v(2) << "\n\n";
 
 bool AABB::does_ray_intersect(const CastingRay& ray) const {
+	Real t_start, t_end;
+	return ray_interval(ray, t_start, t_end);
+}
+
+bool AABB::ray_interval(const CastingRay& ray, Real& t_start, Real& t_end) const {
 	Vec t0 = (minima - ray.ray.origin).array() * ray.recip_deltas.array();
 	Vec t1 = (maxima - ray.ray.origin).array() * ray.recip_deltas.array();
 	Vec entrance_times = vec_min(t0, t1);
 	Vec exit_times = vec_max(t0, t1);
-	Real t_start = real_max(entrance_times(0), real_max(entrance_times(1), entrance_times(2)));
-	Real t_end   = real_min(exit_times(0), real_min(exit_times(1), exit_times(2)));
+	t_start = real_max(ray.t_min, real_max(entrance_times(0), real_max(entrance_times(1), entrance_times(2))));
+	t_end   = real_min(ray.t_max, real_min(exit_times(0), real_min(exit_times(1), exit_times(2))));
 /*
 	cout << "=== AABB check ===" << endl;
 	PRINT_VEC(ray.ray.origin)
@@ -72,16 +92,18 @@ bool AABB::does_ray_intersect(const CastingRay& ray) const {
 	PRINT_VEC(t0)
 	PRINT_VEC(t1)
 */
-	// The box is behind us.
-	if (t_end < 0)
-		return false;
-	// The box is missed.
+	// The box is missed, or lies entirely outside the live interval.
 	if (t_start > t_end)
 		return false;
 	// Otherwise we're golden.
 	return true;
 }
 
+Real AABB::surface_area() const {
+	Vec lengths = maxima - minima;
+	return 2 * (lengths(0) * lengths(1) + lengths(1) * lengths(2) + lengths(2) * lengths(0));
+}
+
 void AABB::surface_areas_on_sides_of_split_axis(int axis, Real height, Real& sa_low, Real& sa_high) const {
 	// Compute the perimeter and area of the face normal to `axis`.
 	Real perimeter = 0.0;
@@ -134,24 +156,42 @@ void Triangle::set_normals(Vec n0, Vec n1, Vec n2) {
 	v_normal = n2 - n0;
 }
 
+// The scalar and SIMD intersection tests are written to do the same arithmetic in the same order, so that they give identical hits.
+// -ffast-math would let the compiler rearrange each of them differently, so as would FMA contraction, so we hold both to strict floating point semantics.
+#pragma GCC push_options
+#pragma GCC optimize("no-unsafe-math-optimizations")
+
+// The dot products in the intersection test are summed in this fixed order, which TriangleBlock's kernel mirrors.
+static inline Real ordered_dot(const Vec& a, const Vec& b) {
+	return (a(0) * b(0) + a(1) * b(1)) + a(2) * b(2);
+}
+
 // Performs M\"oller-Trumbore intersection as per Wikipedia.
-bool Triangle::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle) const {
-//	triangle_tests++;
+// This returns the ray parameter and barycentric coordinates of the hit with the triangle's plane, and whether it lands inside the triangle.
+static inline bool moller_trumbore(const Vec& vertex, const Vec& edge01, const Vec& edge02, const Ray& ray, Real& t, Real& u, Real& v) {
+#ifdef TRAVERSAL_STATS
+	triangle_tests++;
+#endif
 	Vec P = ray.direction.cross(edge02);
-	Real det = edge01.dot(P);
+	Real det = ordered_dot(edge01, P);
 	if (det > -EPSILON and det < EPSILON)
 		return false;
 	Real inv_det = 1.0 / det;
-	Vec T = ray.origin - points[0];
-	Real u = T.dot(P) * inv_det;
+	Vec T = ray.origin - vertex;
+	u = ordered_dot(T, P) * inv_det;
 	if (u < 0 or u > 1)
 		return false;
 	Vec Q = T.cross(edge01);
-	Real v = ray.direction.dot(Q) * inv_det;
+	v = ordered_dot(ray.direction, Q) * inv_det;
 	if (v < 0 or u + v > 1)
 		return false;
-	Real t = edge02.dot(Q) * inv_det;
-	if (t <= EPSILON)
+	t = ordered_dot(edge02, Q) * inv_det;
+	return true;
+}
+
+bool Triangle::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle) const {
+	Real t, u, v;
+	if (not moller_trumbore(points[0], edge01, edge02, ray, t, u, v) or t <= EPSILON)
 		return false;
 	// In this case t is the parameter on the ray of the hit.
 	hit_parameter = t;
@@ -162,6 +202,163 @@ bool Triangle::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real&
 	return true;
 }
 
+bool Triangle::occludes(const Ray& ray, Real t_max) const {
+	Real t, u, v;
+	return moller_trumbore(points[0], edge01, edge02, ray, t, u, v) and EPSILON < t and t < t_max;
+}
+
+IntersectionRecord Triangle::intersection_record() const {
+	return IntersectionRecord(points[0], edge01, edge02);
+}
+
+IntersectionRecord::IntersectionRecord() {
+}
+
+IntersectionRecord::IntersectionRecord(const Vec& vertex, const Vec& edge01, const Vec& edge02) : vertex(vertex), edge01(edge01), edge02(edge02) {
+}
+
+bool IntersectionRecord::ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v) const {
+	Real t, u, v;
+	if (not moller_trumbore(vertex, edge01, edge02, ray, t, u, v) or t <= EPSILON)
+		return false;
+	hit_parameter = t;
+	hit_u = u;
+	hit_v = v;
+	return true;
+}
+
+bool IntersectionRecord::occludes(const Ray& ray, Real t_max) const {
+	Real t, u, v;
+	return moller_trumbore(vertex, edge01, edge02, ray, t, u, v) and EPSILON < t and t < t_max;
+}
+
+#ifdef LEAF_BLOCK_WIDTH
+// Thin wrappers so that the block kernel reads the same at either width.
+#if LEAF_BLOCK_WIDTH == 8
+typedef __m256 simd_float;
+static inline simd_float simd_set(float x) { return _mm256_set1_ps(x); }
+static inline simd_float simd_load(const float* p) { return _mm256_loadu_ps(p); }
+static inline void simd_store(float* p, simd_float x) { _mm256_storeu_ps(p, x); }
+static inline simd_float simd_add(simd_float a, simd_float b) { return _mm256_add_ps(a, b); }
+static inline simd_float simd_sub(simd_float a, simd_float b) { return _mm256_sub_ps(a, b); }
+static inline simd_float simd_mul(simd_float a, simd_float b) { return _mm256_mul_ps(a, b); }
+static inline simd_float simd_div(simd_float a, simd_float b) { return _mm256_div_ps(a, b); }
+static inline simd_float simd_and(simd_float a, simd_float b) { return _mm256_and_ps(a, b); }
+static inline simd_float simd_or(simd_float a, simd_float b) { return _mm256_or_ps(a, b); }
+static inline simd_float simd_less(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline simd_float simd_less_equal(simd_float a, simd_float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline int simd_mask(simd_float x) { return _mm256_movemask_ps(x); }
+#else
+typedef __m128 simd_float;
+static inline simd_float simd_set(float x) { return _mm_set1_ps(x); }
+static inline simd_float simd_load(const float* p) { return _mm_loadu_ps(p); }
+static inline void simd_store(float* p, simd_float x) { _mm_storeu_ps(p, x); }
+static inline simd_float simd_add(simd_float a, simd_float b) { return _mm_add_ps(a, b); }
+static inline simd_float simd_sub(simd_float a, simd_float b) { return _mm_sub_ps(a, b); }
+static inline simd_float simd_mul(simd_float a, simd_float b) { return _mm_mul_ps(a, b); }
+static inline simd_float simd_div(simd_float a, simd_float b) { return _mm_div_ps(a, b); }
+static inline simd_float simd_and(simd_float a, simd_float b) { return _mm_and_ps(a, b); }
+static inline simd_float simd_or(simd_float a, simd_float b) { return _mm_or_ps(a, b); }
+static inline simd_float simd_less(simd_float a, simd_float b) { return _mm_cmplt_ps(a, b); }
+static inline simd_float simd_less_equal(simd_float a, simd_float b) { return _mm_cmple_ps(a, b); }
+static inline int simd_mask(simd_float x) { return _mm_movemask_ps(x); }
+#endif
+
+TriangleBlock::TriangleBlock() {
+	for (int axis = 0; axis < 3; axis++) {
+		for (int lane = 0; lane < LEAF_BLOCK_WIDTH; lane++) {
+			vertex[axis][lane] = 0;
+			edge01[axis][lane] = 0;
+			edge02[axis][lane] = 0;
+		}
+	}
+	for (int lane = 0; lane < LEAF_BLOCK_WIDTH; lane++)
+		triangle_index[lane] = 0;
+}
+
+void TriangleBlock::set_lane(int lane, const IntersectionRecord& record, uint32_t index) {
+	for (int axis = 0; axis < 3; axis++) {
+		vertex[axis][lane] = record.vertex(axis);
+		edge01[axis][lane] = record.edge01(axis);
+		edge02[axis][lane] = record.edge02(axis);
+	}
+	triangle_index[lane] = index;
+}
+
+// Performs the same M\"oller-Trumbore test as moller_trumbore on every lane at once, with the arithmetic in the same order, so each lane
+// agrees bit for bit with the scalar test. Returns the mask of lanes hit with EPSILON < t < t_max, and fills in t, u and v for every lane.
+static inline int block_moller_trumbore(const TriangleBlock& block, const Ray& ray, Real t_max, float* t_out, float* u_out, float* v_out) {
+#ifdef TRAVERSAL_STATS
+	// We count every lane, padding included, because that's the work being done.
+	triangle_tests += LEAF_BLOCK_WIDTH;
+#endif
+	simd_float e1[3], e2[3];
+	for (int axis = 0; axis < 3; axis++) {
+		e1[axis] = simd_load(block.edge01[axis]);
+		e2[axis] = simd_load(block.edge02[axis]);
+	}
+	simd_float d[3] = {simd_set(ray.direction(0)), simd_set(ray.direction(1)), simd_set(ray.direction(2))};
+	// P = direction x edge02
+	simd_float P[3] = {
+		simd_sub(simd_mul(d[1], e2[2]), simd_mul(d[2], e2[1])),
+		simd_sub(simd_mul(d[2], e2[0]), simd_mul(d[0], e2[2])),
+		simd_sub(simd_mul(d[0], e2[1]), simd_mul(d[1], e2[0])),
+	};
+	simd_float det = simd_add(simd_add(simd_mul(e1[0], P[0]), simd_mul(e1[1], P[1])), simd_mul(e1[2], P[2]));
+	simd_float epsilon = simd_set(EPSILON);
+	simd_float zero = simd_set(0), one = simd_set(1);
+	// Lanes stay live while none of the scalar test's rejections apply, starting with a det too close to zero.
+	simd_float live = simd_or(simd_less_equal(det, simd_set(-EPSILON)), simd_less_equal(epsilon, det));
+	simd_float inv_det = simd_div(one, det);
+	simd_float T[3];
+	for (int axis = 0; axis < 3; axis++)
+		T[axis] = simd_sub(simd_set(ray.origin(axis)), simd_load(block.vertex[axis]));
+	simd_float u = simd_mul(simd_add(simd_add(simd_mul(T[0], P[0]), simd_mul(T[1], P[1])), simd_mul(T[2], P[2])), inv_det);
+	live = simd_and(live, simd_and(simd_less_equal(zero, u), simd_less_equal(u, one)));
+	// Q = T x edge01
+	simd_float Q[3] = {
+		simd_sub(simd_mul(T[1], e1[2]), simd_mul(T[2], e1[1])),
+		simd_sub(simd_mul(T[2], e1[0]), simd_mul(T[0], e1[2])),
+		simd_sub(simd_mul(T[0], e1[1]), simd_mul(T[1], e1[0])),
+	};
+	simd_float v = simd_mul(simd_add(simd_add(simd_mul(d[0], Q[0]), simd_mul(d[1], Q[1])), simd_mul(d[2], Q[2])), inv_det);
+	live = simd_and(live, simd_and(simd_less_equal(zero, v), simd_less_equal(simd_add(u, v), one)));
+	simd_float t = simd_mul(simd_add(simd_add(simd_mul(e2[0], Q[0]), simd_mul(e2[1], Q[1])), simd_mul(e2[2], Q[2])), inv_det);
+	live = simd_and(live, simd_and(simd_less(epsilon, t), simd_less(t, simd_set(t_max))));
+	simd_store(t_out, t);
+	simd_store(u_out, u);
+	simd_store(v_out, v);
+	return simd_mask(live);
+}
+
+int TriangleBlock::ray_test(const CastingRay& ray, Real& hit_parameter, Real& hit_u, Real& hit_v) const {
+	float t[LEAF_BLOCK_WIDTH], u[LEAF_BLOCK_WIDTH], v[LEAF_BLOCK_WIDTH];
+	int hits = block_moller_trumbore(*this, ray.ray, ray.t_max, t, u, v);
+	// Reduce the mask to the closest hit, walking the lanes in order so that ties go to the lowest one.
+	int best_lane = -1;
+	for (; hits != 0; hits &= hits - 1) {
+		int lane = __builtin_ctz(hits);
+		if (t[lane] < ray.t_min)
+			continue;
+		if (best_lane == -1 or t[lane] < t[best_lane])
+			best_lane = lane;
+	}
+	if (best_lane != -1) {
+		hit_parameter = t[best_lane];
+		hit_u = u[best_lane];
+		hit_v = v[best_lane];
+	}
+	return best_lane;
+}
+
+bool TriangleBlock::occludes(const CastingRay& ray) const {
+	float t[LEAF_BLOCK_WIDTH], u[LEAF_BLOCK_WIDTH], v[LEAF_BLOCK_WIDTH];
+	return block_moller_trumbore(*this, ray.ray, ray.t_max, t, u, v) != 0;
+}
+#endif
+
+#pragma GCC pop_options
+
 Vec Triangle::project_point_to_given_altitude(Vec point, Real desired_altitude) const {
 	Real parameter = normal.dot(point);
 	Real plane_parameter = (normal.dot(points[0]) + normal.dot(points[1]) + normal.dot(points[2])) / 3.0;
@@ -170,18 +367,107 @@ Vec Triangle::project_point_to_given_altitude(Vec point, Real desired_altitude)
 }
 
 bool Triangle::intersects_axis_aligned_plane(int axis, Real plane_height) const {
-	assert(false); // TODO: Implement this.
-	return true;
+	// A triangle is convex, so it crosses the plane exactly when it has corners strictly on both sides.
+	return aabb.minima(axis) < plane_height and plane_height < aabb.maxima(axis);
+}
+
+AABB Triangle::clipped_bounds(const AABB& box) const {
+	// We clip the triangle to each face of the box in turn (Sutherland-Hodgman), each of which adds at most one corner to the polygon.
+	Vec polygons[2][9];
+	int count = 3;
+	for (int i = 0; i < 3; i++)
+		polygons[0][i] = points[i];
+	int current = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		for (int side = 0; side < 2; side++) {
+			Real plane_height = side == 0 ? box.minima(axis) : box.maxima(axis);
+			// What's left of the triangle is inside it, so faces that don't cut the triangle leave all of it or none of it.
+			if (not intersects_axis_aligned_plane(axis, plane_height)) {
+				if (side == 0 ? aabb.maxima(axis) < plane_height : aabb.minima(axis) > plane_height)
+					return AABB();
+				continue;
+			}
+			const Vec* polygon = polygons[current];
+			Vec* clipped = polygons[current ^ 1];
+			int clipped_count = 0;
+			for (int i = 0; i < count; i++) {
+				const Vec& from = polygon[i];
+				const Vec& to = polygon[(i + 1) % count];
+				bool from_inside = side == 0 ? from(axis) >= plane_height : from(axis) <= plane_height;
+				bool to_inside = side == 0 ? to(axis) >= plane_height : to(axis) <= plane_height;
+				if (from_inside)
+					clipped[clipped_count++] = from;
+				if (from_inside != to_inside) {
+					Vec crossing = from + (to - from) * ((plane_height - from(axis)) / (to(axis) - from(axis)));
+					crossing(axis) = plane_height;
+					clipped[clipped_count++] = crossing;
+				}
+			}
+			current ^= 1;
+			count = clipped_count;
+			if (count == 0)
+				return AABB();
+		}
+	}
+	AABB bounds;
+	for (int i = 0; i < count; i++)
+		bounds.update(polygons[current][i]);
+	// Rounding in the crossings can leave them a hair outside the box, which is all the box can grow by.
+	for (int axis = 0; axis < 3; axis++) {
+		bounds.minima(axis) = max(bounds.minima(axis), box.minima(axis));
+		bounds.maxima(axis) = min(bounds.maxima(axis), box.maxima(axis));
+	}
+	return bounds;
+}
+
+AliasTable::AliasTable(const vector<Real>& weights) {
+	int count = weights.size();
+	double total = 0;
+	for (Real weight : weights)
+		total += weight;
+	thresholds.resize(count);
+	aliases.resize(count);
+	probabilities.resize(count);
+	// Scale the weights so that they average one, and then split the slots into those with too little weight and those with too much.
+	vector<double> scaled(count);
+	vector<int> small, large;
+	for (int i = 0; i < count; i++) {
+		probabilities[i] = total > 0 ? weights[i] / total : 1.0 / count;
+		scaled[i] = probabilities[i] * count;
+		(scaled[i] < 1 ? small : large).push_back(i);
+	}
+	// Each slot with too little weight is topped up by one with too much, which may then have too little itself.
+	while (not small.empty() and not large.empty()) {
+		int low = small.back(), high = large.back();
+		small.pop_back();
+		thresholds[low] = scaled[low];
+		aliases[low] = high;
+		scaled[high] -= 1 - scaled[low];
+		if (scaled[high] < 1) {
+			large.pop_back();
+			small.push_back(high);
+		}
+	}
+	// Whatever is left over is only off from one by rounding.
+	for (int i : small) {
+		thresholds[i] = 1;
+		aliases[i] = i;
+	}
+	for (int i : large) {
+		thresholds[i] = 1;
+		aliases[i] = i;
+	}
+}
+
+int AliasTable::size() const {
+	return thresholds.size();
 }
 
-Vec sample_unit_sphere(mt19937& engine) {
-	// I experimentally determined that instantiating this object costs about as much as actually drawing from the distribution once.
-	// Thus, I could get maybe a 33% performance improvement by hoisting this out of the loop by moving this distribution into the Integrator object.
-	normal_distribution<> dist(0, 1);
-	// Technically this next line leaves the evaluation order unspecified, so a seeded render could render differently on different compiled binaries for different platforms. For now I don't care.
-	Vec samples(dist(engine), dist(engine), dist(engine));
-	samples.normalize();
-	return samples;
+int AliasTable::sample(Real u) const {
+	int count = thresholds.size();
+	Real scaled = u * count;
+	int slot = min(count - 1, (int)scaled);
+	return scaled - slot < thresholds[slot] ? slot : aliases[slot];
 }
 
 bool thread_count_is_overridden = false;
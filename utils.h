@@ -3,8 +3,9 @@
 #ifndef _RENDER_UTILS_H
 #define _RENDER_UTILS_H
 
+#include <stdint.h>
 #include <string>
-#include <random>
+#include <vector>
 #include <Eigen/Dense>
 
 #define FLOAT_INF (1e100)
@@ -73,8 +74,12 @@ struct Ray {
 struct CastingRay {
 	Vec recip_deltas;
 	Ray ray;
+	// Only the interval [t_min, t_max] of the ray is live. Box tests clip against it, and traversal shrinks t_max as hits are found.
+	Real t_min, t_max;
 
-	CastingRay(const Ray& ray);
+	// Leaves everything unset, for arrays of rays that get filled in later.
+	CastingRay();
+	CastingRay(const Ray& ray, Real t_min=0.0, Real t_max=FLOAT_INF);
 };
 
 struct AABB {
@@ -87,10 +92,53 @@ struct AABB {
 	void update(Vec p);
 	void update(const AABB& other);
 	bool does_ray_intersect(const CastingRay& ray) const;
+	// Computes the interval of ray parameters spent inside the box, clipped to the ray's live interval, returning false if this is empty.
+	bool ray_interval(const CastingRay& ray, Real& t_start, Real& t_end) const;
+	Real surface_area() const;
 	void surface_areas_on_sides_of_split_axis(int axis, Real height, Real& sa_low, Real& sa_high) const;
 	int longest_axis() const;
 };
 
+// Just the part of a triangle that the intersection test reads, kept apart from the shading data so that traversal can stream through
+// a dense array of these without pulling in cache lines it never uses. Shading data is then looked up by index after the closest hit.
+struct IntersectionRecord {
+	Vec vertex;
+	Vec edge01, edge02;
+
+	IntersectionRecord();
+	IntersectionRecord(const Vec& vertex, const Vec& edge01, const Vec& edge02);
+	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v) const;
+	bool occludes(const Ray& ray, Real t_max) const;
+};
+
+// With SIMD_LEAVES set we intersect leaf triangles a block at a time, eight wide if AVX is available and four wide with SSE otherwise.
+// The kernels work in single precision, so double precision builds always use the scalar IntersectionRecord path.
+#if defined(SIMD_LEAVES) and not defined(DOUBLE_PRECISION)
+#ifdef __AVX__
+#define LEAF_BLOCK_WIDTH 8
+#else
+#define LEAF_BLOCK_WIDTH 4
+#endif
+
+// The intersection records of up to LEAF_BLOCK_WIDTH triangles, stored as a structure of arrays so that one test covers the whole block.
+// Unused lanes hold a degenerate triangle, which never reports a hit.
+struct TriangleBlock {
+	float vertex[3][LEAF_BLOCK_WIDTH];
+	float edge01[3][LEAF_BLOCK_WIDTH];
+	float edge02[3][LEAF_BLOCK_WIDTH];
+	// The index into the tree's triangle array of the triangle in each lane, so we can find the full triangle for a hit.
+	uint32_t triangle_index[LEAF_BLOCK_WIDTH];
+
+	TriangleBlock();
+	void set_lane(int lane, const IntersectionRecord& record, uint32_t index);
+	// Finds the closest hit in the block within the ray's live interval, returning its lane, or -1 if there's no hit.
+	// The hits are exactly those that IntersectionRecord::ray_test would give, and ties go to the lowest lane, as they do when testing in order.
+	int ray_test(const CastingRay& ray, Real& hit_parameter, Real& hit_u, Real& hit_v) const;
+	// Checks if any triangle in the block blocks the ray before ray.t_max.
+	bool occludes(const CastingRay& ray) const;
+};
+#endif
+
 struct Triangle {
 	Vec points[3];
 	Vec edge01, edge02;
@@ -108,11 +156,30 @@ struct Triangle {
 	Triangle(Vec p0, Vec p1, Vec p2);
 	void set_normals(Vec n0, Vec n1, Vec n2);
 	bool ray_test(const Ray& ray, Real& hit_parameter, Real& hit_u, Real& hit_v, const Triangle** hit_triangle) const;
+	// Checks only whether the ray hits the triangle with a parameter below t_max, without reporting anything about the hit.
+	bool occludes(const Ray& ray, Real t_max) const;
 	Vec project_point_to_given_altitude(Vec point, Real desired_altitude) const;
+	// Checks if the plane cuts through the triangle, with corners strictly on both sides of it.
 	bool intersects_axis_aligned_plane(int axis, Real plane_height) const;
+	// The bounds of the part of the triangle inside the box, which is an invalid AABB if none of it is.
+	AABB clipped_bounds(const AABB& box) const;
+	IntersectionRecord intersection_record() const;
 };
 
-Vec sample_unit_sphere(std::mt19937& engine);
+// Picks indices with probabilities in proportion to a list of weights, in constant time however many there are (Vose's alias method).
+// Each index has a slot, which it takes with the slot's threshold probability, and otherwise hands over to the slot's alias.
+struct AliasTable {
+	std::vector<Real> thresholds;
+	std::vector<int> aliases;
+	// The probability of picking each index.
+	std::vector<Real> probabilities;
+
+	// The weights must be non-negative. If they're all zero then every index is equally likely.
+	AliasTable(const std::vector<Real>& weights=std::vector<Real>());
+	int size() const;
+	// Picks an index from a uniform sample in [0, 1).
+	int sample(Real u) const;
+};
 
 void override_thread_count(int thread_count);
 int get_optimal_thread_count();